@@ -0,0 +1,197 @@
+#include "arena.h"
+#include <gmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// size classes of 2^ARENA_MIN_SHIFT to 2^(ARENA_MIN_SHIFT + ARENA_CLASSES - 1)
+// bytes, header included; anything bigger is a plain malloc
+#define ARENA_MIN_SHIFT 5
+#define ARENA_CLASSES   13
+
+// bytes of freed blocks a thread keeps before handing them back to free
+#define ARENA_CACHE_BYTES (4 << 20)
+
+// precedes every block, keeping the payload 16-byte aligned like malloc's
+#define ARENA_HEADER 16
+#define ARENA_LARGE  ARENA_CLASSES
+
+typedef struct arena_cache {
+    void *free[ARENA_CLASSES]; // freed blocks, linked through their first word
+    size_t bytes; // bytes on the free lists
+    // written only by the owning thread, read by arena_stats_get
+    atomic_uint_least64_t requests, mallocs, cached;
+    struct arena_cache *next;
+} arena_cache;
+
+static _Thread_local arena_cache *cache = NULL;
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key; // runs cache_exit when a thread with a cache ends
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static arena_cache *live = NULL; // caches of running threads
+static arena_stats retired; // counters of exited threads
+static bool caching; // false to send every block to malloc, only counting
+
+// relaxed increment by the only writer, so no locked instruction is needed
+static void bump(atomic_uint_least64_t *x, int64_t by) {
+    atomic_store_explicit(
+        x, atomic_load_explicit(x, memory_order_relaxed) + by, memory_order_relaxed);
+}
+
+static void *sys_alloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) {
+        fprintf(stderr, "arena: out of memory\n");
+        abort();
+    }
+    return p;
+}
+
+// hands a thread's free blocks back to malloc and files its counters when it ends
+static void cache_exit(void *arg) {
+    arena_cache *c = (arena_cache *) arg;
+
+    for (int i = 0; i < ARENA_CLASSES; i++) {
+        while (c->free[i] != NULL) {
+            void *b = c->free[i];
+            c->free[i] = *(void **) b;
+            free(b);
+        }
+    }
+
+    pthread_mutex_lock(&arena_lock);
+    arena_cache **link = &live;
+    while (*link != c)
+        link = &(*link)->next;
+    *link = c->next;
+    retired.requests += atomic_load(&c->requests);
+    retired.mallocs += atomic_load(&c->mallocs);
+    pthread_mutex_unlock(&arena_lock);
+    free(c);
+
+    // anything GMP frees later on this thread starts a new cache
+    cache = NULL;
+}
+
+static void arena_setup(void) {
+    pthread_key_create(&arena_key, cache_exit);
+}
+
+static arena_cache *cache_get(void) {
+    if (cache != NULL)
+        return cache;
+
+    pthread_once(&arena_once, arena_setup);
+    arena_cache *c = (arena_cache *) calloc(1, sizeof(arena_cache));
+    pthread_setspecific(arena_key, c);
+
+    pthread_mutex_lock(&arena_lock);
+    c->next = live;
+    live = c;
+    pthread_mutex_unlock(&arena_lock);
+    return cache = c;
+}
+
+// smallest class holding bytes, or ARENA_LARGE
+static int class_of(size_t bytes) {
+    if (caching == false)
+        return ARENA_LARGE;
+
+    int cls = 0;
+    while (cls < ARENA_CLASSES && ((size_t) 1 << (cls + ARENA_MIN_SHIFT)) < bytes)
+        cls++;
+    return cls;
+}
+
+// a block of the class, with its header filled in; counts the malloc if there is one
+static void *block_get(arena_cache *c, int cls, size_t bytes) {
+    uint8_t *b;
+
+    if (cls < ARENA_CLASSES && c->free[cls] != NULL) {
+        b = (uint8_t *) c->free[cls];
+        c->free[cls] = *(void **) b;
+        c->bytes -= (size_t) 1 << (cls + ARENA_MIN_SHIFT);
+        bump(&c->cached, -1);
+    } else {
+        b = (uint8_t *) sys_alloc(cls < ARENA_CLASSES ? (size_t) 1 << (cls + ARENA_MIN_SHIFT) : bytes);
+        bump(&c->mallocs, 1);
+    }
+
+    *(int *) b = cls;
+    return b + ARENA_HEADER;
+}
+
+static void block_put(arena_cache *c, void *ptr) {
+    uint8_t *b = (uint8_t *) ptr - ARENA_HEADER;
+    int cls = *(int *) b;
+    size_t size = (size_t) 1 << (cls + ARENA_MIN_SHIFT);
+
+    if (cls == ARENA_LARGE || c->bytes + size > ARENA_CACHE_BYTES) {
+        free(b);
+        return;
+    }
+
+    *(void **) b = c->free[cls];
+    c->free[cls] = b;
+    c->bytes += size;
+    bump(&c->cached, 1);
+}
+
+static void *arena_alloc(size_t size) {
+    arena_cache *c = cache_get();
+    bump(&c->requests, 1);
+    return block_get(c, class_of(size + ARENA_HEADER), size + ARENA_HEADER);
+}
+
+static void *arena_realloc(void *ptr, size_t old_size, size_t new_size) {
+    arena_cache *c = cache_get();
+    bump(&c->requests, 1);
+
+    uint8_t *b = (uint8_t *) ptr - ARENA_HEADER;
+    int cls = *(int *) b;
+    int new_cls = class_of(new_size + ARENA_HEADER);
+
+    // still fits the block it has
+    if (cls < ARENA_CLASSES && new_cls <= cls)
+        return ptr;
+
+    if (cls == ARENA_LARGE && new_cls == ARENA_LARGE) {
+        b = (uint8_t *) realloc(b, new_size + ARENA_HEADER);
+        if (b == NULL) {
+            fprintf(stderr, "arena: out of memory\n");
+            abort();
+        }
+        bump(&c->mallocs, 1);
+        return b + ARENA_HEADER;
+    }
+
+    void *p = block_get(c, new_cls, new_size + ARENA_HEADER);
+    memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+    block_put(c, ptr);
+    return p;
+}
+
+static void arena_free(void *ptr, size_t size) {
+    (void) size;
+    block_put(cache_get(), ptr);
+}
+
+void arena_install(bool cache) {
+    caching = cache;
+    mp_set_memory_functions(arena_alloc, arena_realloc, arena_free);
+}
+
+void arena_stats_get(arena_stats *stats) {
+    pthread_mutex_lock(&arena_lock);
+    *stats = retired;
+    for (arena_cache *c = live; c != NULL; c = c->next) {
+        stats->requests += atomic_load_explicit(&c->requests, memory_order_relaxed);
+        stats->mallocs += atomic_load_explicit(&c->mallocs, memory_order_relaxed);
+        stats->cached += atomic_load_explicit(&c->cached, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&arena_lock);
+}
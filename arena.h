@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Per-thread caches of freed GMP limb buffers, installed as GMP's memory
+// functions. Blocks are rounded up to power-of-two size classes and a
+// freed block goes onto the freeing thread's list for its class, so once a
+// thread has run one block or prime candidate, the temporaries of the next
+// ones are served from its lists without taking malloc's locks, and an mpz_t
+// that grows within its class is reallocated in place. Big blocks and
+// blocks beyond a thread's cache limit go straight to malloc and free.
+//
+typedef struct {
+    uint64_t requests; // allocations and reallocations GMP asked for
+    uint64_t mallocs; // requests that had to call malloc or realloc
+    uint64_t cached; // blocks held in the caches
+} arena_stats;
+
+//
+// Makes GMP allocate through the caches.
+//
+// Requires:
+//  cache: false to only count, passing every block straight to malloc
+//  no mpz_t initialized yet, since blocks from malloc can't be freed into
+//  the caches
+//
+void arena_install(bool cache);
+
+//
+// Counters summed over every thread, including threads that have exited.
+// Requests minus mallocs is the number of allocations avoided.
+//
+void arena_stats_get(arena_stats *stats);
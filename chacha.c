@@ -0,0 +1,295 @@
+#include "chacha.h"
+#include <string.h>
+
+static uint32_t load32(const uint8_t *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16)
+           | ((uint32_t) p[3] << 24);
+}
+
+static void store32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+    p[2] = (uint8_t) (v >> 16);
+    p[3] = (uint8_t) (v >> 24);
+}
+
+static void store64(uint8_t *p, uint64_t v) {
+    store32(p, (uint32_t) v);
+    store32(p + 4, (uint32_t) (v >> 32));
+}
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d)                                                                        \
+    do {                                                                                           \
+        a += b;                                                                                    \
+        d = ROTL(d ^ a, 16);                                                                       \
+        c += d;                                                                                    \
+        b = ROTL(b ^ c, 12);                                                                       \
+        a += b;                                                                                    \
+        d = ROTL(d ^ a, 8);                                                                        \
+        c += d;                                                                                    \
+        b = ROTL(b ^ c, 7);                                                                        \
+    } while (0)
+
+// one 64-byte keystream block for the given input state
+static void chacha20_block(uint8_t out[64], const uint32_t in[16]) {
+    uint32_t x[16];
+    memcpy(x, in, sizeof(x));
+
+    // 20 rounds: alternating column and diagonal rounds
+    for (int i = 0; i < 10; i++) {
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++)
+        store32(out + 4 * i, x[i] + in[i]);
+}
+
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t len, const uint8_t key[CHACHA_KEY_BYTES],
+    const uint8_t nonce[CHACHA_NONCE_BYTES], uint32_t counter) {
+    uint32_t st[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 }; // "expand 32-byte k"
+    for (int i = 0; i < 8; i++)
+        st[4 + i] = load32(key + 4 * i);
+    st[12] = counter;
+    for (int i = 0; i < 3; i++)
+        st[13 + i] = load32(nonce + 4 * i);
+
+    uint8_t ks[64];
+    while (len > 0) {
+        chacha20_block(ks, st);
+        st[12]++;
+
+        size_t n = len < 64 ? len : 64;
+        for (size_t i = 0; i < n; i++)
+            out[i] = in[i] ^ ks[i];
+
+        out += n;
+        in += n;
+        len -= n;
+    }
+}
+
+// poly1305 with 26-bit limbs, so every product fits in 64 bits
+typedef struct {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+    uint8_t buf[16];
+    size_t buffered;
+} poly1305_ctx;
+
+static void poly1305_init(poly1305_ctx *st, const uint8_t key[32]) {
+    // r is clamped as the spec requires
+    st->r[0] = load32(key + 0) & 0x3ffffff;
+    st->r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+    st->r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+    st->r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+    st->r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+
+    for (int i = 0; i < 5; i++)
+        st->h[i] = 0;
+    for (int i = 0; i < 4; i++)
+        st->pad[i] = load32(key + 16 + 4 * i);
+    st->buffered = 0;
+}
+
+// absorbs whole 16-byte blocks; hibit is 2^128 for full blocks, 0 for the padded last one
+static void poly1305_blocks(poly1305_ctx *st, const uint8_t *m, size_t len, uint32_t hibit) {
+    const uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+
+    while (len >= 16) {
+        h0 += load32(m + 0) & 0x3ffffff;
+        h1 += (load32(m + 3) >> 2) & 0x3ffffff;
+        h2 += (load32(m + 6) >> 4) & 0x3ffffff;
+        h3 += (load32(m + 9) >> 6) & 0x3ffffff;
+        h4 += (load32(m + 12) >> 8) | hibit;
+
+        // h *= r mod 2^130 - 5
+        uint64_t d0 = (uint64_t) h0 * r0 + (uint64_t) h1 * s4 + (uint64_t) h2 * s3
+                      + (uint64_t) h3 * s2 + (uint64_t) h4 * s1;
+        uint64_t d1 = (uint64_t) h0 * r1 + (uint64_t) h1 * r0 + (uint64_t) h2 * s4
+                      + (uint64_t) h3 * s3 + (uint64_t) h4 * s2;
+        uint64_t d2 = (uint64_t) h0 * r2 + (uint64_t) h1 * r1 + (uint64_t) h2 * r0
+                      + (uint64_t) h3 * s4 + (uint64_t) h4 * s3;
+        uint64_t d3 = (uint64_t) h0 * r3 + (uint64_t) h1 * r2 + (uint64_t) h2 * r1
+                      + (uint64_t) h3 * r0 + (uint64_t) h4 * s4;
+        uint64_t d4 = (uint64_t) h0 * r4 + (uint64_t) h1 * r3 + (uint64_t) h2 * r2
+                      + (uint64_t) h3 * r1 + (uint64_t) h4 * r0;
+
+        // partial carry
+        uint32_t c = (uint32_t) (d0 >> 26);
+        h0 = (uint32_t) d0 & 0x3ffffff;
+        d1 += c;
+        c = (uint32_t) (d1 >> 26);
+        h1 = (uint32_t) d1 & 0x3ffffff;
+        d2 += c;
+        c = (uint32_t) (d2 >> 26);
+        h2 = (uint32_t) d2 & 0x3ffffff;
+        d3 += c;
+        c = (uint32_t) (d3 >> 26);
+        h3 = (uint32_t) d3 & 0x3ffffff;
+        d4 += c;
+        c = (uint32_t) (d4 >> 26);
+        h4 = (uint32_t) d4 & 0x3ffffff;
+        h0 += c * 5;
+        c = h0 >> 26;
+        h0 &= 0x3ffffff;
+        h1 += c;
+
+        m += 16;
+        len -= 16;
+    }
+
+    st->h[0] = h0;
+    st->h[1] = h1;
+    st->h[2] = h2;
+    st->h[3] = h3;
+    st->h[4] = h4;
+}
+
+static void poly1305_update(poly1305_ctx *st, const uint8_t *m, size_t len) {
+    if (st->buffered > 0) {
+        size_t n = 16 - st->buffered < len ? 16 - st->buffered : len;
+        memcpy(st->buf + st->buffered, m, n);
+        st->buffered += n;
+        m += n;
+        len -= n;
+        if (st->buffered < 16)
+            return;
+        poly1305_blocks(st, st->buf, 16, 1 << 24);
+        st->buffered = 0;
+    }
+
+    size_t whole = len & ~(size_t) 15;
+    poly1305_blocks(st, m, whole, 1 << 24);
+    memcpy(st->buf, m + whole, len - whole);
+    st->buffered = len - whole;
+}
+
+static void poly1305_finish(poly1305_ctx *st, uint8_t tag[16]) {
+    // a short last block is padded with a 1 byte and zeros instead of the 2^128 bit
+    if (st->buffered > 0) {
+        st->buf[st->buffered] = 1;
+        memset(st->buf + st->buffered + 1, 0, 15 - st->buffered);
+        poly1305_blocks(st, st->buf, 16, 0);
+    }
+
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+
+    // full carry
+    uint32_t c = h1 >> 26;
+    h1 &= 0x3ffffff;
+    h2 += c;
+    c = h2 >> 26;
+    h2 &= 0x3ffffff;
+    h3 += c;
+    c = h3 >> 26;
+    h3 &= 0x3ffffff;
+    h4 += c;
+    c = h4 >> 26;
+    h4 &= 0x3ffffff;
+    h0 += c * 5;
+    c = h0 >> 26;
+    h0 &= 0x3ffffff;
+    h1 += c;
+
+    // g = h - (2^130 - 5), kept only if h >= 2^130 - 5
+    uint32_t g0 = h0 + 5;
+    c = g0 >> 26;
+    g0 &= 0x3ffffff;
+    uint32_t g1 = h1 + c;
+    c = g1 >> 26;
+    g1 &= 0x3ffffff;
+    uint32_t g2 = h2 + c;
+    c = g2 >> 26;
+    g2 &= 0x3ffffff;
+    uint32_t g3 = h3 + c;
+    c = g3 >> 26;
+    g3 &= 0x3ffffff;
+    uint32_t g4 = h4 + c - (1u << 26);
+
+    uint32_t keep_g = (g4 >> 31) - 1; // all ones if g did not go negative
+    h0 = (h0 & ~keep_g) | (g0 & keep_g);
+    h1 = (h1 & ~keep_g) | (g1 & keep_g);
+    h2 = (h2 & ~keep_g) | (g2 & keep_g);
+    h3 = (h3 & ~keep_g) | (g3 & keep_g);
+    h4 = (h4 & ~keep_g) | (g4 & keep_g);
+
+    // repack into 32-bit words and add the pad mod 2^128
+    uint32_t w0 = h0 | (h1 << 26);
+    uint32_t w1 = (h1 >> 6) | (h2 << 20);
+    uint32_t w2 = (h2 >> 12) | (h3 << 14);
+    uint32_t w3 = (h3 >> 18) | (h4 << 8);
+
+    uint64_t f = (uint64_t) w0 + st->pad[0];
+    store32(tag + 0, (uint32_t) f);
+    f = (uint64_t) w1 + st->pad[1] + (f >> 32);
+    store32(tag + 4, (uint32_t) f);
+    f = (uint64_t) w2 + st->pad[2] + (f >> 32);
+    store32(tag + 8, (uint32_t) f);
+    f = (uint64_t) w3 + st->pad[3] + (f >> 32);
+    store32(tag + 12, (uint32_t) f);
+}
+
+void poly1305(uint8_t tag[CHACHA_TAG_BYTES], const uint8_t *msg, size_t len, const uint8_t key[32]) {
+    poly1305_ctx st;
+    poly1305_init(&st, key);
+    poly1305_update(&st, msg, len);
+    poly1305_finish(&st, tag);
+}
+
+// tag over aad and ciphertext, with the one-time key from keystream block 0
+static void aead_tag(uint8_t tag[CHACHA_TAG_BYTES], const uint8_t *ct, size_t len,
+    const uint8_t *aad, size_t aad_len, const uint8_t key[CHACHA_KEY_BYTES],
+    const uint8_t nonce[CHACHA_NONCE_BYTES]) {
+    static const uint8_t zeros[16] = { 0 };
+    uint8_t otk[32] = { 0 };
+    chacha20_xor(otk, otk, sizeof(otk), key, nonce, 0);
+
+    poly1305_ctx st;
+    poly1305_init(&st, otk);
+    poly1305_update(&st, aad, aad_len);
+    poly1305_update(&st, zeros, (16 - aad_len % 16) % 16);
+    poly1305_update(&st, ct, len);
+    poly1305_update(&st, zeros, (16 - len % 16) % 16);
+
+    uint8_t lengths[16];
+    store64(lengths, aad_len);
+    store64(lengths + 8, len);
+    poly1305_update(&st, lengths, sizeof(lengths));
+    poly1305_finish(&st, tag);
+}
+
+void aead_seal(uint8_t *out, uint8_t tag[CHACHA_TAG_BYTES], const uint8_t *in, size_t len,
+    const uint8_t *aad, size_t aad_len, const uint8_t key[CHACHA_KEY_BYTES],
+    const uint8_t nonce[CHACHA_NONCE_BYTES]) {
+    chacha20_xor(out, in, len, key, nonce, 1);
+    aead_tag(tag, out, len, aad, aad_len, key, nonce);
+}
+
+bool aead_open(uint8_t *out, const uint8_t tag[CHACHA_TAG_BYTES], const uint8_t *in, size_t len,
+    const uint8_t *aad, size_t aad_len, const uint8_t key[CHACHA_KEY_BYTES],
+    const uint8_t nonce[CHACHA_NONCE_BYTES]) {
+    uint8_t expect[CHACHA_TAG_BYTES];
+    aead_tag(expect, in, len, aad, aad_len, key, nonce);
+
+    // constant-time compare
+    uint8_t diff = 0;
+    for (int i = 0; i < CHACHA_TAG_BYTES; i++)
+        diff |= expect[i] ^ tag[i];
+    if (diff != 0)
+        return false;
+
+    chacha20_xor(out, in, len, key, nonce, 1);
+    return true;
+}
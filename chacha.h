@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHACHA_KEY_BYTES   32
+#define CHACHA_NONCE_BYTES 12
+#define CHACHA_TAG_BYTES   16
+
+//
+// XORs len bytes of in with the ChaCha20 keystream (RFC 8439), starting at
+// block counter. in and out may be the same buffer.
+//
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t len, const uint8_t key[CHACHA_KEY_BYTES],
+    const uint8_t nonce[CHACHA_NONCE_BYTES], uint32_t counter);
+
+//
+// Computes the Poly1305 one-time authenticator of msg under a 32-byte key.
+//
+void poly1305(uint8_t tag[CHACHA_TAG_BYTES], const uint8_t *msg, size_t len, const uint8_t key[32]);
+
+//
+// ChaCha20-Poly1305 AEAD encryption (RFC 8439).
+//
+// Provides:
+//  out: len bytes of ciphertext; may be the same buffer as in
+//  tag: authentication tag over aad and the ciphertext
+//
+void aead_seal(uint8_t *out, uint8_t tag[CHACHA_TAG_BYTES], const uint8_t *in, size_t len,
+    const uint8_t *aad, size_t aad_len, const uint8_t key[CHACHA_KEY_BYTES],
+    const uint8_t nonce[CHACHA_NONCE_BYTES]);
+
+//
+// ChaCha20-Poly1305 AEAD decryption (RFC 8439).
+//
+// Provides:
+//  out: len bytes of plaintext; may be the same buffer as in
+//  returns false, leaving out unspecified, if the tag does not match
+//
+bool aead_open(uint8_t *out, const uint8_t tag[CHACHA_TAG_BYTES], const uint8_t *in, size_t len,
+    const uint8_t *aad, size_t aad_len, const uint8_t key[CHACHA_KEY_BYTES],
+    const uint8_t nonce[CHACHA_NONCE_BYTES]);
@@ -1,15 +1,39 @@
 #include <stdio.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <time.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <sys/stat.h>
 #include <string.h>
 #include "randstate.h"
+#include "arena.h"
 #include "numtheory.h"
 #include "ss.h"
+#include "pool.h"
+#include "stats.h"
+#include "ssdproto.h"
 
-#define OPTIONS "hvi:o:n:"
+#define OPTIONS "hvi:o:n:t:q:K:S:"
+
+static const struct option long_options[] = {
+    { "range", required_argument, NULL, 'r' },
+    { "stats", required_argument, NULL, 'T' },
+    { "io", required_argument, NULL, 'I' },
+    { NULL, 0, NULL, 0 },
+};
+
+// parses "offset:len" into its two parts
+static bool parse_range(const char *arg, uint64_t *offset, uint64_t *len) {
+    char *end;
+    *offset = strtoull(arg, &end, 10);
+    if (end == arg || *end != ':')
+        return false;
+
+    const char *rest = end + 1;
+    *len = strtoull(rest, &end, 10);
+    return end != rest && *end == '\0';
+}
 
 int main(int argc, char **argv) {
     int opt;
@@ -19,12 +43,21 @@ int main(int argc, char **argv) {
     char *input_file, *output_file, *private_key_file;
     input_file = NULL;
     output_file = NULL;
-    private_key_file = "ss.priv";
+    private_key_file = NULL;
+    char *key_id = NULL;
+    char *socket_path = NULL;
+    bool stats = false;
+
+    ss_file_opts opts;
+    ss_file_opts_init(&opts);
+
+    bool ranged = false;
+    uint64_t range_offset = 0, range_len = 0;
 
     int optInd = optind + 1;
 
     // manages user inputs
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'v': {
             verbose = true;
@@ -51,6 +84,49 @@ int main(int argc, char **argv) {
             break;
         }
 
+        case 't': {
+            if (pool_parse_threads(argv[optInd], &opts.threads) == false) {
+                fprintf(stderr, "-t: threads must be from 1 to %u\n", pool_max_threads());
+                return 1;
+            }
+            break;
+        }
+
+        case 'q': {
+            if (ss_parse_depth(argv[optInd], &opts.depth) == false) {
+                fprintf(stderr, "-q: depth must be from 1 to %d\n", SS_DEPTH_MAX);
+                return 1;
+            }
+            break;
+        }
+
+        case 'K': {
+            key_id = argv[optInd];
+            break;
+        }
+
+        case 'S': {
+            socket_path = argv[optInd];
+            break;
+        }
+
+        case 'T': {
+            stats = parse_stats(optarg);
+            help = help || stats == false;
+            break;
+        }
+
+        case 'I': {
+            help = help || ss_parse_io(optarg, &opts.io) == false;
+            break;
+        }
+
+        case 'r': {
+            ranged = parse_range(optarg, &range_offset, &range_len);
+            help = help || ranged == false;
+            break;
+        }
+
         default: {
             help = true;
             break;
@@ -59,17 +135,37 @@ int main(int argc, char **argv) {
         optInd = optind + 1;
     }
 
+    // -K looks the key up in a keystore instead of a key file
+    if (private_key_file == NULL)
+        private_key_file = key_id != NULL ? "ss.keys" : "ss.priv";
+
     // usage message
     if (help == true) {
         printf("SYNOPSIS:\n   Decrypts data using an SS encryption.\n   Encrypted data is "
-               "encrypted by the encrypted program.\n\nUSAGE\n   ./decrypt [hvi:o:n:]\n\nOPTIONS\n "
-               " -h\t\t\tDisplay program help and usage.\n  -v\t\t\tDisplay verbose program "
-               "output.\n  -i infile\t\tInput file of data to decrypt (default: stdin).\n  -o "
-               "outfile\t\tOutput file for decrypted data (default: stdout).\n  -n "
-               "pbfile\t\tPrivate key file (default: ss.priv).\n");
+               "encrypted by the encrypted program.\n\nUSAGE\n   ./decrypt [hvi:o:n:t:q:K:S:] "
+               "[--range offset:len] [--stats json] [--io backend]\n\nOPTIONS\n  -h\t\t\tDisplay "
+               "program help and usage.\n  -v\t\t\tDisplay verbose program output.\n  -i "
+               "infile\t\tInput file of data to decrypt (default: stdin).\n  -o outfile\t\tOutput "
+               "file for decrypted data (default: stdout).\n  -n pbfile\t\tPrivate key file "
+               "(default: ss.priv, or ss.keys with -K).\n  -K id\t\t\tUse key id from the keystore "
+               "given by -n.\n  -S socket\t\tHave the ssd daemon at socket decrypt (hex, binary or "
+               "-c input).\n  -t threads\t\tWorker threads for decryption (default: 1).\n  -q "
+               "depth\t\tBatches in flight between reading, decrypting and writing (default: "
+               "3).\n  --range offset:len\tDecrypt only len plaintext bytes from offset (needs "
+               "ciphertext from encrypt -c).\n  --stats json\t\tPrint hot-path counters to stderr "
+               "at exit (counted with make STATS=1).\n  --io backend\t\tRead and write files with "
+               "uring (default), pread or stdio.\n");
+        return 0;
+    }
+
+    if (socket_path != NULL && ranged == true) {
+        printf("-S: ssd decrypts whole ciphertexts; drop --range\n");
         return 0;
     }
 
+    // GMP temporaries come from per-thread caches instead of malloc
+    arena_install(true);
+
     FILE *infile = stdin; // file containing encrypted ciphertext
 
     // if input file provided, use that instead of stdin
@@ -96,26 +192,85 @@ int main(int argc, char **argv) {
         }
     }
 
-    FILE *pvfile = fopen(private_key_file, "r"); // read file containing private key
-
-    if (private_key_file == NULL) {
-        printf("%s: No such file or directory\n", private_key_file);
-        return 0;
+    if (socket_path != NULL) {
+        bool ok = ssd_call(socket_path, SSD_DECRYPT, infile, outfile);
+        fclose(infile);
+        fclose(outfile);
+        if (stats == true)
+            stats_report(stderr, "decrypt");
+        return ok ? 0 : 1;
     }
 
     mpz_t d, pq;
     mpz_inits(d, pq, NULL);
-    ss_read_priv(pq, d, pvfile);
-    fclose(pvfile);
+    ss_crt crt;
+    ss_crt_init(&crt);
+    bool has_crt;
+    ss_ctx *key;
+
+    // keystores and binary key files are mapped and used as they are, text key files are parsed
+    ss_keystore *ks = NULL;
+    ss_keyfile *kf;
+
+    // a failed lookup is an error the caller must be able to see, unlike
+    // the usage mistakes above
+    if (key_id != NULL) {
+        ks = ss_keystore_open(private_key_file);
+        if (ks == NULL) {
+            fprintf(stderr, "%s: Not a keystore\n", private_key_file);
+            return 1;
+        }
+        kf = ss_keystore_get(ks, key_id, SS_KEY_PRIV);
+        if (kf == NULL) {
+            fprintf(stderr, "%s: No key %s\n", private_key_file, key_id);
+            return 1;
+        }
+    } else
+        kf = ss_keyfile_open(private_key_file);
+
+    if (kf != NULL) {
+        if (ss_keyfile_kind(kf) != SS_KEY_PRIV) {
+            printf("%s: Not a private key file\n", private_key_file);
+            return 0;
+        }
+        has_crt = verbose == true && ss_keyfile_read_priv(kf, pq, d, &crt);
+        key = ss_ctx_from_keyfile(kf);
+    } else {
+        FILE *pvfile = fopen(private_key_file, "r"); // read file containing private key
+
+        if (pvfile == NULL) {
+            printf("%s: No such file or directory\n", private_key_file);
+            return 0;
+        }
+
+        has_crt = ss_read_priv(pq, d, &crt, pvfile); // older key files only have pq and d
+        fclose(pvfile);
+        key = ss_ctx_create_priv(d, pq, has_crt ? &crt : NULL);
+    }
 
     if (verbose == true) {
         gmp_printf("pq (%d bits) = %Zd\n", mpz_sizeinbase(pq, 2), pq);
         gmp_printf("d  (%d bits) = %Zd\n", mpz_sizeinbase(d, 2), d);
+        if (has_crt == true) {
+            gmp_printf("p  (%d bits) = %Zd\n", mpz_sizeinbase(crt.p, 2), crt.p);
+            gmp_printf("q  (%d bits) = %Zd\n", mpz_sizeinbase(crt.q, 2), crt.q);
+        }
     }
 
-    ss_decrypt_file(infile, outfile, d, pq);
+    if (ranged == true)
+        ss_ctx_decrypt_range(key, infile, outfile, range_offset, range_len, &opts);
+    else
+        ss_ctx_decrypt_file(key, infile, outfile, &opts);
     fclose(infile);
     fclose(outfile);
+    ss_ctx_destroy(key);
+    if (kf != NULL)
+        ss_keyfile_close(kf);
+    if (ks != NULL)
+        ss_keystore_close(ks);
     mpz_clears(d, pq, NULL);
+    ss_crt_clear(&crt);
+    if (stats == true)
+        stats_report(stderr, "decrypt");
     return 0;
 }
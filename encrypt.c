@@ -1,15 +1,26 @@
 #include <stdio.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <time.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <sys/stat.h>
 #include <string.h>
 #include "randstate.h"
+#include "arena.h"
 #include "numtheory.h"
 #include "ss.h"
+#include "pool.h"
+#include "stats.h"
+#include "ssdproto.h"
 
-#define OPTIONS "hvi:o:n:"
+#define OPTIONS "hvbcHzi:o:n:t:q:K:S:"
+
+static const struct option long_options[] = {
+    { "stats", required_argument, NULL, 'T' },
+    { "io", required_argument, NULL, 'I' },
+    { NULL, 0, NULL, 0 },
+};
 
 int main(int argc, char **argv) {
     int opt;
@@ -19,12 +30,18 @@ int main(int argc, char **argv) {
     char *input_file, *output_file, *public_key_file;
     input_file = NULL;
     output_file = NULL;
-    public_key_file = "ss.pub";
+    public_key_file = NULL;
+    char *key_id = NULL;
+    char *socket_path = NULL;
+    bool stats = false;
+
+    ss_file_opts opts;
+    ss_file_opts_init(&opts);
 
     int optInd = optind + 1;
 
     // manages user inputs
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'v': {
             verbose = true;
@@ -36,6 +53,26 @@ int main(int argc, char **argv) {
             break;
         }
 
+        case 'b': {
+            opts.format = SS_FORMAT_BINARY;
+            break;
+        }
+
+        case 'c': {
+            opts.format = SS_FORMAT_CONTAINER;
+            break;
+        }
+
+        case 'H': {
+            opts.format = SS_FORMAT_HYBRID;
+            break;
+        }
+
+        case 'z': {
+            opts.compress = true;
+            break;
+        }
+
         case 'i': {
             input_file = argv[optInd];
             break;
@@ -51,6 +88,43 @@ int main(int argc, char **argv) {
             break;
         }
 
+        case 't': {
+            if (pool_parse_threads(argv[optInd], &opts.threads) == false) {
+                fprintf(stderr, "-t: threads must be from 1 to %u\n", pool_max_threads());
+                return 1;
+            }
+            break;
+        }
+
+        case 'q': {
+            if (ss_parse_depth(argv[optInd], &opts.depth) == false) {
+                fprintf(stderr, "-q: depth must be from 1 to %d\n", SS_DEPTH_MAX);
+                return 1;
+            }
+            break;
+        }
+
+        case 'K': {
+            key_id = argv[optInd];
+            break;
+        }
+
+        case 'S': {
+            socket_path = argv[optInd];
+            break;
+        }
+
+        case 'T': {
+            stats = parse_stats(optarg);
+            help = help || stats == false;
+            break;
+        }
+
+        case 'I': {
+            help = help || ss_parse_io(optarg, &opts.io) == false;
+            break;
+        }
+
         default: {
             help = true;
             break;
@@ -59,18 +133,42 @@ int main(int argc, char **argv) {
         optInd = optind + 1;
     }
 
+    // -K looks the key up in a keystore instead of a key file
+    if (public_key_file == NULL)
+        public_key_file = key_id != NULL ? "ss.keys" : "ss.pub";
+
     // usage message
     if (help == true) {
         printf(
-            "SYNOPSIS:\n   Encrypts data using an SS encryption.\n   Encrypted data is "
-            "decrypted by the decrypt program.\n\nUSAGE\n   ./encrypt [hvi:o:n:]\n\nOPTIONS\n  "
-            "-h\t\t\tDisplay program help and usage.\n  -v\t\t\tDisplay verbose program "
-            "output.\n  -i infile\t\tInput file of data to encrypt (default: stdin).\n  -o "
+            "SYNOPSIS:\n   Encrypts data using an SS encryption.\n   Encrypted data is decrypted "
+            "by the decrypt program.\n\nUSAGE\n   ./encrypt [hvbcHzi:o:n:t:q:K:S:] [--stats json] "
+            "[--io backend]\n\nOPTIONS\n  -h\t\t\tDisplay program help and usage.\n  "
+            "-v\t\t\tDisplay verbose program output.\n  -b\t\t\tWrite binary ciphertext instead of "
+            "hex lines.\n  -c\t\t\tWrite binary ciphertext with a block index for ranged "
+            "decryption.\n  -H\t\t\tHybrid mode: SS-wrapped session key, ChaCha20-Poly1305 "
+            "payload.\n  -z\t\t\tCompress the data before encrypting it (implies -b unless -c or "
+            "-H).\n  -i infile\t\tInput file of data to encrypt (default: stdin).\n  -o "
             "outfile\t\tOutput file for encrypted data (default: stdout).\n  -n pbfile\t\tPublic "
-            "key file (default: ss.pub).\n");
+            "key file (default: ss.pub, or ss.keys with -K).\n  -K id\t\t\tUse key id from the "
+            "keystore given by -n.\n  -S socket\t\tHave the ssd daemon at socket encrypt (binary "
+            "format only).\n  -t threads\t\tWorker threads for encryption (default: 1).\n  -q "
+            "depth\t\tBatches in flight between reading, encrypting and writing (default: 3).\n  "
+            "--stats json\t\tPrint hot-path counters to stderr at exit (counted with make "
+            "STATS=1).\n  --io backend\t\tRead and write files with uring (default), pread or "
+            "stdio.\n");
         return 0;
     }
 
+    // the daemon holds the key and only writes the plain binary format
+    if (socket_path != NULL && (opts.compress == true || opts.format == SS_FORMAT_HYBRID
+                                   || opts.format == SS_FORMAT_CONTAINER)) {
+        printf("-S: ssd only writes the binary format; drop -c, -H and -z\n");
+        return 0;
+    }
+
+    // GMP temporaries come from per-thread caches instead of malloc
+    arena_install(true);
+
     // file containing message
     FILE *infile = stdin;
 
@@ -99,28 +197,75 @@ int main(int argc, char **argv) {
         }
     }
 
-    // file that contains public key
-    FILE *pbfile = fopen(public_key_file, "r");
-
-    if (pbfile == NULL) {
-        printf("%s: No such file or directory\n", public_key_file);
-        return 0;
+    if (socket_path != NULL) {
+        bool ok = ssd_call(socket_path, SSD_ENCRYPT, infile, outfile);
+        fclose(infile);
+        fclose(outfile);
+        if (stats == true)
+            stats_report(stderr, "encrypt");
+        return ok ? 0 : 1;
     }
 
     mpz_t n;
     mpz_init(n);
     char username[_POSIX_LOGIN_NAME_MAX]; //maximum possible username
-    ss_read_pub(n, username, pbfile);
-    fclose(pbfile);
+    ss_ctx *key;
+
+    // keystores and binary key files are mapped and used as they are, text key files are parsed
+    ss_keystore *ks = NULL;
+    ss_keyfile *kf;
+
+    // a failed lookup is an error the caller must be able to see, unlike
+    // the usage mistakes above
+    if (key_id != NULL) {
+        ks = ss_keystore_open(public_key_file);
+        if (ks == NULL) {
+            fprintf(stderr, "%s: Not a keystore\n", public_key_file);
+            return 1;
+        }
+        kf = ss_keystore_get(ks, key_id, SS_KEY_PUB);
+        if (kf == NULL) {
+            fprintf(stderr, "%s: No key %s\n", public_key_file, key_id);
+            return 1;
+        }
+    } else
+        kf = ss_keyfile_open(public_key_file);
+
+    if (kf != NULL) {
+        if (ss_keyfile_read_pub(kf, n, username) == false) {
+            printf("%s: Not a public key file\n", public_key_file);
+            return 0;
+        }
+        key = ss_ctx_from_keyfile(kf);
+    } else {
+        // file that contains public key
+        FILE *pbfile = fopen(public_key_file, "r");
+
+        if (pbfile == NULL) {
+            printf("%s: No such file or directory\n", public_key_file);
+            return 0;
+        }
+
+        ss_read_pub(n, username, pbfile);
+        fclose(pbfile);
+        key = ss_ctx_create_pub(n);
+    }
 
     if (verbose == true) {
         printf("user = %s\n", username);
         gmp_printf("n (%d bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
     }
 
-    ss_encrypt_file(infile, outfile, n);
+    ss_ctx_encrypt_file(key, infile, outfile, &opts);
     fclose(infile);
     fclose(outfile);
+    ss_ctx_destroy(key);
+    if (kf != NULL)
+        ss_keyfile_close(kf);
+    if (ks != NULL)
+        ss_keystore_close(ks);
     mpz_clear(n);
+    if (stats == true)
+        stats_report(stderr, "encrypt");
     return 0;
 }
@@ -0,0 +1,438 @@
+#define _GNU_SOURCE // O_DIRECT
+#include "fileio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FILEIO_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+// one chunk of the file in a buffer
+typedef struct {
+    uint8_t *data; // FILEIO_CHUNK bytes, FILEIO_ALIGN-aligned
+    struct iovec iov; // the pending transfer, for IORING_OP_READV/WRITEV
+    off_t off; // file offset of data[0]
+    size_t want; // bytes to transfer
+    size_t done; // bytes transferred so far
+    bool busy; // a transfer is in flight
+    bool end; // a read came back empty: the file ends at off + done
+} fileio_buf;
+
+struct fileio {
+    FILE *file;
+    int fd;
+    bool write;
+    bool direct; // fd has O_DIRECT
+    bool eof; // a read hit the end of the file, nothing past it is requested
+    fileio_buf bufs[FILEIO_DEPTH];
+    size_t cur; // buffer being drained (reader) or filled (writer)
+    size_t pos; // bytes of bufs[cur] drained or filled
+    size_t cap; // bytes bufs[cur] takes before it is written
+    off_t next; // file offset of the next chunk to request or write
+    size_t inflight; // transfers in flight
+
+    // io_uring, ring < 0 when pread/pwrite are used
+    int ring;
+    bool fixed; // bufs are registered with the ring
+#ifdef FILEIO_HAVE_URING
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+};
+
+static void fileio_fail(const fileio *io, int err) {
+    fprintf(stderr, "%s error: %s\n", io->write == true ? "write" : "read", strerror(err));
+    exit(1);
+}
+
+// bytes from off to the next chunk boundary, so every transfer after the
+// first starts aligned
+static size_t chunk_len(off_t off) {
+    return FILEIO_CHUNK - (size_t) (off % FILEIO_CHUNK);
+}
+
+#ifdef FILEIO_HAVE_URING
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int ring, unsigned submit, unsigned wait, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, ring, submit, wait, flags, NULL, 0);
+}
+
+static int uring_register(int ring, unsigned op, void *arg, unsigned count) {
+    return (int) syscall(__NR_io_uring_register, ring, op, arg, count);
+}
+
+static void uring_exit(fileio *io) {
+    if (io->sqes != NULL && io->sqes != MAP_FAILED)
+        munmap(io->sqes, io->sqes_len);
+    if (io->cq_map != NULL && io->cq_map != MAP_FAILED && io->cq_map != io->sq_map)
+        munmap(io->cq_map, io->cq_map_len);
+    if (io->sq_map != NULL && io->sq_map != MAP_FAILED)
+        munmap(io->sq_map, io->sq_map_len);
+    close(io->ring); // also unregisters the buffers
+    io->ring = -1;
+}
+
+// maps a ring with room for every buffer's transfer and registers the
+// buffers; false leaves the stream on pread/pwrite
+static bool uring_init(fileio *io) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    io->ring = uring_setup(FILEIO_DEPTH, &p);
+    if (io->ring < 0) {
+        io->ring = -1;
+        return false;
+    }
+
+    io->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+        if (io->cq_map_len > io->sq_map_len)
+            io->sq_map_len = io->cq_map_len;
+        io->cq_map_len = io->sq_map_len;
+    }
+
+    io->sq_map = mmap(NULL, io->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        io->ring, IORING_OFF_SQ_RING);
+    if (io->sq_map == MAP_FAILED) {
+        uring_exit(io);
+        return false;
+    }
+    io->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) != 0
+        ? io->sq_map
+        : mmap(NULL, io->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring,
+              IORING_OFF_CQ_RING);
+    io->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = (struct io_uring_sqe *) mmap(NULL, io->sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_SQES);
+    if (io->cq_map == MAP_FAILED || io->sqes == MAP_FAILED) {
+        uring_exit(io);
+        return false;
+    }
+
+    uint8_t *sq = (uint8_t *) io->sq_map, *cq = (uint8_t *) io->cq_map;
+    io->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    io->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    io->sq_array = (unsigned *) (sq + p.sq_off.array);
+    io->cq_head = (unsigned *) (cq + p.cq_off.head);
+    io->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    io->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // registering pins the buffers, which RLIMIT_MEMLOCK may not allow;
+    // the ring still works without it
+    struct iovec iov[FILEIO_DEPTH];
+    for (size_t i = 0; i < FILEIO_DEPTH; i++) {
+        iov[i].iov_base = io->bufs[i].data;
+        iov[i].iov_len = FILEIO_CHUNK;
+    }
+    io->fixed = uring_register(io->ring, IORING_REGISTER_BUFFERS, iov, FILEIO_DEPTH) == 0;
+    return true;
+}
+
+// queues the rest of buffer i's transfer
+static void uring_submit(fileio *io, size_t i) {
+    fileio_buf *b = &io->bufs[i];
+    unsigned tail = *io->sq_tail;
+    unsigned slot = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+
+    b->iov.iov_base = b->data + b->done;
+    b->iov.iov_len = b->want - b->done;
+    if (io->fixed == true) {
+        sqe->opcode = io->write == true ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (uint64_t) (uintptr_t) b->iov.iov_base;
+        sqe->len = (uint32_t) b->iov.iov_len;
+        sqe->buf_index = (uint16_t) i;
+    } else {
+        sqe->opcode = io->write == true ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (uint64_t) (uintptr_t) &b->iov;
+        sqe->len = 1;
+    }
+    sqe->fd = io->fd;
+    sqe->off = (uint64_t) (b->off + (off_t) b->done);
+    sqe->user_data = i;
+
+    io->sq_array[slot] = slot;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    while (uring_enter(io->ring, 1, 0, 0) < 0)
+        if (errno != EINTR)
+            fileio_fail(io, errno);
+}
+
+static void complete(fileio *io, size_t i, ssize_t res);
+
+// waits for at least one transfer to finish and handles every finished one
+static void uring_reap(fileio *io) {
+    while (*io->cq_head == __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE))
+        if (uring_enter(io->ring, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+            fileio_fail(io, errno);
+
+    // the head is read again each time since complete() may reap as well
+    unsigned head;
+    while ((head = *io->cq_head) != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+        const struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+        size_t i = (size_t) cqe->user_data;
+        ssize_t res = cqe->res;
+        __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+        complete(io, i, res);
+    }
+}
+
+#endif
+
+// waits for the transfers in flight
+static void drain(fileio *io) {
+#ifdef FILEIO_HAVE_URING
+    while (io->inflight > 0)
+        uring_reap(io);
+#else
+    (void) io;
+#endif
+}
+
+// moves the rest of buffer i with pread or pwrite
+static void transfer_sync(fileio *io, size_t i) {
+    fileio_buf *b = &io->bufs[i];
+    while (b->done < b->want && b->end == false) {
+        void *at = b->data + b->done;
+        size_t len = b->want - b->done;
+        off_t off = b->off + (off_t) b->done;
+        ssize_t res = io->write == true ? pwrite(io->fd, at, len, off) : pread(io->fd, at, len, off);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            fileio_fail(io, errno);
+        if (res == 0 && io->write == true)
+            fileio_fail(io, EIO);
+        if (res == 0)
+            b->end = true;
+        b->done += (size_t) res;
+    }
+}
+
+// starts the rest of buffer i's transfer; on a pread/pwrite stream the
+// transfer is finished on return
+static void start(fileio *io, size_t i) {
+    fileio_buf *b = &io->bufs[i];
+    b->busy = true;
+
+    // O_DIRECT wants aligned offsets and lengths, which only the first and
+    // last chunks lack; those go through the page cache with nothing else
+    // in flight on the descriptor
+    bool aligned = (b->off + (off_t) b->done) % FILEIO_ALIGN == 0
+        && (b->want - b->done) % FILEIO_ALIGN == 0
+        && (uintptr_t) (b->data + b->done) % FILEIO_ALIGN == 0;
+    if (io->direct == true && aligned == false) {
+        drain(io);
+        int flags = fcntl(io->fd, F_GETFL);
+        fcntl(io->fd, F_SETFL, flags & ~O_DIRECT);
+        transfer_sync(io, i);
+        fcntl(io->fd, F_SETFL, flags);
+        b->busy = false;
+        return;
+    }
+
+#ifdef FILEIO_HAVE_URING
+    if (io->ring >= 0) {
+        uring_submit(io, i);
+        io->inflight++;
+        return;
+    }
+#endif
+
+    transfer_sync(io, i);
+    b->busy = false;
+}
+
+// a transfer of res bytes (or -errno) into or out of buffer i finished
+static void complete(fileio *io, size_t i, ssize_t res) {
+    fileio_buf *b = &io->bufs[i];
+    io->inflight--;
+
+    if (res == -EINTR || res == -EAGAIN)
+        res = 0;
+    else if (res < 0)
+        fileio_fail(io, (int) -res);
+    else if (res == 0 && io->write == true)
+        fileio_fail(io, EIO);
+    else if (res == 0)
+        b->end = io->eof = true;
+    b->done += (size_t) res;
+
+    // a short transfer continues where it stopped
+    if (b->done < b->want && b->end == false)
+        start(io, i);
+    else
+        b->busy = false;
+}
+
+// waits until buffer i is idle
+static void wait_buf(fileio *io, size_t i) {
+#ifdef FILEIO_HAVE_URING
+    while (io->bufs[i].busy == true)
+        uring_reap(io);
+#else
+    (void) io;
+    (void) i;
+#endif
+}
+
+// requests the next chunk of the file into buffer i
+static void read_ahead(fileio *io, size_t i) {
+    fileio_buf *b = &io->bufs[i];
+    b->off = io->next;
+    b->want = chunk_len(io->next);
+    b->done = 0;
+    b->end = io->eof;
+    io->next += (off_t) b->want;
+    if (b->end == false)
+        start(io, i);
+}
+
+fileio *fileio_open(FILE *file, bool write, fileio_mode mode) {
+    int fd = fileno(file);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || S_ISREG(st.st_mode) == false)
+        return NULL;
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || (write == true && (flags & O_APPEND) != 0))
+        return NULL;
+
+    // the stream takes over at the position stdio has reached
+    if (write == true && fflush(file) != 0)
+        return NULL;
+    off_t pos = ftello(file);
+    if (pos < 0)
+        return NULL;
+
+    fileio *io = (fileio *) calloc(1, sizeof(fileio));
+    io->file = file;
+    io->fd = fd;
+    io->write = write;
+    io->direct = (flags & O_DIRECT) != 0;
+    io->next = pos;
+    io->ring = -1;
+    for (size_t i = 0; i < FILEIO_DEPTH; i++)
+        io->bufs[i].data = (uint8_t *) aligned_alloc(FILEIO_ALIGN, FILEIO_CHUNK);
+
+#ifdef FILEIO_HAVE_URING
+    if (mode == FILEIO_URING)
+        uring_init(io);
+#else
+    (void) mode;
+#endif
+
+    if (write == true) {
+        io->bufs[0].off = pos;
+        io->cap = chunk_len(pos);
+    } else {
+        for (size_t i = 0; i < FILEIO_DEPTH; i++)
+            read_ahead(io, i);
+    }
+    return io;
+}
+
+size_t fileio_read(fileio *io, void *buf, size_t len) {
+    uint8_t *out = (uint8_t *) buf;
+    size_t got = 0;
+
+    while (got < len) {
+        fileio_buf *b = &io->bufs[io->cur];
+        wait_buf(io, io->cur);
+        if (b->end == true)
+            io->eof = true;
+
+        size_t avail = b->done - io->pos;
+        if (avail == 0) {
+            if (b->end == true)
+                break;
+            read_ahead(io, io->cur);
+            io->cur = (io->cur + 1) % FILEIO_DEPTH;
+            io->pos = 0;
+            continue;
+        }
+
+        size_t n = avail < len - got ? avail : len - got;
+        memcpy(out + got, b->data + io->pos, n);
+        io->pos += n;
+        got += n;
+    }
+    return got;
+}
+
+// hands the filled buffer to the kernel and moves on to the next one
+static void write_out(fileio *io) {
+    fileio_buf *b = &io->bufs[io->cur];
+    b->want = io->pos;
+    b->done = 0;
+    io->next = b->off + (off_t) io->pos;
+    start(io, io->cur);
+
+    io->cur = (io->cur + 1) % FILEIO_DEPTH;
+    wait_buf(io, io->cur);
+    io->bufs[io->cur].off = io->next;
+    io->cap = chunk_len(io->next);
+    io->pos = 0;
+}
+
+void fileio_write(fileio *io, const void *buf, size_t len) {
+    const uint8_t *in = (const uint8_t *) buf;
+    while (len > 0) {
+        size_t n = io->cap - io->pos < len ? io->cap - io->pos : len;
+        memcpy(io->bufs[io->cur].data + io->pos, in, n);
+        io->pos += n;
+        in += n;
+        len -= n;
+        if (io->pos == io->cap)
+            write_out(io);
+    }
+}
+
+const char *fileio_name(const fileio *io) {
+    if (io->ring < 0)
+        return "pread";
+    return io->fixed == true ? "io_uring-fixed" : "io_uring";
+}
+
+void fileio_close(fileio *io) {
+    off_t end;
+    if (io->write == true) {
+        if (io->pos > 0)
+            write_out(io);
+        drain(io);
+        end = io->next;
+    } else {
+        drain(io);
+        end = io->bufs[io->cur].off + (off_t) io->pos;
+    }
+    fseeko(io->file, end, SEEK_SET);
+
+#ifdef FILEIO_HAVE_URING
+    if (io->ring >= 0)
+        uring_exit(io);
+#endif
+    for (size_t i = 0; i < FILEIO_DEPTH; i++)
+        free(io->bufs[i].data);
+    free(io);
+}
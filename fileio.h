@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+//
+// Sequential reads or writes of a regular file through FILEIO_DEPTH
+// aligned buffers of FILEIO_CHUNK bytes. With io_uring every buffer is
+// kept in flight at once: a reader requests the chunks ahead of the one
+// being consumed, a writer hands a full chunk to the kernel and goes on
+// filling the next. The buffers are registered with the ring when the
+// kernel allows it, so transfers skip the per-call page pinning. Where
+// io_uring is unavailable, the same buffers are moved with plain pread and
+// pwrite. Transfers are chunk-aligned after the first, so files opened
+// with O_DIRECT work too; the unaligned first and last ones go through the
+// page cache.
+//
+typedef struct fileio fileio;
+
+#define FILEIO_CHUNK (1 << 20)
+#define FILEIO_DEPTH 4
+#define FILEIO_ALIGN 4096
+
+typedef enum {
+    FILEIO_URING, // io_uring, or pread/pwrite if the kernel refuses it
+    FILEIO_PREAD, // pread/pwrite only
+} fileio_mode;
+
+//
+// Takes over reading or writing file from its current position. Until
+// fileio_close, the file must not be used through stdio.
+//
+// Provides:
+//  returns NULL if file isn't a regular file (a pipe, terminal or
+//  fopencookie stream) or is opened for appending, in which case the
+//  caller should keep using stdio
+//
+fileio *fileio_open(FILE *file, bool write, fileio_mode mode);
+
+//
+// Reads up to len bytes; fewer only at the end of the file. Exits on a
+// read error.
+//
+size_t fileio_read(fileio *io, void *buf, size_t len);
+
+//
+// Queues len bytes for writing. Exits on a write error.
+//
+void fileio_write(fileio *io, const void *buf, size_t len);
+
+//
+// Backend in use: "io_uring-fixed" with registered buffers, "io_uring"
+// without them, or "pread".
+//
+const char *fileio_name(const fileio *io);
+
+//
+// Finishes every write, frees the stream and leaves file positioned just
+// past the last byte read or written, ready for stdio again.
+//
+void fileio_close(fileio *io);
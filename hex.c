@@ -0,0 +1,219 @@
+#include "hex.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && GMP_NUMB_BITS == 64 && GMP_NAIL_BITS == 0
+#define HEX_SIMD
+#include <immintrin.h>
+#endif
+
+static const char hex_digits[16] = "0123456789abcdef";
+
+// digit values of every byte, -1 for anything that is not a hex digit
+static int8_t hex_values[256];
+
+// writes limbs xp[n - 1] down to xp[0], HEX_LIMB_DIGITS digits each
+typedef void (*encode_fn)(char *out, const mp_limb_t *xp, size_t n);
+
+// reads n limbs from the n * HEX_LIMB_DIGITS digits ending at end, least
+// significant limb first; returns false on a char that is not a hex digit
+typedef bool (*decode_fn)(mp_limb_t *xp, const char *end, size_t n);
+
+static pthread_once_t hex_once = PTHREAD_ONCE_INIT;
+static encode_fn encode_limbs;
+static decode_fn decode_limbs;
+
+static void encode_limbs_scalar(char *out, const mp_limb_t *xp, size_t n) {
+    for (size_t i = n; i-- > 0; out += HEX_LIMB_DIGITS) {
+        mp_limb_t l = xp[i];
+        for (int j = HEX_LIMB_DIGITS - 1; j >= 0; j--, l >>= 4)
+            out[j] = hex_digits[l & 15];
+    }
+}
+
+// digits of one limb, most significant first
+static bool decode_limb_scalar(mp_limb_t *l, const char *str, size_t digits) {
+    mp_limb_t v = 0;
+    int8_t bad = 0;
+    for (size_t j = 0; j < digits; j++) {
+        int8_t d = hex_values[(uint8_t) str[j]];
+        bad |= d;
+        v = (v << 4) | (mp_limb_t) (d & 15);
+    }
+    *l = v;
+    return bad >= 0;
+}
+
+static bool decode_limbs_scalar(mp_limb_t *xp, const char *end, size_t n) {
+    bool ok = true;
+    for (size_t i = 0; i < n; i++)
+        ok &= decode_limb_scalar(&xp[i], end - (i + 1) * HEX_LIMB_DIGITS, HEX_LIMB_DIGITS);
+    return ok;
+}
+
+#ifdef HEX_SIMD
+
+// SSSE3: one limb per step. The limb is byte-swapped so its bytes come out
+// most significant first, split into nibbles and mapped to digits with pshufb.
+__attribute__((target("ssse3"))) static void encode_limbs_ssse3(
+    char *out, const mp_limb_t *xp, size_t n) {
+    const __m128i table = _mm_loadu_si128((const __m128i *) hex_digits);
+    const __m128i low = _mm_set1_epi8(0x0F);
+
+    for (size_t i = n; i-- > 0; out += 16) {
+        __m128i v = _mm_cvtsi64_si128((long long) __builtin_bswap64(xp[i]));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low);
+        __m128i lo = _mm_and_si128(v, low);
+        __m128i nib = _mm_unpacklo_epi8(hi, lo);
+        _mm_storeu_si128((__m128i *) out, _mm_shuffle_epi8(table, nib));
+    }
+}
+
+// nibble values of 16 chars; false if any is not a hex digit
+__attribute__((target("ssse3"))) static inline bool nibbles_ssse3(__m128i v, __m128i *nib) {
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    __m128i a = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i is_d = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    __m128i is_a = _mm_cmpeq_epi8(_mm_min_epu8(a, _mm_set1_epi8(5)), a);
+
+    *nib = _mm_or_si128(_mm_and_si128(is_d, d),
+        _mm_and_si128(is_a, _mm_add_epi8(a, _mm_set1_epi8(10))));
+    return _mm_movemask_epi8(_mm_or_si128(is_d, is_a)) == 0xFFFF;
+}
+
+// SSSE3: 16 digits per limb; pmaddubsw joins digit pairs into bytes and
+// the byte swap turns the most-significant-first bytes into a limb
+__attribute__((target("ssse3"))) static bool decode_limbs_ssse3(
+    mp_limb_t *xp, const char *end, size_t n) {
+    const __m128i pair = _mm_set1_epi16(0x0110);
+    bool ok = true;
+
+    for (size_t i = 0; i < n; i++) {
+        __m128i nib;
+        ok &= nibbles_ssse3(_mm_loadu_si128((const __m128i *) (end - (i + 1) * 16)), &nib);
+        __m128i bytes = _mm_packus_epi16(_mm_maddubs_epi16(nib, pair), _mm_setzero_si128());
+        xp[i] = __builtin_bswap64((uint64_t) _mm_cvtsi128_si64(bytes));
+    }
+    return ok;
+}
+
+// AVX2: four limbs per step, two per 128-bit lane, then the SSSE3 kernel
+// for what is left
+__attribute__((target("avx2"))) static void encode_limbs_avx2(
+    char *out, const mp_limb_t *xp, size_t n) {
+    const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) hex_digits));
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    const __m256i reverse = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+
+    size_t i = n;
+    for (; i >= 4; i -= 4, out += 64) {
+        // lane 1 holds xp[i - 1], xp[i - 2] and lane 0 xp[i - 3], xp[i - 4],
+        // each reversed to most significant byte first
+        __m256i v = _mm256_loadu_si256((const __m256i *) (xp + i - 4));
+        v = _mm256_shuffle_epi8(v, reverse);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+        __m256i lo = _mm256_and_si256(v, low);
+        __m256i first = _mm256_shuffle_epi8(table, _mm256_unpacklo_epi8(hi, lo));
+        __m256i second = _mm256_shuffle_epi8(table, _mm256_unpackhi_epi8(hi, lo));
+        _mm256_storeu_si256((__m256i *) out, _mm256_permute2x128_si256(first, second, 0x31));
+        _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(first, second, 0x20));
+    }
+
+    encode_limbs_ssse3(out, xp, i);
+}
+
+// AVX2: two limbs per step, one per 128-bit lane
+__attribute__((target("avx2"))) static bool decode_limbs_avx2(
+    mp_limb_t *xp, const char *end, size_t n) {
+    const __m256i pair = _mm256_set1_epi16(0x0110);
+    bool ok = true;
+
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (end - (i + 2) * 16));
+        __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+        __m256i a = _mm256_sub_epi8(
+            _mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+        __m256i is_d = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+        __m256i is_a = _mm256_cmpeq_epi8(_mm256_min_epu8(a, _mm256_set1_epi8(5)), a);
+        ok &= _mm256_movemask_epi8(_mm256_or_si256(is_d, is_a)) == -1;
+
+        __m256i nib = _mm256_or_si256(_mm256_and_si256(is_d, d),
+            _mm256_and_si256(is_a, _mm256_add_epi8(a, _mm256_set1_epi8(10))));
+        __m256i bytes
+            = _mm256_packus_epi16(_mm256_maddubs_epi16(nib, pair), _mm256_setzero_si256());
+
+        // the first 16 digits are the more significant limb
+        xp[i + 1] = __builtin_bswap64((uint64_t) _mm256_extract_epi64(bytes, 0));
+        xp[i] = __builtin_bswap64((uint64_t) _mm256_extract_epi64(bytes, 2));
+    }
+
+    return decode_limbs_ssse3(xp + i, end - i * 16, n - i) && ok;
+}
+
+#endif
+
+static void hex_setup(void) {
+    memset(hex_values, -1, sizeof(hex_values));
+    for (int i = 0; i < 16; i++) {
+        hex_values[(uint8_t) hex_digits[i]] = (int8_t) i;
+        hex_values[(uint8_t) "0123456789ABCDEF"[i]] = (int8_t) i;
+    }
+
+    encode_limbs = encode_limbs_scalar;
+    decode_limbs = decode_limbs_scalar;
+
+#ifdef HEX_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        encode_limbs = encode_limbs_avx2;
+        decode_limbs = decode_limbs_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        encode_limbs = encode_limbs_ssse3;
+        decode_limbs = decode_limbs_ssse3;
+    }
+#endif
+}
+
+size_t hex_encode(char *out, const mpz_t x) {
+    pthread_once(&hex_once, hex_setup);
+
+    size_t size = mpz_size(x);
+    if (size == 0) {
+        out[0] = '0';
+        return 1;
+    }
+
+    // the top limb without its leading zero digits
+    const mp_limb_t *xp = mpz_limbs_read(x);
+    mp_limb_t top = xp[size - 1];
+    size_t digits = 0;
+    for (mp_limb_t t = top; t != 0; t >>= 4)
+        digits++;
+    for (size_t j = digits; j-- > 0; top >>= 4)
+        out[j] = hex_digits[top & 15];
+
+    encode_limbs(out + digits, xp, size - 1);
+    return digits + (size - 1) * HEX_LIMB_DIGITS;
+}
+
+bool hex_decode(mpz_t x, const char *str, size_t len) {
+    pthread_once(&hex_once, hex_setup);
+
+    if (len == 0)
+        return false;
+
+    size_t full = len / HEX_LIMB_DIGITS, head = len % HEX_LIMB_DIGITS;
+    size_t size = full + (head > 0);
+    mp_limb_t *xp = mpz_limbs_write(x, (mp_size_t) size);
+
+    bool ok = decode_limbs(xp, str + len, full);
+    if (head > 0)
+        ok &= decode_limb_scalar(&xp[full], str, head);
+
+    // mpz_limbs_finish strips leading zero limbs
+    mpz_limbs_finish(x, ok ? (mp_size_t) size : 0);
+    return ok;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <gmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// hex digits per limb
+#define HEX_LIMB_DIGITS (GMP_NUMB_BITS / 4)
+
+//
+// Writes x in lowercase hex without leading zeros, exactly as gmp_printf's
+// "%Zx" does for a nonnegative number. Uses AVX2 or SSSE3 when the CPU has
+// them. No NUL is appended.
+//
+// Provides:
+//  out: the digits
+//  returns the number of digits written
+//
+// Requires:
+//  out: room for max(1, mpz_size(x) * HEX_LIMB_DIGITS) chars
+//  x: 0 or greater
+//
+size_t hex_encode(char *out, const mpz_t x);
+
+//
+// Sets x to the hex number in str[0, len), taking the fast path only when
+// every char is a hex digit.
+//
+// Provides:
+//  x: the number, or 0 if false is returned
+//  returns false if len is 0 or str holds anything besides 0-9, a-f, A-F,
+//  in which case the caller should fall back to mpz_set_str for signs and
+//  whitespace
+//
+bool hex_decode(mpz_t x, const char *str, size_t len);
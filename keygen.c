@@ -1,34 +1,59 @@
 #include <stdio.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <time.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <sys/stat.h>
 #include "randstate.h"
+#include "arena.h"
 #include "numtheory.h"
 #include "ss.h"
-
-#define OPTIONS "hvb:i:n:d:s:"
+#include "pool.h"
+#include "stats.h"
+
+#define OPTIONS "hvBb:i:n:d:s:t:"
+
+static const struct option long_options[] = {
+    { "count", required_argument, NULL, 'c' },
+    { "keystore", required_argument, NULL, 'k' },
+    { "stats", required_argument, NULL, 'T' },
+    { NULL, 0, NULL, 0 },
+};
+
+// how many GMP allocations the arena kept away from malloc
+static void print_arena_stats(void) {
+    arena_stats st;
+    arena_stats_get(&st);
+    printf("gmp allocations = %lu (%lu from malloc)\n", (unsigned long) st.requests,
+        (unsigned long) st.mallocs);
+}
 
 int main(int argc, char **argv) {
     int opt;
 
     bool help = false;
     bool verbose = false;
+    bool binary = false;
 
-    uint32_t bits, iters, optInd;
-    char *public_key_file, *private_key_file;
+    uint32_t bits, threads, optInd;
+    uint64_t iters;
+    char *public_key_file, *private_key_file, *keystore_file;
     public_key_file = "ss.pub";
     private_key_file = "ss.priv";
+    keystore_file = NULL;
+    int64_t count = -1; // key pairs in the keystore
+    bool stats = false;
 
     iters = 50;
     bits = 256;
+    threads = 1;
     optInd = optind + 1;
 
     long seed = time(NULL);
 
     // manages user inputs
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'v': {
             verbose = true;
@@ -40,13 +65,18 @@ int main(int argc, char **argv) {
             break;
         }
 
+        case 'B': {
+            binary = true;
+            break;
+        }
+
         case 'b': {
             bits = atoi(argv[optInd]);
             break;
         }
 
         case 'i': {
-            iters = atoi(argv[optInd]);
+            help = help || parse_iters(argv[optInd], &iters) == false;
             break;
         }
 
@@ -65,6 +95,31 @@ int main(int argc, char **argv) {
             break;
         }
 
+        case 't': {
+            if (pool_parse_threads(argv[optInd], &threads) == false) {
+                fprintf(stderr, "-t: threads must be from 1 to %u\n", pool_max_threads());
+                return 1;
+            }
+            break;
+        }
+
+        case 'c': {
+            count = atoll(optarg);
+            help = help || count < 1 || count > UINT32_MAX;
+            break;
+        }
+
+        case 'T': {
+            stats = parse_stats(optarg);
+            help = help || stats == false;
+            break;
+        }
+
+        case 'k': {
+            keystore_file = optarg;
+            break;
+        }
+
         default: {
             help = true;
         }
@@ -72,19 +127,57 @@ int main(int argc, char **argv) {
         optInd = optind + 1;
     }
 
+    // --count only makes sense for a keystore
+    help = help || (count != -1 && keystore_file == NULL);
+
     // usage message
     if (help == true) {
         printf(
             "SYNOPSIS:\n   Generates an SS public/private key pair.\n\nUSAGE\n   ./keygen "
-            "[hvb:i:n:d:s:]\n\nOPTIONS\n  -h\t\tDisplay program help and usage.\n  -v\t\tDisplay "
-            "verbose program output.\n  -b bits\tMinimum bits needed for public key n (default: "
-            "256).\n  -i iterations\tMiller-Rabin iterations for testing primes (default: 50).\n  "
-            "-n pbfile\tPublic key file (default: ss.pub).\n  -d pvfile\tPrivate key file "
-            "(default: ss.priv).\n  -s seed\tRandom seed for testing.\n");
+            "[hvBb:i:n:d:s:t:] [--keystore path [--count N]] [--stats json]\n\nOPTIONS\n  "
+            "-h\t\tDisplay program help and usage.\n  -v\t\tDisplay verbose program output.\n  "
+            "-B\t\tWrite binary key files with precomputed values.\n  -b bits\tMinimum bits needed "
+            "for public key n (default: 256).\n  -i iterations\tMiller-Rabin iterations for "
+            "testing primes, or 'bpsw' for Baillie-PSW, or 'auto' for rounds by prime size "
+            "(default: 50).\n  -n pbfile\tPublic key file (default: ss.pub).\n  -d pvfile\tPrivate "
+            "key file (default: ss.priv).\n  -s seed\tRandom seed for testing.\n  -t "
+            "threads\tThreads searching for primes (default: 1).\n  --keystore path\tWrite key "
+            "pairs to one indexed keystore instead of -n/-d.\n  --count N\tKey pairs in the "
+            "keystore, made on -t threads (default: 1).\n  --stats json\tPrint hot-path counters "
+            "to stderr at exit (counted with make STATS=1).\n");
 
         return 0;
     }
 
+    // GMP temporaries come from per-thread caches instead of malloc
+    arena_install(true);
+
+    char *username = getenv("USER"); // get username
+
+    // a keystore holds every key pair, ids 0 to count - 1, in one file
+    if (keystore_file != NULL) {
+        FILE *ksfile = fopen(keystore_file, "w");
+        if (ksfile == NULL) {
+            printf("%s: No such file or directory\n", keystore_file);
+            return 0;
+        }
+        fchmod(fileno(ksfile), 0600); // it holds private keys, so owner only
+
+        randstate_init(seed);
+        ss_write_keystore(
+            ksfile, count == -1 ? 1 : (uint32_t) count, bits, iters, threads, username);
+        randstate_clear();
+        fclose(ksfile);
+
+        if (verbose == true) {
+            printf("user = %s\nkeys = %lld\n", username, (long long) (count == -1 ? 1 : count));
+            print_arena_stats();
+        }
+        if (stats == true)
+            stats_report(stderr, "keygen");
+        return 0;
+    }
+
     FILE *pbfile = fopen(public_key_file, "w"); // open to write public key file
     FILE *pvfile = fopen(private_key_file, "w"); // open to write private key file
     fchmod(fileno(pvfile),
@@ -93,13 +186,20 @@ int main(int argc, char **argv) {
     randstate_init(seed);
     mpz_t p, q, n, d, pq;
     mpz_inits(p, q, n, d, pq, NULL);
-    ss_make_pub(p, q, n, bits, iters);
+    ss_make_pub_threads(p, q, n, bits, iters, threads);
     ss_make_priv(d, pq, p, q);
 
-    char *username = getenv("USER"); // get username
+    ss_crt crt;
+    ss_crt_init(&crt);
+    ss_make_crt(&crt, d, p, q);
 
-    ss_write_pub(n, username, pbfile);
-    ss_write_priv(pq, d, pvfile);
+    if (binary == true) {
+        ss_write_pub_bin(n, username, pbfile);
+        ss_write_priv_bin(pq, d, &crt, pvfile);
+    } else {
+        ss_write_pub(n, username, pbfile);
+        ss_write_priv(pq, d, &crt, pvfile);
+    }
 
     if (verbose == true) {
         printf("user = %s\n", username);
@@ -108,11 +208,15 @@ int main(int argc, char **argv) {
         gmp_printf("n  (%d bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
         gmp_printf("pq (%d bits) = %Zd\n", mpz_sizeinbase(pq, 2), pq);
         gmp_printf("d  (%d bits) = %Zd\n", mpz_sizeinbase(d, 2), d);
+        print_arena_stats();
     }
 
     randstate_clear();
     fclose(pbfile);
     fclose(pvfile);
     mpz_clears(p, q, n, d, pq, NULL);
+    ss_crt_clear(&crt);
+    if (stats == true)
+        stats_report(stderr, "keygen");
     return 0;
 }
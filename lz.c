@@ -0,0 +1,271 @@
+#define _GNU_SOURCE // fopencookie
+#include "lz.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+
+// misses in a row before the search starts skipping ahead, so input that
+// doesn't compress goes by quickly
+#define LZ_SKIP_SHIFT 6
+
+#define FRAME_HEAD 8
+
+static uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// writes the part of a length beyond the 15 that fits in the token
+static uint8_t *put_length(uint8_t *op, size_t n) {
+    for (; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t) n;
+    return op;
+}
+
+// reads a length continued past the token, adding it to n
+static bool get_length(const uint8_t **ip, const uint8_t *end, size_t *n) {
+    uint8_t b;
+    do {
+        if (*ip == end)
+            return false;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return true;
+}
+
+// one sequence: literals, then a match unless match_len is 0
+static uint8_t *put_sequence(
+    uint8_t *op, const uint8_t *lit, size_t lit_len, size_t offset, size_t match_len) {
+    size_t ml = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+    *op++ = (uint8_t) (((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit_len >= 15)
+        op = put_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len == 0)
+        return op;
+
+    *op++ = (uint8_t) offset;
+    *op++ = (uint8_t) (offset >> 8);
+    if (ml >= 15)
+        op = put_length(op, ml - 15);
+    return op;
+}
+
+size_t lz_compress(uint8_t *out, const uint8_t *in, size_t len) {
+    uint32_t table[1 << LZ_HASH_BITS] = { 0 }; // last position + 1 of each hash, 0 if none
+    uint8_t *op = out;
+    size_t anchor = 0, i = 0, misses = 0;
+
+    while (i + LZ_MIN_MATCH <= len) {
+        uint32_t seq = load32(in + i);
+        uint32_t h = lz_hash(seq);
+        size_t cand = table[h];
+        table[h] = (uint32_t) i + 1;
+
+        if (cand == 0 || load32(in + cand - 1) != seq) {
+            i += 1 + (misses++ >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        // inputs are at most LZ_MAX_INPUT bytes, so the offset fits 16 bits
+        size_t m = cand - 1;
+        size_t match = LZ_MIN_MATCH;
+        while (i + match < len && in[m + match] == in[i + match])
+            match++;
+
+        op = put_sequence(op, in + anchor, i - anchor, i - m, match);
+        i += match;
+        anchor = i;
+        misses = 0;
+
+        // the position just before the next search starts is a likely match too
+        if (i + 2 <= len)
+            table[lz_hash(load32(in + i - 2))] = (uint32_t) i - 1;
+    }
+
+    op = put_sequence(op, in + anchor, len - anchor, 0, 0);
+    return op - out;
+}
+
+bool lz_decompress(uint8_t *out, size_t out_len, const uint8_t *in, size_t in_len) {
+    const uint8_t *ip = in, *end = in + in_len;
+    size_t op = 0;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15 && get_length(&ip, end, &lit) == false)
+            return false;
+        if ((size_t) (end - ip) < lit || out_len - op < lit)
+            return false;
+        memcpy(out + op, ip, lit);
+        ip += lit;
+        op += lit;
+
+        // the last sequence has no match
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return false;
+        size_t offset = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+
+        size_t match = token & 15;
+        if (match == 15 && get_length(&ip, end, &match) == false)
+            return false;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || out_len - op < match)
+            return false;
+
+        // a match may overlap its own output, repeating the last offset bytes
+        if (offset >= match) {
+            memcpy(out + op, out + op - offset, match);
+        } else {
+            for (size_t i = 0; i < match; i++)
+                out[op + i] = out[op - offset + i];
+        }
+        op += match;
+    }
+
+    return op == out_len;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+// state of either kind of stream
+typedef struct {
+    FILE *file; // infile of a reader, outfile of a writer
+    uint8_t raw[LZ_MAX_INPUT];
+    uint8_t frame[FRAME_HEAD + LZ_BOUND(LZ_MAX_INPUT)];
+    size_t pos; // bytes of frame handed out (reader) or taken in (writer)
+    size_t len; // bytes in frame (reader)
+    uint32_t raw_len, stored; // header of the frame coming in (writer)
+} lz_stream;
+
+static void lz_corrupt(void) {
+    fprintf(stderr, "corrupt compressed plaintext\n");
+    exit(1);
+}
+
+// compresses the next frame; false at the end of the input
+static bool reader_fill(lz_stream *s) {
+    size_t n = fread(s->raw, sizeof(uint8_t), LZ_MAX_INPUT, s->file);
+    if (n == 0)
+        return false;
+
+    size_t stored = lz_compress(s->frame + FRAME_HEAD, s->raw, n);
+    if (stored >= n) {
+        memcpy(s->frame + FRAME_HEAD, s->raw, n);
+        stored = n;
+    }
+
+    put_be32(s->frame, (uint32_t) n);
+    put_be32(s->frame + 4, (uint32_t) stored);
+    s->pos = 0;
+    s->len = FRAME_HEAD + stored;
+    return true;
+}
+
+static ssize_t reader_read(void *cookie, char *buf, size_t size) {
+    lz_stream *s = (lz_stream *) cookie;
+    size_t done = 0;
+
+    while (done < size) {
+        if (s->pos == s->len && reader_fill(s) == false)
+            break;
+
+        size_t n = s->len - s->pos < size - done ? s->len - s->pos : size - done;
+        memcpy(buf + done, s->frame + s->pos, n);
+        s->pos += n;
+        done += n;
+    }
+
+    return (ssize_t) done;
+}
+
+// decompresses a complete frame to the output
+static void writer_flush(lz_stream *s) {
+    const uint8_t *data = s->frame + FRAME_HEAD;
+    if (s->stored < s->raw_len) {
+        if (lz_decompress(s->raw, s->raw_len, data, s->stored) == false)
+            lz_corrupt();
+        data = s->raw;
+    }
+
+    fwrite(data, sizeof(uint8_t), s->raw_len, s->file);
+    s->pos = 0;
+}
+
+static ssize_t writer_write(void *cookie, const char *buf, size_t size) {
+    lz_stream *s = (lz_stream *) cookie;
+
+    for (size_t done = 0; done < size;) {
+        size_t need = s->pos < FRAME_HEAD ? FRAME_HEAD : FRAME_HEAD + s->stored;
+        size_t n = need - s->pos < size - done ? need - s->pos : size - done;
+        memcpy(s->frame + s->pos, buf + done, n);
+        s->pos += n;
+        done += n;
+
+        if (s->pos == FRAME_HEAD && need == FRAME_HEAD) {
+            s->raw_len = get_be32(s->frame);
+            s->stored = get_be32(s->frame + 4);
+            if (s->raw_len == 0 || s->raw_len > LZ_MAX_INPUT || s->stored == 0
+                || s->stored > s->raw_len)
+                lz_corrupt();
+        } else if (s->pos == need) {
+            writer_flush(s);
+        }
+    }
+
+    return (ssize_t) size;
+}
+
+static int reader_close(void *cookie) {
+    free(cookie);
+    return 0;
+}
+
+static int writer_close(void *cookie) {
+    lz_stream *s = (lz_stream *) cookie;
+    if (s->pos != 0)
+        lz_corrupt(); // cut off mid-frame
+    free(s);
+    return 0;
+}
+
+FILE *lz_reader(FILE *infile) {
+    lz_stream *s = (lz_stream *) calloc(1, sizeof(lz_stream));
+    s->file = infile;
+    cookie_io_functions_t io = { reader_read, NULL, NULL, reader_close };
+    return fopencookie(s, "r", io);
+}
+
+FILE *lz_writer(FILE *outfile) {
+    lz_stream *s = (lz_stream *) calloc(1, sizeof(lz_stream));
+    s->file = outfile;
+    cookie_io_functions_t io = { NULL, writer_write, NULL, writer_close };
+    return fopencookie(s, "w", io);
+}
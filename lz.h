@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//
+// LZ77 compression in the style of LZ4: greedy matching against a hash of
+// the last position each 4-byte string was seen at, and output as a series
+// of sequences, each a token byte (literal count in the high nibble, match
+// length - 4 in the low one, 15 meaning more follows in bytes of up to
+// 255), the literals, and a little-endian u16 match offset. The last
+// sequence has literals only. Nothing is shared between calls.
+//
+
+// largest input accepted by lz_compress, so match offsets fit 16 bits
+#define LZ_MAX_INPUT (1 << 16)
+
+// most bytes lz_compress can write for len bytes of input
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+//
+// Compresses in[0, len).
+//
+// Provides:
+//  out: the sequences
+//  returns the number of bytes written
+//
+// Requires:
+//  len: at most LZ_MAX_INPUT
+//  out: room for LZ_BOUND(len) bytes
+//
+size_t lz_compress(uint8_t *out, const uint8_t *in, size_t len);
+
+//
+// Decompresses in[0, in_len) into exactly out_len bytes.
+//
+// Provides:
+//  returns false if the input is malformed or does not decode to out_len
+//  bytes; nothing outside out[0, out_len) is ever written
+//
+bool lz_decompress(uint8_t *out, size_t out_len, const uint8_t *in, size_t in_len);
+
+//
+// Framed streams: input is cut into frames of LZ_MAX_INPUT bytes, each
+// stored as its length (big-endian u32), its stored length (big-endian u32)
+// and the stored bytes, which are the frame as it is when compression
+// doesn't make it smaller.
+//
+
+//
+// Opens a stream that reads infile and yields it compressed. Closing the
+// stream leaves infile open.
+//
+FILE *lz_reader(FILE *infile);
+
+//
+// Opens a stream that takes compressed data and writes it decompressed to
+// outfile. Closing the stream leaves outfile open; corrupt or truncated
+// input stops the program with an error.
+//
+FILE *lz_writer(FILE *outfile);
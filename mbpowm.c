@@ -0,0 +1,349 @@
+#include "mbpowm.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && GMP_NUMB_BITS == 64 && GMP_NAIL_BITS == 0
+#define MBPOWM_SIMD
+#include <immintrin.h>
+#endif
+
+// most digits of a POWM_FIXED_MAX-limb modulus in the narrowest radix
+#define MAX_DIGITS ((POWM_FIXED_MAX * 64 + 25) / 26)
+
+// r = a * b / R mod n on numbers laid out digit-major across the lanes,
+// with r fully reduced; r may alias a or b
+typedef void (*mbpowm_mul)(uint64_t *r, const uint64_t *a, const uint64_t *b, const mbpowm_ctx *ctx);
+
+struct mbpowm_ctx {
+    mpz_t n; // modulus
+    const powm_recoding *rec; // shared exponent
+    const char *name;
+    mbpowm_mul mul;
+    uint32_t lanes;
+    unsigned radix; // bits per digit
+    size_t digits; // digits per number, R = 2^(radix * digits)
+    uint64_t ninv; // -n^-1 mod 2^radix
+    uint64_t *np; // digits of n
+    uint64_t *r2; // R^2 mod n, in every lane
+    uint64_t *one; // 1, in every lane
+};
+
+struct mbpowm_scratch {
+    uint64_t *table; // odd powers of the bases, Montgomery form
+    uint64_t *acc;
+    uint64_t *x;
+    mpz_t t; // reduced base
+};
+
+// number of uint64_t in one multi-lane number
+static size_t lane_words(const mbpowm_ctx *ctx) {
+    return ctx->digits * ctx->lanes;
+}
+
+static uint64_t *lane_alloc(const mbpowm_ctx *ctx, size_t count) {
+    size_t bytes = count * lane_words(ctx) * sizeof(uint64_t);
+    return (uint64_t *) aligned_alloc(64, (bytes + 63) / 64 * 64);
+}
+
+// splits limbs into radix-bit digits and stores them in one lane of x
+static void lane_store(uint64_t *x, const mbpowm_ctx *ctx, uint32_t lane, const mp_limb_t *xp,
+    mp_size_t size) {
+    uint64_t mask = (UINT64_C(1) << ctx->radix) - 1;
+
+    for (size_t j = 0; j < ctx->digits; j++) {
+        size_t bit = j * ctx->radix, li = bit / 64, sh = bit % 64;
+        uint64_t d = 0;
+        if ((mp_size_t) li < size)
+            d = xp[li] >> sh;
+        if (sh + ctx->radix > 64 && (mp_size_t) li + 1 < size)
+            d |= xp[li + 1] << (64 - sh);
+        x[j * ctx->lanes + lane] = d & mask;
+    }
+}
+
+// joins the digits in one lane of x back into o
+static void lane_load(mpz_t o, const mbpowm_ctx *ctx, uint32_t lane, const uint64_t *x) {
+    mp_size_t size = (mp_size_t) ((ctx->digits * ctx->radix + 63) / 64);
+    mp_limb_t *op = mpz_limbs_write(o, size);
+    memset(op, 0, size * sizeof(mp_limb_t));
+
+    for (size_t j = 0; j < ctx->digits; j++) {
+        uint64_t d = x[j * ctx->lanes + lane];
+        size_t bit = j * ctx->radix, li = bit / 64, sh = bit % 64;
+        op[li] |= d << sh;
+        if (sh + ctx->radix > 64)
+            op[li + 1] |= d >> (64 - sh);
+    }
+    mpz_limbs_finish(o, size);
+}
+
+// x = v in every lane
+static void lane_broadcast(uint64_t *x, const mbpowm_ctx *ctx, const mpz_t v) {
+    for (uint32_t l = 0; l < ctx->lanes; l++)
+        lane_store(x, ctx, l, mpz_limbs_read(v), (mp_size_t) mpz_size(v));
+}
+
+#ifdef MBPOWM_SIMD
+
+// AVX-512 IFMA: each step adds the low and high 52 bits of a 52 x 52-bit
+// product into 64-bit accumulators, so carries only need resolving once at
+// the end; an accumulator collects at most digits * 2^54 < 2^64
+__attribute__((target("avx512f,avx512ifma"))) static void mul_ifma(
+    uint64_t *rp, const uint64_t *ap, const uint64_t *bp, const mbpowm_ctx *ctx) {
+    const __m512i *a = (const __m512i *) ap, *b = (const __m512i *) bp;
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i ninv = _mm512_set1_epi64((long long) ctx->ninv);
+    const __m512i mask = _mm512_set1_epi64((1LL << 52) - 1);
+    const uint64_t *np = ctx->np;
+    size_t L = ctx->digits;
+
+    __m512i t[2 * MAX_DIGITS + 1];
+    for (size_t j = 0; j <= 2 * L; j++)
+        t[j] = zero;
+
+    for (size_t i = 0; i < L; i++) {
+        __m512i *ti = t + i;
+        __m512i bi = _mm512_loadu_si512(b + i);
+
+        // m makes ti[0] + a[0] * bi + m * n[0] divisible by 2^52
+        ti[0] = _mm512_madd52lo_epu64(ti[0], _mm512_loadu_si512(a), bi);
+        __m512i m = _mm512_madd52lo_epu64(zero, ti[0], ninv);
+
+        for (size_t j = 0; j < L; j++) {
+            __m512i aj = _mm512_loadu_si512(a + j);
+            __m512i nj = _mm512_set1_epi64((long long) np[j]);
+            if (j > 0)
+                ti[j] = _mm512_madd52lo_epu64(ti[j], aj, bi);
+            ti[j] = _mm512_madd52lo_epu64(ti[j], m, nj);
+            ti[j + 1] = _mm512_madd52hi_epu64(ti[j + 1], aj, bi);
+            ti[j + 1] = _mm512_madd52hi_epu64(ti[j + 1], m, nj);
+        }
+        ti[1] = _mm512_add_epi64(ti[1], _mm512_srli_epi64(ti[0], 52));
+    }
+
+    // carry out to 52-bit digits; the result is below 2n, so one top bit at most
+    __m512i carry = zero;
+    for (size_t j = 0; j < L; j++) {
+        __m512i v = _mm512_add_epi64(t[L + j], carry);
+        t[L + j] = _mm512_and_si512(v, mask);
+        carry = _mm512_srli_epi64(v, 52);
+    }
+    carry = _mm512_add_epi64(carry, t[2 * L]);
+
+    // subtract n where the result is at least n
+    __m512i borrow = zero;
+    __m512i *d = t;
+    for (size_t j = 0; j < L; j++) {
+        __m512i v = _mm512_sub_epi64(
+            _mm512_sub_epi64(t[L + j], _mm512_set1_epi64((long long) np[j])), borrow);
+        d[j] = _mm512_and_si512(v, mask);
+        borrow = _mm512_srli_epi64(v, 63);
+    }
+    __mmask8 ge = _mm512_cmpge_epi64_mask(_mm512_sub_epi64(carry, borrow), zero);
+
+    __m512i *r = (__m512i *) rp;
+    for (size_t j = 0; j < L; j++)
+        _mm512_storeu_si512(r + j, _mm512_mask_blend_epi64(ge, t[L + j], d[j]));
+}
+
+// AVX2: 26-bit digits so that vpmuludq yields whole products; accumulators
+// take two products per step, at most digits * 2^53 < 2^64
+__attribute__((target("avx2"))) static void mul_avx2(
+    uint64_t *rp, const uint64_t *ap, const uint64_t *bp, const mbpowm_ctx *ctx) {
+    const __m256i *a = (const __m256i *) ap, *b = (const __m256i *) bp;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ninv = _mm256_set1_epi64x((long long) ctx->ninv);
+    const __m256i mask = _mm256_set1_epi64x((1LL << 26) - 1);
+    const uint64_t *np = ctx->np;
+    size_t L = ctx->digits;
+
+    __m256i t[2 * MAX_DIGITS + 1];
+    for (size_t j = 0; j <= 2 * L; j++)
+        t[j] = zero;
+
+    for (size_t i = 0; i < L; i++) {
+        __m256i *ti = t + i;
+        __m256i bi = _mm256_loadu_si256(b + i);
+
+        ti[0] = _mm256_add_epi64(ti[0], _mm256_mul_epu32(_mm256_loadu_si256(a), bi));
+        __m256i m = _mm256_and_si256(_mm256_mul_epu32(ti[0], ninv), mask);
+        ti[0] = _mm256_add_epi64(ti[0], _mm256_mul_epu32(m, _mm256_set1_epi64x((long long) np[0])));
+
+        for (size_t j = 1; j < L; j++) {
+            __m256i p = _mm256_mul_epu32(_mm256_loadu_si256(a + j), bi);
+            __m256i q = _mm256_mul_epu32(m, _mm256_set1_epi64x((long long) np[j]));
+            ti[j] = _mm256_add_epi64(ti[j], _mm256_add_epi64(p, q));
+        }
+        ti[1] = _mm256_add_epi64(ti[1], _mm256_srli_epi64(ti[0], 26));
+    }
+
+    __m256i carry = zero;
+    for (size_t j = 0; j < L; j++) {
+        __m256i v = _mm256_add_epi64(t[L + j], carry);
+        t[L + j] = _mm256_and_si256(v, mask);
+        carry = _mm256_srli_epi64(v, 26);
+    }
+    carry = _mm256_add_epi64(carry, t[2 * L]);
+
+    __m256i borrow = zero;
+    __m256i *d = t;
+    for (size_t j = 0; j < L; j++) {
+        __m256i v = _mm256_sub_epi64(
+            _mm256_sub_epi64(t[L + j], _mm256_set1_epi64x((long long) np[j])), borrow);
+        d[j] = _mm256_and_si256(v, mask);
+        borrow = _mm256_srli_epi64(v, 63);
+    }
+    // all ones in lanes where carry - borrow is negative, i.e. the result was below n
+    __m256i below = _mm256_cmpgt_epi64(zero, _mm256_sub_epi64(carry, borrow));
+
+    __m256i *r = (__m256i *) rp;
+    for (size_t j = 0; j < L; j++)
+        _mm256_storeu_si256(r + j, _mm256_blendv_epi8(d[j], t[L + j], below));
+}
+
+#endif
+
+// -n^-1 mod 2^bits for odd n
+static uint64_t neg_inverse(uint64_t n0, unsigned bits) {
+    uint64_t x = n0; // correct to 3 bits, each step doubles that
+    for (int i = 0; i < 5; i++)
+        x *= 2 - n0 * x;
+    return (0 - x) & ((UINT64_C(1) << bits) - 1);
+}
+
+mbpowm_ctx *mbpowm_create(const mpz_t n, const powm_recoding *rec, mbpowm_isa isa) {
+    if (mpz_odd_p(n) == 0 || mpz_cmp_ui(n, 1) <= 0 || mpz_size(n) > POWM_FIXED_MAX)
+        return NULL;
+
+    mbpowm_ctx ctx = { 0 };
+
+#ifdef MBPOWM_SIMD
+    __builtin_cpu_init();
+    bool ifma = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512ifma");
+    bool avx2 = __builtin_cpu_supports("avx2");
+
+    if ((isa == MBPOWM_AUTO || isa == MBPOWM_IFMA) && ifma) {
+        ctx.name = "ifma";
+        ctx.mul = mul_ifma;
+        ctx.lanes = 8;
+        ctx.radix = 52;
+    } else if (isa == MBPOWM_AVX2 && avx2) {
+        ctx.name = "avx2";
+        ctx.mul = mul_avx2;
+        ctx.lanes = 4;
+        ctx.radix = 26;
+    }
+#else
+    (void) isa;
+#endif
+
+    if (ctx.mul == NULL)
+        return NULL;
+
+    mbpowm_ctx *c = (mbpowm_ctx *) malloc(sizeof(mbpowm_ctx));
+    *c = ctx;
+    mpz_init_set(c->n, n);
+    c->rec = rec;
+    c->digits = (mpz_sizeinbase(n, 2) + c->radix - 1) / c->radix;
+    c->ninv = neg_inverse(mpz_getlimbn(n, 0), c->radix);
+
+    c->np = (uint64_t *) malloc(c->digits * sizeof(uint64_t));
+    mpz_t v;
+    mpz_init(v);
+    for (size_t j = 0; j < c->digits; j++) {
+        mpz_tdiv_q_2exp(v, n, j * c->radix);
+        c->np[j] = mpz_getlimbn(v, 0) & ((UINT64_C(1) << c->radix) - 1);
+    }
+
+    // R^2 mod n for entering Montgomery form
+    c->r2 = lane_alloc(c, 1);
+    mpz_set_ui(v, 1);
+    mpz_mul_2exp(v, v, 2 * c->digits * c->radix);
+    mpz_mod(v, v, n);
+    lane_broadcast(c->r2, c, v);
+
+    c->one = lane_alloc(c, 1);
+    mpz_set_ui(v, 1);
+    lane_broadcast(c->one, c, v);
+
+    mpz_clear(v);
+    return c;
+}
+
+void mbpowm_destroy(mbpowm_ctx *ctx) {
+    if (ctx == NULL)
+        return;
+    mpz_clear(ctx->n);
+    free(ctx->np);
+    free(ctx->r2);
+    free(ctx->one);
+    free(ctx);
+}
+
+uint32_t mbpowm_lanes(const mbpowm_ctx *ctx) {
+    return ctx->lanes;
+}
+
+const char *mbpowm_name(const mbpowm_ctx *ctx) {
+    return ctx->name;
+}
+
+mbpowm_scratch *mbpowm_scratch_create(const mbpowm_ctx *ctx) {
+    mbpowm_scratch *s = (mbpowm_scratch *) malloc(sizeof(mbpowm_scratch));
+    s->table = lane_alloc(ctx, (size_t) 1 << (ctx->rec->k - 1));
+    s->acc = lane_alloc(ctx, 1);
+    s->x = lane_alloc(ctx, 1);
+    mpz_init(s->t);
+    return s;
+}
+
+void mbpowm_scratch_destroy(mbpowm_scratch *s) {
+    if (s == NULL)
+        return;
+    free(s->table);
+    free(s->acc);
+    free(s->x);
+    mpz_clear(s->t);
+    free(s);
+}
+
+void mbpowm(const mbpowm_ctx *ctx, mbpowm_scratch *s, mpz_t *o, mpz_t *a, size_t count) {
+    const powm_recoding *rec = ctx->rec;
+    size_t words = lane_words(ctx);
+
+    // bases into the lanes, unused lanes zero
+    memset(s->x, 0, words * sizeof(uint64_t));
+    for (size_t l = 0; l < count; l++) {
+        mpz_srcptr base = a[l];
+        if (mpz_cmp(base, ctx->n) >= 0) {
+            mpz_mod(s->t, base, ctx->n);
+            base = s->t;
+        }
+        lane_store(s->x, ctx, (uint32_t) l, mpz_limbs_read(base), (mp_size_t) mpz_size(base));
+    }
+
+    // table[i] = x^(2i + 1), in Montgomery form
+    uint64_t *table = s->table;
+    ctx->mul(table, s->x, ctx->r2, ctx);
+    size_t entries = (size_t) 1 << (rec->k - 1);
+    if (entries > 1) {
+        ctx->mul(s->acc, table, table, ctx); // x^2
+        for (size_t i = 1; i < entries; i++)
+            ctx->mul(table + i * words, table + (i - 1) * words, s->acc, ctx);
+    }
+
+    memcpy(s->acc, table + rec->step[0].idx * words, words * sizeof(uint64_t));
+    for (size_t i = 1; i < rec->count; i++) {
+        for (uint32_t j = 0; j < rec->step[i].sqr; j++)
+            ctx->mul(s->acc, s->acc, s->acc, ctx);
+        ctx->mul(s->acc, s->acc, table + rec->step[i].idx * words, ctx);
+    }
+    for (uint32_t j = 0; j < rec->tail; j++)
+        ctx->mul(s->acc, s->acc, s->acc, ctx);
+
+    // leave Montgomery form
+    ctx->mul(s->acc, s->acc, ctx->one, ctx);
+    for (size_t l = 0; l < count; l++)
+        lane_load(o[l], ctx, (uint32_t) l, s->acc);
+}
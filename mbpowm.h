@@ -0,0 +1,75 @@
+#pragma once
+
+#include "powm.h"
+#include <gmp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Multi-buffer exponentiation: raises up to mbpowm_lanes() independent
+// bases to the same exponent mod the same odd modulus in lockstep, one base
+// per SIMD lane. Numbers are held digit by digit across the lanes, in radix
+// 2^52 for AVX-512 IFMA (8 lanes) or radix 2^26 for AVX2 (4 lanes), and
+// multiplied with word-by-word Montgomery reduction.
+//
+typedef enum {
+    MBPOWM_AUTO, // IFMA if the CPU has it; AVX2 only breaks even with powm, so never
+    MBPOWM_IFMA, // AVX-512 IFMA, radix 2^52, 8 lanes
+    MBPOWM_AVX2, // AVX2, radix 2^26, 4 lanes
+} mbpowm_isa;
+
+// most lanes of any kernel
+#define MBPOWM_MAX_LANES 8
+
+typedef struct mbpowm_ctx mbpowm_ctx;
+typedef struct mbpowm_scratch mbpowm_scratch;
+
+//
+// Creates a context for exponent rec mod n. rec is borrowed and must stay
+// valid until mbpowm_destroy.
+//
+// Provides:
+//  returns NULL if the CPU lacks the requested instructions, n is even, or
+//  n is larger than POWM_FIXED_MAX limbs
+//
+// Requires:
+//  n: modulus greater than 1
+//  rec: recoding of an exponent greater than 0
+//
+mbpowm_ctx *mbpowm_create(const mpz_t n, const powm_recoding *rec, mbpowm_isa isa);
+
+//
+// Frees the context.
+//
+void mbpowm_destroy(mbpowm_ctx *ctx);
+
+//
+// Number of bases processed per call.
+//
+uint32_t mbpowm_lanes(const mbpowm_ctx *ctx);
+
+//
+// Name of the kernel in use, e.g. for benchmark output.
+//
+const char *mbpowm_name(const mbpowm_ctx *ctx);
+
+//
+// Allocates the window table and temporaries for one thread.
+//
+mbpowm_scratch *mbpowm_scratch_create(const mbpowm_ctx *ctx);
+
+//
+// Frees scratch space.
+//
+void mbpowm_scratch_destroy(mbpowm_scratch *s);
+
+//
+// Sets o[i] = a[i]^e mod n for i in [0, count), where e is the exponent
+// recoded in rec.
+//
+// Requires:
+//  count: at most mbpowm_lanes(ctx)
+//  a: bases, 0 or greater; not modified
+//  o: initialized; may be the same array as a
+//
+void mbpowm(const mbpowm_ctx *ctx, mbpowm_scratch *s, mpz_t *o, mpz_t *a, size_t count);
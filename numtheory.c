@@ -1,9 +1,15 @@
 #include "randstate.h"
 #include <gmp.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 #include "numtheory.h"
+#include "powm.h"
+#include "smallprimes.h"
+#include "stats.h"
 
 // puts greatest common denominator of a and b into g
-void gcd(mpz_t g, const mpz_t a, const mpz_t b) {
+static void gcd_own(mpz_t g, const mpz_t a, const mpz_t b) {
     mpz_t t, a_copy, b_copy;
     mpz_inits(t, a_copy, b_copy, NULL);
 
@@ -21,9 +27,10 @@ void gcd(mpz_t g, const mpz_t a, const mpz_t b) {
 }
 
 // finds modular inverse of a and n
-void mod_inverse(mpz_t o, const mpz_t a, const mpz_t n) {
-    mpz_t remainder, remainder_prime, s, s_prime, t, t_prime, q;
-    mpz_inits(remainder, remainder_prime, s, s_prime, t, t_prime, q, NULL);
+static void mod_inverse_own(mpz_t o, const mpz_t a, const mpz_t n) {
+    // a_temp, s_temp and t_temp hold the previous values during each step
+    mpz_t remainder, remainder_prime, s, s_prime, t, t_prime, q, a_temp, s_temp, t_temp;
+    mpz_inits(remainder, remainder_prime, s, s_prime, t, t_prime, q, a_temp, s_temp, t_temp, NULL);
 
     mpz_set(remainder, n);
     mpz_set(remainder_prime, a);
@@ -36,8 +43,6 @@ void mod_inverse(mpz_t o, const mpz_t a, const mpz_t n) {
         mpz_fdiv_q(q, remainder, remainder_prime); // q = (remainder / remainder_prime)
 
         // store current values into a placeholder temporary variable
-        mpz_t a_temp, s_temp, t_temp;
-        mpz_inits(a_temp, s_temp, t_temp, NULL);
         mpz_set(a_temp, remainder);
         mpz_set(s_temp, s);
         mpz_set(t_temp, t);
@@ -54,13 +59,11 @@ void mod_inverse(mpz_t o, const mpz_t a, const mpz_t n) {
         mpz_set(t, t_prime); // t = t_prime
         mpz_mul(t_prime, q, t_prime); //t_prime = q * t_prime
         mpz_sub(t_prime, t_temp, t_prime); // t_prime = t_temp - t_prime
-
-        mpz_clears(a_temp, s_temp, t_temp, NULL);
     }
 
     if (mpz_cmp_ui(remainder, 1) > 0) {
         mpz_set_ui(o, 0);
-        mpz_clears(remainder, remainder_prime, s, s_prime, t, t_prime, q, NULL);
+        mpz_clears(remainder, remainder_prime, s, s_prime, t, t_prime, q, a_temp, s_temp, t_temp, NULL);
         return;
     }
 
@@ -69,33 +72,211 @@ void mod_inverse(mpz_t o, const mpz_t a, const mpz_t n) {
         mpz_add(t, t, n);
 
     mpz_set(o, t);
-    mpz_clears(remainder, remainder_prime, s, s_prime, t, t_prime, q, NULL);
+    mpz_clears(remainder, remainder_prime, s, s_prime, t, t_prime, q, a_temp, s_temp, t_temp, NULL);
 }
 
 // sets 'o' to the result of a^d mod n
-void pow_mod(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n) {
-    mpz_t v, p, i;
-    mpz_inits(v, p, i, NULL);
-    mpz_set_ui(v, 1);
-    mpz_set(p, a);
-    mpz_set(i, d);
+static void pow_mod_own(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n) {
+    powm_ctx ctx;
+    powm_init(&ctx, n);
+    powm(o, a, d, &ctx);
+    powm_clear(&ctx);
+}
+
+// true if n has a factor in the small prime table (and isn't that prime itself)
+static bool has_small_factor(const mpz_t n) {
+    bool small = mpz_cmp_ui(n, small_primes[SMALL_PRIMES - 1]) <= 0;
+
+    // one multi-precision division per group of primes whose product fits in a limb
+    for (int i = 0; i < SMALL_PRIMES;) {
+        unsigned long prod = small_primes[i];
+        int end = i + 1;
+        while (end < SMALL_PRIMES && prod <= ULONG_MAX / small_primes[end])
+            prod *= small_primes[end++];
+
+        unsigned long r = mpz_fdiv_ui(n, prod);
+        for (; i < end; i++) {
+            if (r % small_primes[i] == 0)
+                return small == false || mpz_cmp_ui(n, small_primes[i]) != 0;
+        }
+    }
+
+    return false;
+}
+
+// n - 1 = 2^s * m, with the reduction constants for n and the recoding of m
+// shared by every witness
+typedef struct {
+    mpz_t n_minus_one, y;
+    mp_bitcnt_t s;
+    powm_ctx ctx;
+    powm_recoding rec;
+} mr_state;
+
+static void mr_init(mr_state *mr, const mpz_t n) {
+    mpz_t m;
+    mpz_inits(mr->n_minus_one, mr->y, m, NULL);
+    mpz_sub_ui(mr->n_minus_one, n, 1);
+    mr->s = mpz_scan1(mr->n_minus_one, 0);
+    mpz_tdiv_q_2exp(m, mr->n_minus_one, mr->s);
+
+    powm_init(&mr->ctx, n);
+    powm_recode(&mr->rec, m);
+    mpz_clear(m);
+}
+
+static void mr_clear(mr_state *mr) {
+    powm_recoding_clear(&mr->rec);
+    powm_clear(&mr->ctx);
+    mpz_clears(mr->n_minus_one, mr->y, NULL);
+}
+
+// strong probable prime test of n to base a: a^m = 1, or a^(2^j * m) = -1
+// for some j < s
+static bool mr_witness(mr_state *mr, const mpz_t n, const mpz_t a) {
+    STATS_ADD(STAT_MR_ROUNDS, 1);
+    powm_recoded(mr->y, a, &mr->rec, &mr->ctx);
+    if (mpz_cmp_ui(mr->y, 1) == 0 || mpz_cmp(mr->y, mr->n_minus_one) == 0)
+        return true;
+
+    for (mp_bitcnt_t j = 1; j < mr->s; j++) {
+        mpz_mul(mr->y, mr->y, mr->y);
+        mpz_mod(mr->y, mr->y, n); // y = y^2 mod n
+
+        if (mpz_cmp_ui(mr->y, 1) == 0)
+            return false;
+        if (mpz_cmp(mr->y, mr->n_minus_one) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+// Miller-Rabin rounds that bring the chance of a random candidate of this
+// size passing as prime below 2^-80 (Damgard, Landrock and Pomerance;
+// Handbook of Applied Cryptography, table 4.4)
+uint64_t mr_rounds(uint64_t bits) {
+    static const struct {
+        uint16_t bits, rounds;
+    } table[] = { { 1300, 2 }, { 850, 3 }, { 650, 4 }, { 550, 5 }, { 450, 6 }, { 400, 7 },
+        { 350, 8 }, { 300, 9 }, { 250, 12 }, { 200, 15 }, { 150, 18 }, { 100, 27 } };
+
+    for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+        if (bits >= table[i].bits)
+            return table[i].rounds;
+    }
+    return 40; // the bound above doesn't reach this far down
+}
+
+// y = y / 2 mod n, for odd n
+static void half_mod(mpz_t y, const mpz_t n) {
+    if (mpz_odd_p(y))
+        mpz_add(y, y, n);
+    mpz_tdiv_q_2exp(y, y, 1);
+}
 
-    while ((mpz_cmp_ui(i, 0) > 0)) {
-        if (mpz_odd_p(i)) {
-            mpz_mul(v, v, p);
+// strong Lucas probable prime test with Selfridge's parameters: D is the
+// first of 5, -7, 9, -11, ... with (D/n) = -1, P = 1 and Q = (1 - D) / 4
+static bool lucas_strong(const mpz_t n) {
+    STATS_ADD(STAT_LUCAS_TESTS, 1);
+    // the search never ends for squares
+    if (mpz_perfect_square_p(n))
+        return false;
+
+    long d = 5;
+    mpz_t t;
+    mpz_init(t);
+    while (true) {
+        mpz_set_si(t, d);
+        int j = mpz_jacobi(t, n);
+        if (j == -1)
+            break;
+        if (j == 0 && mpz_cmpabs_ui(n, (unsigned long) labs(d)) != 0) {
+            mpz_clear(t);
+            return false; // |D| shares a factor with n
+        }
+        d = d > 0 ? -(d + 2) : -d + 2;
+    }
+    long q = (1 - d) / 4;
+
+    // n + 1 = 2^s * m
+    mpz_t m, u, v, qk, u2;
+    mpz_inits(m, u, v, qk, u2, NULL);
+    mpz_add_ui(m, n, 1);
+    mp_bitcnt_t s = mpz_scan1(m, 0);
+    mpz_tdiv_q_2exp(m, m, s);
+
+    // U_1 = 1, V_1 = P = 1, Q^1, then left to right over the bits of m:
+    // U_2k = U_k V_k, V_2k = V_k^2 - 2 Q^k, and
+    // U_k+1 = (P U_k + V_k) / 2, V_k+1 = (D U_k + P V_k) / 2
+    mpz_set_ui(u, 1);
+    mpz_set_ui(v, 1);
+    mpz_set_si(qk, q);
+    mpz_mod(qk, qk, n);
+    for (mp_bitcnt_t i = mpz_sizeinbase(m, 2) - 1; i-- > 0;) {
+        mpz_mul(u, u, v);
+        mpz_mod(u, u, n);
+        mpz_mul(v, v, v);
+        mpz_submul_ui(v, qk, 2);
+        mpz_mod(v, v, n);
+        mpz_mul(qk, qk, qk);
+        mpz_mod(qk, qk, n);
+
+        if (mpz_tstbit(m, i)) {
+            mpz_add(u2, u, v);
+            half_mod(u2, n);
+            mpz_mul_si(t, u, d);
+            mpz_add(v, v, t);
             mpz_mod(v, v, n);
+            half_mod(v, n);
+            mpz_mod(u, u2, n);
+            mpz_mul_si(qk, qk, q);
+            mpz_mod(qk, qk, n);
         }
-        mpz_mul(p, p, p);
-        mpz_mod(p, p, n);
-        mpz_fdiv_q_ui(i, i, 2);
     }
 
-    mpz_set(o, v);
-    mpz_clears(v, p, i, NULL);
+    // U_m = 0, or V_(2^r * m) = 0 for some r < s
+    bool prime = mpz_sgn(u) == 0 || mpz_sgn(v) == 0;
+    for (mp_bitcnt_t r = 1; r < s && prime == false; r++) {
+        mpz_mul(v, v, v);
+        mpz_submul_ui(v, qk, 2);
+        mpz_mod(v, v, n);
+        mpz_mul(qk, qk, qk);
+        mpz_mod(qk, qk, n);
+        prime = mpz_sgn(v) == 0;
+    }
+
+    mpz_clears(t, m, u, v, qk, u2, NULL);
+    return prime;
+}
+
+// Baillie-PSW: a strong test to base 2 and a strong Lucas test, with no
+// known composite passing both
+static bool bpsw(const mpz_t n) {
+    // the small prime table settles everything up to its largest prime
+    if (mpz_cmp_ui(n, small_primes[SMALL_PRIMES - 1]) <= 0)
+        return mpz_cmp_ui(n, 2) >= 0 && has_small_factor(n) == false;
+    if (mpz_even_p(n))
+        return false;
+
+    mr_state mr;
+    mr_init(&mr, n);
+    mpz_t two;
+    mpz_init_set_ui(two, 2);
+    bool prime = mr_witness(&mr, n, two);
+    mpz_clear(two);
+    mr_clear(&mr);
+
+    return prime == true && lucas_strong(n) == true;
 }
 
 // determines whether n is likely prime (true) or not (false)
-bool is_prime(const mpz_t n, uint64_t iters) {
+static bool is_prime_own(const mpz_t n, uint64_t iters) {
+    if (iters == ITERS_BPSW)
+        return bpsw(n);
+    if (iters == ITERS_ADAPTIVE)
+        iters = mr_rounds(mpz_sizeinbase(n, 2));
+
     // 0 and 1 are special cases which are neither prime nor composite, but we still want to return false
     if (mpz_cmp_ui(n, 0) == 0 || mpz_cmp_ui(n, 1) == 0)
         return false;
@@ -104,76 +285,91 @@ bool is_prime(const mpz_t n, uint64_t iters) {
     if (mpz_cmp_ui(n, 2) == 0 || mpz_cmp_ui(n, 3) == 0)
         return true;
 
-    // n_copy will be a copy of (n-1) to find out k
-    mpz_t n_copy, k, m;
-    mpz_inits(n_copy, k, m, NULL);
-
-    mpz_set(n_copy, n);
-    mpz_sub_ui(n_copy, n_copy, 1);
+    // witnesses are drawn from [2, n - 2]
+    mpz_t a, range;
+    mpz_inits(a, range, NULL);
+    mpz_sub_ui(range, n, 3);
+    mr_state mr;
+    mr_init(&mr, n);
+    bool prime = true;
 
-    // if (n-1) is even:
-    while (mpz_even_p(n_copy)) {
-        mpz_div_ui(n_copy, n_copy, 2);
-        mpz_add_ui(k, k, 1);
+    for (uint64_t i = 0; i < iters && prime == true; i++) {
+        mpz_urandomm(a, state, range);
+        mpz_add_ui(a, a, 2);
+        prime = mr_witness(&mr, n, a);
     }
 
-    mpz_set(m, n_copy);
-    mpz_set(n_copy, n);
-    mpz_sub_ui(n_copy, n, 3);
-
-    mpz_t n_minus_one;
-    mpz_init(n_minus_one);
-    mpz_set(n_minus_one, n);
-    mpz_sub_ui(n_minus_one, n, 1);
-
-    // set k to k-1
-    mpz_sub_ui(k, k, 1);
+    mr_clear(&mr);
+    mpz_clears(a, range, NULL);
+    return prime;
+}
 
-    // step two
-    mpz_t a;
-    mpz_init(a);
+static void gcd_gmp(mpz_t g, const mpz_t a, const mpz_t b) {
+    mpz_gcd(g, a, b);
+}
 
-    for (uint64_t i = 0; i < iters; i++) {
-        mpz_urandomm(a, state, n_copy);
-        mpz_add_ui(a, a, 2);
+// 0 when there is no inverse, as mod_inverse_own leaves it
+static void mod_inverse_gmp(mpz_t o, const mpz_t a, const mpz_t n) {
+    if (mpz_invert(o, a, n) == 0)
+        mpz_set_ui(o, 0);
+}
 
-        mpz_t y;
-        mpz_init(y);
-        pow_mod(y, a, m, n);
+static void pow_mod_gmp(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n) {
+    mpz_powm(o, a, d, n);
+}
 
-        if (mpz_cmp_ui(y, 1) != 0 && mpz_cmp(y, n_minus_one) != 0) {
+// Baillie-PSW, then iters - 24 Miller-Rabin rounds if iters is larger, so
+// ITERS_BPSW is Baillie-PSW alone; the witnesses come from GMP's own
+// generator rather than the thread's state
+static bool is_prime_gmp(const mpz_t n, uint64_t iters) {
+    if (iters == ITERS_BPSW)
+        iters = 1;
+    else if (iters == ITERS_ADAPTIVE)
+        iters = mr_rounds(mpz_sizeinbase(n, 2));
+    return mpz_probab_prime_p(n, iters < INT_MAX ? (int) iters : INT_MAX) != 0;
+}
 
-            mpz_t j;
-            mpz_init(j);
-            mpz_set_ui(j, 1);
+const nt_backend nt_backend_own = { "own", gcd_own, mod_inverse_own, pow_mod_own, is_prime_own };
+const nt_backend nt_backend_gmp = { "gmp", gcd_gmp, mod_inverse_gmp, pow_mod_gmp, is_prime_gmp };
 
-            while (mpz_cmp(j, k) <= 0 && mpz_cmp(y, n_minus_one) != 0) {
-                mpz_t two;
-                mpz_init(two);
-                mpz_set_ui(two, 2);
-                pow_mod(y, y, two, n);
+#ifdef SS_BACKEND_GMP
+#define BACKEND(f) f##_gmp
+const nt_backend *const nt_backend_active = &nt_backend_gmp;
+#else
+#define BACKEND(f) f##_own
+const nt_backend *const nt_backend_active = &nt_backend_own;
+#endif
 
-                if (mpz_cmp_ui(y, 1) == 0) {
-                    mpz_clears(n_copy, k, m, n_minus_one, a, y, j, two, NULL);
-                    return false;
-                }
+void gcd(mpz_t g, const mpz_t a, const mpz_t b) {
+    BACKEND(gcd)(g, a, b);
+}
 
-                mpz_add_ui(j, j, 1);
-                mpz_clear(two);
-            }
+void mod_inverse(mpz_t o, const mpz_t a, const mpz_t n) {
+    BACKEND(mod_inverse)(o, a, n);
+}
 
-            // if y is not equal to (n-1) -- if it's composite
-            if (mpz_cmp(y, n_minus_one) != 0) {
-                mpz_clears(n_copy, k, m, n_minus_one, a, y, j, NULL);
-                return false;
-            }
-            mpz_clear(j);
-        }
+void pow_mod(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n) {
+    STATS_START(t);
+    BACKEND(pow_mod)(o, a, d, n);
+    STATS_STOP(STAT_POWM_NS, t);
+}
 
-        mpz_clear(y);
-    }
+// GMP's backend runs its rounds out of sight, so only the time is counted for it
+bool is_prime(const mpz_t n, uint64_t iters) {
+    STATS_START(t);
+    bool prime = BACKEND(is_prime)(n, iters);
+    STATS_STOP(STAT_PRIME_NS, t);
+    return prime;
+}
 
-    mpz_clears(n_copy, k, m, n_minus_one, a, NULL);
+bool parse_iters(const char *arg, uint64_t *iters) {
+    char *end;
+    if (strcmp(arg, "bpsw") == 0)
+        *iters = ITERS_BPSW;
+    else if (strcmp(arg, "auto") == 0)
+        *iters = ITERS_ADAPTIVE;
+    else if (*arg < '0' || *arg > '9' || (*iters = strtoull(arg, &end, 10), *end != '\0'))
+        return false;
     return true;
 }
 
@@ -194,9 +390,155 @@ void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
         mpz_urandomb(p, state, bits);
         mpz_add(p, p, addition);
 
-        if (is_prime(p, iters) == true)
+        // cheap residue checks weed out most candidates before miller-rabin
+        STATS_ADD(STAT_PRIME_CANDIDATES, 1);
+        if (has_small_factor(p) == true)
+            STATS_ADD(STAT_PRIME_SIEVED, 1);
+        else if (is_prime(p, iters) == true)
             primeSatisfied = true;
+        else
+            STATS_ADD(STAT_PRIME_COMPOSITE, 1);
     }
 
     mpz_clear(addition);
 }
+
+// odd offsets from the start of a window that are sieved together
+#define SIEVE_WINDOW 2048
+
+// below this size a window would cover most of the range, so plain make_prime is used
+#define SIEVE_MIN_BITS 32
+
+// sets res[i] to n mod small_primes[i]
+static void small_residues(uint32_t *res, const mpz_t n) {
+    for (int i = 0; i < SMALL_PRIMES;) {
+        unsigned long prod = small_primes[i];
+        int end = i + 1;
+        while (end < SMALL_PRIMES && prod <= ULONG_MAX / small_primes[end])
+            prod *= small_primes[end++];
+
+        unsigned long r = mpz_fdiv_ui(n, prod);
+        for (; i < end; i++)
+            res[i] = r % small_primes[i];
+    }
+}
+
+// searches one window of odd candidates above a random start for a prime
+bool make_prime_window(mpz_t p, uint64_t bits, uint64_t iters) {
+    static _Thread_local uint32_t res[SMALL_PRIMES];
+    uint8_t composite[SIEVE_WINDOW] = { 0 };
+
+    // random odd start in the same range as make_prime: 2^(bits-1) up to 2^(bits-1) + 2^bits
+    mpz_t top;
+    mpz_init(top);
+    mpz_ui_pow_ui(top, 2, bits - 1);
+    mpz_urandomb(p, state, bits);
+    mpz_add(p, p, top);
+    mpz_setbit(p, 0);
+
+    // shrink the window so start + 2 * (window - 1) stays below the top of the range
+    mpz_mul_ui(top, top, 3);
+    mpz_sub(top, top, p);
+    mpz_fdiv_q_ui(top, top, 2);
+    size_t window = SIEVE_WINDOW;
+    if (mpz_cmp_ui(top, window) < 0)
+        window = mpz_get_ui(top);
+    mpz_clear(top);
+
+    // cross off start + 2i for every i where a small prime divides it; skip 2 as candidates are odd
+    small_residues(res, p);
+    for (int j = 1; j < SMALL_PRIMES; j++) {
+        uint32_t q = small_primes[j];
+        uint32_t i = (uint32_t) ((uint64_t) ((q - res[j]) % q) * ((q + 1) / 2) % q); // i = -r / 2 mod q
+        for (; i < window; i += q)
+            composite[i] = 1;
+    }
+
+    // test the survivors in order
+    size_t last = 0;
+    for (size_t i = 0; i < window; i++) {
+        STATS_ADD(STAT_PRIME_CANDIDATES, 1);
+        if (composite[i]) {
+            STATS_ADD(STAT_PRIME_SIEVED, 1);
+            continue;
+        }
+
+        mpz_add_ui(p, p, 2 * (i - last));
+        last = i;
+        if (is_prime(p, iters) == true)
+            return true;
+        STATS_ADD(STAT_PRIME_COMPOSITE, 1);
+    }
+
+    return false;
+}
+
+// make a prime number at least *bits* number of bits by sieving windows of consecutive odd numbers
+void make_prime_sieved(mpz_t p, uint64_t bits, uint64_t iters) {
+    if (bits < SIEVE_MIN_BITS) {
+        make_prime(p, bits, iters);
+        return;
+    }
+
+    while (make_prime_window(p, bits, iters) == false)
+        ;
+}
+
+void prime_search_init(prime_search *ps, uint32_t threads) {
+    ps->workers = pool_create(threads);
+    ps->ranks = pool_size(ps->workers);
+    ps->streams = (gmp_randstate_t *) malloc(ps->ranks * sizeof(gmp_randstate_t));
+    ps->cand = (mpz_t *) malloc(ps->ranks * sizeof(mpz_t));
+    ps->found = (bool *) calloc(ps->ranks, sizeof(bool));
+
+    for (uint32_t i = 0; i < ps->ranks; i++) {
+        randstate_stream_init(ps->streams[i]);
+        mpz_init(ps->cand[i]);
+    }
+}
+
+void prime_search_clear(prime_search *ps) {
+    pool_destroy(ps->workers);
+    for (uint32_t i = 0; i < ps->ranks; i++) {
+        gmp_randclear(ps->streams[i]);
+        mpz_clear(ps->cand[i]);
+    }
+    free(ps->streams);
+    free(ps->cand);
+    free(ps->found);
+}
+
+typedef struct {
+    prime_search *ps;
+    uint64_t bits, iters;
+} search_round;
+
+// searches one window with the rank's own random stream, whichever thread runs it
+static void search_rank(void *arg, size_t rank, uint32_t worker) {
+    search_round *r = (search_round *) arg;
+    prime_search *ps = r->ps;
+    (void) worker;
+
+    randstate_ptr prev = randstate_use(ps->streams[rank]);
+    ps->found[rank] = make_prime_window(ps->cand[rank], r->bits, r->iters);
+    randstate_use(prev);
+}
+
+void make_prime_parallel(mpz_t p, uint64_t bits, uint64_t iters, prime_search *ps) {
+    if (bits < SIEVE_MIN_BITS || ps->ranks == 1) {
+        make_prime_sieved(p, bits, iters);
+        return;
+    }
+
+    search_round r = { ps, bits, iters };
+    while (true) {
+        pool_run(ps->workers, search_rank, &r, ps->ranks);
+
+        for (uint32_t i = 0; i < ps->ranks; i++) {
+            if (ps->found[i] == true) {
+                mpz_set(p, ps->cand[i]);
+                return;
+            }
+        }
+    }
+}
@@ -4,6 +4,7 @@
 #include <gmp.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include "pool.h"
 
 void gcd(mpz_t g, const mpz_t a, const mpz_t b);
 
@@ -11,6 +12,102 @@ void mod_inverse(mpz_t o, const mpz_t a, const mpz_t n);
 
 void pow_mod(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n);
 
+//
+// Values of iters, for is_prime and everything that takes iters down to it,
+// that pick a test instead of a number of Miller-Rabin rounds.
+//
+// ITERS_BPSW: Baillie-PSW, a strong test to base 2 plus a strong Lucas test;
+//  about three exponentiations, and no composite is known to pass it
+// ITERS_ADAPTIVE: mr_rounds(bits of n) rounds with random bases
+//
+#define ITERS_BPSW     UINT64_MAX
+#define ITERS_ADAPTIVE (UINT64_MAX - 1)
+
 bool is_prime(const mpz_t n, uint64_t iters);
 
+//
+// Miller-Rabin rounds with random bases that make the chance of a random
+// odd candidate of this many bits passing as prime at most 2^-80.
+//
+uint64_t mr_rounds(uint64_t bits);
+
+//
+// Parses an iters option: a number of Miller-Rabin rounds, "bpsw" or "auto".
+//
+// Provides:
+//  iters: the rounds, ITERS_BPSW or ITERS_ADAPTIVE
+//  returns false if arg is none of these
+//
+bool parse_iters(const char *arg, uint64_t *iters);
+
+//
+// One implementation of the four primitives above. The build picks which
+// one they call: the Euclid, Montgomery and Miller-Rabin code in
+// numtheory.c by default, or GMP's mpz_gcd, mpz_invert, mpz_powm and
+// mpz_probab_prime_p with make BACKEND=gmp (SS_BACKEND_GMP). Both are always
+// linked in, so ssbench -N can check them against each other.
+//
+typedef struct {
+    const char *name;
+    void (*gcd)(mpz_t g, const mpz_t a, const mpz_t b);
+    void (*mod_inverse)(mpz_t o, const mpz_t a, const mpz_t n);
+    void (*pow_mod)(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n);
+    bool (*is_prime)(const mpz_t n, uint64_t iters);
+} nt_backend;
+
+extern const nt_backend nt_backend_own, nt_backend_gmp;
+
+// the backend gcd, mod_inverse, pow_mod and is_prime call in this build
+extern const nt_backend *const nt_backend_active;
+
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
+
+//
+// Searches one window of consecutive odd numbers above a random start drawn
+// from the same range as make_prime. Candidates with small factors are sieved out up front,
+// the rest are tested in order.
+//
+// Provides:
+//  p: the first prime in the window
+//  returns false if the window held no prime
+//
+// Requires:
+//  bits: at least 32
+//
+bool make_prime_window(mpz_t p, uint64_t bits, uint64_t iters);
+
+//
+// Makes a prime of at least *bits* bits with incremental sieved search:
+// one random start per window instead of one per candidate.
+//
+void make_prime_sieved(mpz_t p, uint64_t bits, uint64_t iters);
+
+//
+// State for searching for primes on several threads: a worker pool plus one
+// random stream and one candidate per rank.
+//
+typedef struct {
+    pool *workers;
+    uint32_t ranks; // independent searches per round
+    gmp_randstate_t *streams; // random stream of each rank
+    mpz_t *cand; // candidate found by each rank
+    bool *found; // whether each rank found a prime this round
+} prime_search;
+
+//
+// Starts a parallel prime search with one rank per thread. The rank streams
+// are derived from the master seed, so randstate_init must come first.
+//
+void prime_search_init(prime_search *ps, uint32_t threads);
+
+//
+// Stops the search's threads and frees its memory.
+//
+void prime_search_clear(prime_search *ps);
+
+//
+// Makes a prime of at least *bits* bits, with every rank sieving its own
+// window per round. The lowest rank that found a prime wins the round, so the
+// result only depends on the seed and the number of threads.
+//
+void make_prime_parallel(mpz_t p, uint64_t bits, uint64_t iters, prime_search *ps);
@@ -0,0 +1,151 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct pool {
+    uint32_t size; // threads, including the caller
+    pthread_t *threads; // size - 1 background workers
+
+    pthread_mutex_t lock;
+    pthread_cond_t start; // signalled when a new job is posted
+    pthread_cond_t done; // signalled when a worker finishes a job
+
+    uint64_t generation; // incremented for every posted job
+    uint32_t busy; // background workers still running the current job
+    bool quit;
+
+    pool_fn fn;
+    void *arg;
+    size_t count;
+    atomic_size_t next; // next index to hand out
+};
+
+typedef struct {
+    pool *p;
+    uint32_t worker;
+} worker_arg;
+
+// claims indices until the current job is exhausted
+static void drain(pool *p, uint32_t worker) {
+    size_t i;
+    while ((i = atomic_fetch_add_explicit(&p->next, 1, memory_order_relaxed)) < p->count)
+        p->fn(p->arg, i, worker);
+}
+
+static void *worker_main(void *argp) {
+    worker_arg *wa = (worker_arg *) argp;
+    pool *p = wa->p;
+    uint32_t worker = wa->worker;
+    free(wa);
+
+    uint64_t seen = 0;
+    pthread_mutex_lock(&p->lock);
+
+    while (true) {
+        while (p->generation == seen && p->quit == false)
+            pthread_cond_wait(&p->start, &p->lock);
+
+        if (p->quit == true)
+            break;
+        seen = p->generation;
+
+        pthread_mutex_unlock(&p->lock);
+        drain(p, worker);
+        pthread_mutex_lock(&p->lock);
+
+        if (--p->busy == 0)
+            pthread_cond_signal(&p->done);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+uint32_t pool_max_threads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t cap = cpus > 0 ? (uint32_t) cpus * POOL_THREADS_PER_CPU : 0;
+    return cap > POOL_THREADS_MIN_CAP ? cap : POOL_THREADS_MIN_CAP;
+}
+
+bool pool_parse_threads(const char *arg, uint32_t *threads) {
+    // strtoul would take a sign and wrap "-1" around
+    if (arg == NULL || *arg < '0' || *arg > '9')
+        return false;
+
+    char *end;
+    unsigned long v = strtoul(arg, &end, 10);
+    if (*end != '\0' || v < 1 || v > pool_max_threads())
+        return false;
+    *threads = (uint32_t) v;
+    return true;
+}
+
+pool *pool_create(uint32_t threads) {
+    pool *p = (pool *) calloc(1, sizeof(pool));
+    p->size = threads > 1 ? threads : 1;
+    p->threads = (pthread_t *) calloc(p->size, sizeof(pthread_t));
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+    atomic_init(&p->next, 0);
+
+    // worker 0 is the thread that calls pool_run
+    for (uint32_t i = 1; i < p->size; i++) {
+        worker_arg *wa = (worker_arg *) malloc(sizeof(worker_arg));
+        wa->p = p;
+        wa->worker = i;
+        pthread_create(&p->threads[i - 1], NULL, worker_main, wa);
+    }
+
+    return p;
+}
+
+uint32_t pool_size(const pool *p) {
+    return p->size;
+}
+
+void pool_run(pool *p, pool_fn fn, void *arg, size_t count) {
+    p->fn = fn;
+    p->arg = arg;
+    p->count = count;
+    atomic_store(&p->next, 0);
+
+    // a single index or a single thread is not worth waking anyone up for
+    if (p->size == 1 || count <= 1) {
+        drain(p, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->generation++;
+    p->busy = p->size - 1;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    drain(p, 0);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->busy > 0)
+        pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_destroy(pool *p) {
+    pthread_mutex_lock(&p->lock);
+    p->quit = true;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    for (uint32_t i = 1; i < p->size; i++)
+        pthread_join(p->threads[i - 1], NULL);
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->start);
+    pthread_cond_destroy(&p->done);
+    free(p->threads);
+    free(p);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Fixed-size pool of worker threads that run data-parallel jobs.
+//
+typedef struct pool pool;
+
+//
+// Job run once per index. worker identifies the calling thread, from 0 to
+// pool_size() - 1, so jobs can keep per-thread scratch space.
+//
+typedef void (*pool_fn)(void *arg, size_t index, uint32_t worker);
+
+//
+// Most threads a -t option may ask for: POOL_THREADS_PER_CPU per online
+// CPU, but never fewer than POOL_THREADS_MIN_CAP.
+//
+#define POOL_THREADS_PER_CPU 4
+#define POOL_THREADS_MIN_CAP 8
+uint32_t pool_max_threads(void);
+
+//
+// Parses a thread count.
+//
+// Provides:
+//  threads: the count, if true is returned
+//  returns false unless arg is a whole number from 1 to pool_max_threads()
+//
+bool pool_parse_threads(const char *arg, uint32_t *threads);
+
+//
+// Starts a pool of the given number of threads. The calling thread counts
+// as one of them, so a pool of 1 (or 0) runs every job in-line.
+//
+pool *pool_create(uint32_t threads);
+
+//
+// Number of threads in the pool, including the calling thread.
+//
+uint32_t pool_size(const pool *p);
+
+//
+// Runs fn(arg, i, worker) for every i in [0, count) across the pool.
+// Returns once every index has been processed.
+//
+void pool_run(pool *p, pool_fn fn, void *arg, size_t count);
+
+//
+// Stops the worker threads and frees the pool.
+//
+void pool_destroy(pool *p);
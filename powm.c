@@ -0,0 +1,331 @@
+#include "powm.h"
+#include <stdlib.h>
+#include <gmp.h>
+
+// exponents shorter than this skip the conversion into Montgomery form
+#define MONT_MIN_BITS 16
+
+// computes -n^-1 mod 2^GMP_NUMB_BITS for odd n0 with Newton iteration
+static mp_limb_t limb_inverse(mp_limb_t n0) {
+    mp_limb_t inv = n0; // correct to 3 bits since n0 * n0 = 1 mod 8
+
+    // every iteration doubles the number of correct bits
+    for (int i = 0; i < 6; i++)
+        inv *= 2 - n0 * inv;
+
+    return -inv;
+}
+
+// copies x into size limbs, zero-padding the high end
+static void limbs_pad(mp_limb_t *rp, const mpz_t x, mp_size_t size) {
+    mp_size_t xs = mpz_size(x);
+    mpn_copyi(rp, mpz_limbs_read(x), xs);
+    mpn_zero(rp + xs, size - xs);
+}
+
+static powm_kernel fixed_kernel(mp_size_t size);
+static void powm_mont_any(
+    mp_limb_t *op, const mp_limb_t *bp, const powm_recoding *rec, const powm_ctx *ctx);
+
+void powm_init(powm_ctx *ctx, const mpz_t n) {
+    mpz_init_set(ctx->n, n);
+    ctx->size = mpz_size(n);
+    ctx->mont = mpz_odd_p(n) && mpz_cmp_ui(n, 1) > 0;
+    ctx->ninv = ctx->mont ? limb_inverse(mpz_getlimbn(n, 0)) : 0;
+    ctx->r2 = NULL;
+    ctx->kernel = NULL;
+    ctx->borrowed = false;
+
+    if (ctx->mont) {
+        // R^2 mod n, so entering Montgomery form is a multiply instead of a division
+        mpz_t t;
+        mpz_init(t);
+        mpz_setbit(t, 2 * ctx->size * GMP_NUMB_BITS);
+        mpz_mod(t, t, n);
+        mp_limb_t *r2 = (mp_limb_t *) malloc(ctx->size * sizeof(mp_limb_t));
+        limbs_pad(r2, t, ctx->size);
+        ctx->r2 = r2;
+        mpz_clear(t);
+
+        ctx->kernel = fixed_kernel(ctx->size);
+        if (ctx->kernel == NULL)
+            ctx->kernel = powm_mont_any;
+    }
+}
+
+void powm_init_precomputed(
+    powm_ctx *ctx, const mp_limb_t *np, mp_size_t size, mp_limb_t ninv, const mp_limb_t *r2) {
+    mpz_roinit_n(ctx->n, np, size);
+    ctx->size = size;
+    ctx->mont = true;
+    ctx->ninv = ninv;
+    ctx->r2 = r2;
+    ctx->borrowed = true;
+
+    ctx->kernel = fixed_kernel(size);
+    if (ctx->kernel == NULL)
+        ctx->kernel = powm_mont_any;
+}
+
+void powm_clear(powm_ctx *ctx) {
+    if (ctx->borrowed)
+        return;
+    mpz_clear(ctx->n);
+    free((mp_limb_t *) ctx->r2);
+}
+
+unsigned powm_window(size_t bits) {
+    // thresholds where one more window bit saves more multiplies than the table costs
+    static const size_t limits[] = { 7, 25, 80, 240, 672, 1792 };
+    unsigned k = 1;
+
+    while (k <= sizeof(limits) / sizeof(limits[0]) && bits > limits[k - 1])
+        k++;
+
+    return k;
+}
+
+void powm_recode(powm_recoding *rec, const mpz_t d) {
+    size_t bits = mpz_sizeinbase(d, 2);
+    rec->bits = bits;
+    rec->k = powm_window(bits);
+    rec->step = (powm_step *) malloc(bits * sizeof(powm_step)); // at most one window per bit
+    rec->count = 0;
+
+    uint32_t zeros = 0; // squarings collected since the last window
+    long i = (long) bits - 1;
+
+    while (i >= 0) {
+        if (mpz_tstbit(d, i) == 0) {
+            zeros++;
+            i--;
+            continue;
+        }
+
+        // widest window starting at bit i that ends in a 1 bit
+        long l = i - (long) rec->k + 1;
+        if (l < 0)
+            l = 0;
+        while (mpz_tstbit(d, l) == 0)
+            l++;
+
+        uint32_t val = 0;
+        for (long b = i; b >= l; b--)
+            val = (val << 1) | mpz_tstbit(d, b);
+
+        rec->step[rec->count].sqr = zeros + (uint32_t) (i - l + 1);
+        rec->step[rec->count].idx = val >> 1;
+        rec->count++;
+
+        zeros = 0;
+        i = l - 1;
+    }
+
+    rec->tail = zeros;
+}
+
+void powm_recoding_clear(powm_recoding *rec) {
+    free(rec->step);
+    rec->step = NULL;
+    rec->count = 0;
+}
+
+// Montgomery reduction of the 2 * s limbs at tp into rp; tp is clobbered.
+// Always inlined, so s is a compile-time constant inside the fixed kernels.
+static inline __attribute__((always_inline)) void redc(
+    mp_limb_t *rp, mp_limb_t *tp, const mp_limb_t *np, mp_limb_t ninv, mp_size_t s) {
+    // clear one low limb at a time, parking each carry in the cleared limb
+    for (mp_size_t i = 0; i < s; i++) {
+        mp_limb_t q = tp[i] * ninv;
+        tp[i] = mpn_addmul_1(tp + i, np, s, q);
+    }
+
+    mp_limb_t cy = mpn_add_n(rp, tp + s, tp, s);
+    if (cy != 0 || mpn_cmp(rp, np, s) >= 0)
+        mpn_sub_n(rp, rp, np, s);
+}
+
+// rp = ap * bp / R mod n
+static inline __attribute__((always_inline)) void mulredc(mp_limb_t *rp, const mp_limb_t *ap,
+    const mp_limb_t *bp, mp_limb_t *tp, const mp_limb_t *np, mp_limb_t ninv, mp_size_t s) {
+    if (ap == bp)
+        mpn_sqr(tp, ap, s);
+    else
+        mpn_mul_n(tp, ap, bp, s);
+    redc(rp, tp, np, ninv, s);
+}
+
+// sliding-window exponentiation in Montgomery form, with table holding
+// 2^(k-1) * s limbs, acc s limbs and tp 2 * s limbs
+static inline __attribute__((always_inline)) void mont_ladder(mp_limb_t *op, const mp_limb_t *bp,
+    const powm_recoding *rec, const powm_ctx *ctx, mp_limb_t *table, mp_limb_t *acc,
+    mp_limb_t *tp, mp_size_t s) {
+    const mp_limb_t *np = mpz_limbs_read(ctx->n);
+    mp_limb_t ninv = ctx->ninv;
+    size_t entries = (size_t) 1 << (rec->k - 1);
+
+    // table[0] = base * R mod n
+    mulredc(table, bp, ctx->r2, tp, np, ninv, s);
+
+    // table[i] = table[i - 1] * base^2
+    if (entries > 1) {
+        mulredc(acc, table, table, tp, np, ninv, s);
+        for (size_t i = 1; i < entries; i++)
+            mulredc(table + i * s, table + (i - 1) * s, acc, tp, np, ninv, s);
+    }
+
+    mpn_copyi(acc, table + rec->step[0].idx * s, s);
+    for (size_t i = 1; i < rec->count; i++) {
+        for (uint32_t j = 0; j < rec->step[i].sqr; j++)
+            mulredc(acc, acc, acc, tp, np, ninv, s);
+        mulredc(acc, acc, table + rec->step[i].idx * s, tp, np, ninv, s);
+    }
+    for (uint32_t j = 0; j < rec->tail; j++)
+        mulredc(acc, acc, acc, tp, np, ninv, s);
+
+    // leave Montgomery form: acc * 1 / R mod n
+    mpn_copyi(tp, acc, s);
+    mpn_zero(tp + s, s);
+    redc(op, tp, np, ninv, s);
+}
+
+// Montgomery exponentiation for any size, with scratch on the heap
+static void powm_mont_any(
+    mp_limb_t *op, const mp_limb_t *bp, const powm_recoding *rec, const powm_ctx *ctx) {
+    mp_size_t s = ctx->size;
+    size_t entries = (size_t) 1 << (rec->k - 1);
+
+    // table of odd powers, accumulator, and a double-width product buffer
+    mp_limb_t *table = (mp_limb_t *) malloc((entries + 3) * s * sizeof(mp_limb_t));
+    mont_ladder(op, bp, rec, ctx, table, table + entries * s, table + (entries + 1) * s, s);
+    free(table);
+}
+
+// largest table of odd powers powm_window asks for
+#define TABLE_MAX 64
+
+// Montgomery exponentiation compiled for exactly N limbs
+#define POWM_FIXED(N)                                                                              \
+    static void powm_fixed_##N(                                                                    \
+        mp_limb_t *op, const mp_limb_t *bp, const powm_recoding *rec, const powm_ctx *ctx) {       \
+        mp_limb_t table[TABLE_MAX * N], acc[N], tp[2 * N];                                         \
+        mont_ladder(op, bp, rec, ctx, table, acc, tp, N);                                          \
+    }
+
+#define POWM_FIXED_ENTRY(N) powm_fixed_##N,
+
+// POWM_FIXED_MIN to POWM_FIXED_MAX limbs
+#define POWM_FIXED_SIZES(X)                                                                        \
+    X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) X(16) X(17) X(18) X(19)      \
+    X(20) X(21) X(22) X(23) X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31) X(32) X(33) X(34)      \
+    X(35) X(36) X(37) X(38) X(39) X(40) X(41) X(42) X(43) X(44) X(45) X(46) X(47) X(48) X(49)      \
+    X(50) X(51) X(52) X(53) X(54) X(55) X(56) X(57) X(58) X(59) X(60) X(61) X(62) X(63) X(64)      \
+    X(65)
+
+POWM_FIXED_SIZES(POWM_FIXED)
+
+static const powm_kernel fixed_kernels[] = { POWM_FIXED_SIZES(POWM_FIXED_ENTRY) };
+
+// the kernel compiled for size limbs, or NULL if there isn't one
+static powm_kernel fixed_kernel(mp_size_t size) {
+    if (size < POWM_FIXED_MIN || size > POWM_FIXED_MAX)
+        return NULL;
+    return fixed_kernels[size - POWM_FIXED_MIN];
+}
+
+// exponentiation with Montgomery multiplication for odd moduli
+static void powm_mont(mpz_t o, const mpz_t a, const powm_recoding *rec, const powm_ctx *ctx) {
+    mp_size_t s = ctx->size;
+    mp_limb_t fixed[POWM_FIXED_MAX];
+    mp_limb_t *bp = s <= POWM_FIXED_MAX ? fixed : (mp_limb_t *) malloc(s * sizeof(mp_limb_t));
+
+    // base as s limbs, only divided when it isn't already below n
+    if (mpz_sgn(a) >= 0 && mpz_cmp(a, ctx->n) < 0) {
+        limbs_pad(bp, a, s);
+    } else {
+        mpz_t t;
+        mpz_init(t);
+        mpz_mod(t, a, ctx->n);
+        limbs_pad(bp, t, s);
+        mpz_clear(t);
+    }
+
+    // a has been read, so o may be the same mpz_t
+    mp_limb_t *op = mpz_limbs_write(o, s);
+    ctx->kernel(op, bp, rec, ctx);
+    mpz_limbs_finish(o, s);
+
+    if (bp != fixed)
+        free(bp);
+}
+
+// exponentiation with plain mpz multiply and reduce
+static void powm_plain(mpz_t o, const mpz_t base, const powm_recoding *rec, const powm_ctx *ctx) {
+    size_t entries = (size_t) 1 << (rec->k - 1);
+    mpz_t *table = (mpz_t *) malloc(entries * sizeof(mpz_t));
+    mpz_t acc;
+    mpz_init(acc);
+
+    mpz_init_set(table[0], base);
+    if (entries > 1) {
+        mpz_mul(acc, base, base);
+        mpz_mod(acc, acc, ctx->n);
+        for (size_t i = 1; i < entries; i++) {
+            mpz_init(table[i]);
+            mpz_mul(table[i], table[i - 1], acc);
+            mpz_mod(table[i], table[i], ctx->n);
+        }
+    }
+
+    mpz_set(acc, table[rec->step[0].idx]);
+    for (size_t i = 1; i < rec->count; i++) {
+        for (uint32_t j = 0; j < rec->step[i].sqr; j++) {
+            mpz_mul(acc, acc, acc);
+            mpz_mod(acc, acc, ctx->n);
+        }
+        mpz_mul(acc, acc, table[rec->step[i].idx]);
+        mpz_mod(acc, acc, ctx->n);
+    }
+    for (uint32_t j = 0; j < rec->tail; j++) {
+        mpz_mul(acc, acc, acc);
+        mpz_mod(acc, acc, ctx->n);
+    }
+
+    mpz_swap(o, acc);
+
+    for (size_t i = 0; i < entries; i++)
+        mpz_clear(table[i]);
+    free(table);
+    mpz_clear(acc);
+}
+
+void powm_recoded(mpz_t o, const mpz_t a, const powm_recoding *rec, const powm_ctx *ctx) {
+    // a^0 = 1, and everything is 0 mod 1
+    if (rec->count == 0 || mpz_cmp_ui(ctx->n, 1) == 0) {
+        mpz_set_ui(o, mpz_cmp_ui(ctx->n, 1) != 0);
+        return;
+    }
+
+    if (ctx->mont && rec->bits >= MONT_MIN_BITS) {
+        powm_mont(o, a, rec, ctx);
+        return;
+    }
+
+    mpz_t base;
+    mpz_init(base);
+    mpz_mod(base, a, ctx->n);
+    powm_plain(o, base, rec, ctx);
+    mpz_clear(base);
+}
+
+void powm(mpz_t o, const mpz_t a, const mpz_t d, const powm_ctx *ctx) {
+    if (mpz_sgn(d) == 0) {
+        mpz_set_ui(o, mpz_cmp_ui(ctx->n, 1) != 0);
+        return;
+    }
+
+    powm_recoding rec;
+    powm_recode(&rec, d);
+    powm_recoded(o, a, &rec, ctx);
+    powm_recoding_clear(&rec);
+}
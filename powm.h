@@ -0,0 +1,109 @@
+#pragma once
+
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Sliding-window recoding of an exponent. Exponentiation starts from
+// table[step[0].idx], then for every later step squares step[i].sqr times
+// and multiplies by table[step[i].idx], and finally squares tail times.
+// table[i] holds base^(2i + 1).
+//
+typedef struct {
+    uint32_t sqr; // squarings before the multiply
+    uint32_t idx; // index into the table of odd powers
+} powm_step;
+
+typedef struct {
+    powm_step *step; // windows, most significant first
+    size_t count; // number of windows
+    uint32_t tail; // squarings after the last window
+    size_t bits; // bit length of the exponent
+    unsigned k; // window size in bits
+} powm_recoding;
+
+//
+// Precomputed state for repeated exponentiation mod a fixed modulus.
+// Odd moduli use Montgomery multiplication on raw limbs, even moduli
+// fall back to mpz multiply and reduce. Moduli of POWM_FIXED_MIN to
+// POWM_FIXED_MAX limbs (every modulus of a key up to 4096 bits) get a
+// kernel compiled for exactly that many limbs, with all scratch on the
+// stack.
+//
+#define POWM_FIXED_MIN 4
+#define POWM_FIXED_MAX 65
+
+typedef struct powm_ctx powm_ctx;
+
+// op = bp^rec mod n on size-limb operands; bp is reduced, op may alias bp
+typedef void (*powm_kernel)(
+    mp_limb_t *op, const mp_limb_t *bp, const powm_recoding *rec, const powm_ctx *ctx);
+
+struct powm_ctx {
+    mpz_t n; // modulus
+    mp_size_t size; // limbs in n
+    mp_limb_t ninv; // -n^-1 mod 2^GMP_NUMB_BITS
+    const mp_limb_t *r2; // R^2 mod n, size limbs, for entering Montgomery form
+    powm_kernel kernel; // Montgomery exponentiation for this size
+    bool mont; // true if n is odd and Montgomery reduction applies
+    bool borrowed; // n and r2 point into memory the context does not own
+};
+
+//
+// Initializes the context for modulus n.
+//
+// Requires:
+//  n: modulus greater than 0
+//
+void powm_init(powm_ctx *ctx, const mpz_t n);
+
+//
+// Initializes the context from precomputed values without copying them,
+// e.g. straight out of a mapped key file. The limbs must stay valid and
+// unchanged until powm_clear.
+//
+// Requires:
+//  np: size limbs of an odd modulus greater than 1, most significant limb nonzero
+//  ninv: -n^-1 mod 2^GMP_NUMB_BITS
+//  r2: size limbs of R^2 mod n, where R = 2^(size * GMP_NUMB_BITS)
+//
+void powm_init_precomputed(
+    powm_ctx *ctx, const mp_limb_t *np, mp_size_t size, mp_limb_t ninv, const mp_limb_t *r2);
+
+//
+// Frees any memory used by the context.
+//
+void powm_clear(powm_ctx *ctx);
+
+//
+// Picks the sliding window size for an exponent of the given bit length.
+//
+unsigned powm_window(size_t bits);
+
+//
+// Recodes exponent d into sliding windows of powm_window(bits of d).
+//
+// Requires:
+//  d: exponent greater than 0
+//
+void powm_recode(powm_recoding *rec, const mpz_t d);
+
+//
+// Frees any memory used by the recoding.
+//
+void powm_recoding_clear(powm_recoding *rec);
+
+//
+// Sets o to a^d mod n, where n is the modulus of ctx.
+//
+// Requires:
+//  d: exponent, 0 or greater
+//  all mpz_t arguments to be initialized
+//
+void powm(mpz_t o, const mpz_t a, const mpz_t d, const powm_ctx *ctx);
+
+//
+// Sets o to a^d mod n for an exponent that has already been recoded.
+//
+void powm_recoded(mpz_t o, const mpz_t a, const powm_recoding *rec, const powm_ctx *ctx);
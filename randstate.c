@@ -2,14 +2,41 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-gmp_randstate_t state;
+static gmp_randstate_t master;
+static uint64_t master_seed;
+static uint64_t streams; // streams derived so far
+
+_Thread_local randstate_ptr state = NULL;
 
 void randstate_init(uint64_t seed) {
     srandom((int) seed);
-    gmp_randinit_mt(state);
-    gmp_randseed_ui(state, seed);
+    gmp_randinit_mt(master);
+    gmp_randseed_ui(master, seed);
+    master_seed = seed;
+    streams = 0;
+    state = master;
 }
 
 void randstate_clear(void) {
-    gmp_randclear(state);
+    gmp_randclear(master);
+    state = NULL;
+}
+
+// splitmix64 finalizer, spreads consecutive stream numbers over unrelated seeds
+static uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+void randstate_stream_init(gmp_randstate_t s) {
+    streams++;
+    gmp_randinit_mt(s);
+    gmp_randseed_ui(s, mix(master_seed + streams * 0x9e3779b97f4a7c15ULL));
+}
+
+randstate_ptr randstate_use(randstate_ptr s) {
+    randstate_ptr prev = state;
+    state = s;
+    return prev;
 }
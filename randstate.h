@@ -4,7 +4,14 @@
 #include <gmp.h>
 #include <stdint.h>
 
-extern gmp_randstate_t state;
+typedef __gmp_randstate_struct *randstate_ptr;
+
+//
+// The calling thread's random state. Points at the master state seeded by
+// randstate_init on the thread that called it; worker threads point it at
+// their own stream with randstate_use.
+//
+extern _Thread_local randstate_ptr state;
 
 //
 // Initializes the random state needed for SS key generation operations.
@@ -19,3 +26,17 @@ void randstate_init(uint64_t seed);
 // Must be called after all key generation or number theory operations are used.
 //
 void randstate_clear(void);
+
+//
+// Initializes an independent random stream derived from the master seed.
+// Streams are numbered in the order they are created, so the same seed and
+// the same sequence of calls always produce the same streams.
+//
+// s: the random state to initialize, freed with gmp_randclear.
+//
+void randstate_stream_init(gmp_randstate_t s);
+
+//
+// Makes s the calling thread's random state and returns the previous one.
+//
+randstate_ptr randstate_use(randstate_ptr s);
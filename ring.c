@@ -0,0 +1,79 @@
+#include "ring.h"
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+// waits spent yielding before a waiting side starts to sleep
+#define RING_YIELDS 64
+
+// longest sleep between checks, in nanoseconds
+#define RING_SLEEP_MAX 1000000
+
+struct ring {
+    _Alignas(64) atomic_size_t head; // next entry to pop, written by the consumer
+    _Alignas(64) atomic_size_t tail; // next entry to push, written by the producer
+    _Alignas(64) size_t mask; // capacity - 1, capacity a power of 2
+    void **items;
+};
+
+ring *ring_create(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    ring *r = (ring *) aligned_alloc(64, sizeof(ring));
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->mask = size - 1;
+    r->items = (void **) calloc(size, sizeof(void *));
+    return r;
+}
+
+// backs off while the other side catches up: yield first, then sleep for
+// doubling intervals so a stage stuck behind slow I/O leaves the cores to
+// the stages that have work
+static void ring_wait(unsigned *tries) {
+    if (*tries < RING_YIELDS) {
+        (*tries)++;
+        sched_yield();
+        return;
+    }
+
+    long ns = 1000L << (*tries - RING_YIELDS); // from 1 us up
+    if (ns < RING_SLEEP_MAX)
+        (*tries)++;
+    else
+        ns = RING_SLEEP_MAX;
+
+    struct timespec ts = { 0, ns };
+    nanosleep(&ts, NULL);
+}
+
+void ring_push(ring *r, void *item) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned tries = 0;
+
+    while (tail - atomic_load_explicit(&r->head, memory_order_acquire) > r->mask)
+        ring_wait(&tries);
+
+    r->items[tail & r->mask] = item;
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+void *ring_pop(ring *r) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned tries = 0;
+
+    while (atomic_load_explicit(&r->tail, memory_order_acquire) == head)
+        ring_wait(&tries);
+
+    void *item = r->items[head & r->mask];
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return item;
+}
+
+void ring_destroy(ring *r) {
+    free(r->items);
+    free(r);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+
+//
+// Bounded single-producer/single-consumer queue of pointers. Exactly one
+// thread may push and exactly one other thread may pop; neither side takes
+// a lock.
+//
+typedef struct ring ring;
+
+//
+// Creates a ring holding at least capacity entries.
+//
+ring *ring_create(size_t capacity);
+
+//
+// Appends item, waiting while the ring is full. Producer side only.
+//
+void ring_push(ring *r, void *item);
+
+//
+// Removes and returns the oldest item, waiting while the ring is empty.
+// Consumer side only.
+//
+void *ring_pop(ring *r);
+
+//
+// Frees the ring. Items still queued are not touched.
+//
+void ring_destroy(ring *r);
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+#define SMALL_PRIMES 2048
+
+//
+// Table of the first SMALL_PRIMES primes (2 through 17863), used to reject
+// prime candidates with small factors before any modular exponentiation.
+//
+extern const uint16_t small_primes[SMALL_PRIMES];
@@ -1,67 +1,119 @@
 #include "ss.h"
 #include "numtheory.h"
 #include "randstate.h"
+#include "powm.h"
+#include "mbpowm.h"
+#include "pool.h"
+#include "ring.h"
+#include "hex.h"
+#include "chacha.h"
+#include "lz.h"
+#include "stats.h"
+#include "fileio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <gmp.h>
 
-// makes a public key
-void ss_make_pub(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters) {
+// q draws tried against one p before p is drawn again
+#define Q_DRAWS 16
+
+// checks the SS conditions on p and q, and sets n = p^2 * q
+static bool pq_valid(mpz_t n, const mpz_t p, const mpz_t q, uint64_t nbits) {
+    mpz_t larger_val, smaller_val, mod_value;
+    mpz_inits(larger_val, smaller_val, mod_value, NULL);
+
+    bool isNotDivisible = true; //true by default
+
+    //generate n_bits based on p and q
+    mpz_mul(n, p, p);
+    mpz_mul(n, n, q);
+
+    // calculates whether p or q is larger or smaller, used for modular arithmetic for condition 1
+    if (mpz_cmp(p, q) > 0) {
+        mpz_set(larger_val, p);
+        mpz_set(smaller_val, q);
+    } else {
+        mpz_set(larger_val, q);
+        mpz_set(smaller_val, p);
+    }
 
-    mpz_t log_condition, larger_val, smaller_val, mod_value, n_bits;
+    mpz_sub_ui(larger_val, larger_val, 1);
+    mpz_mod(mod_value, larger_val, smaller_val);
 
-    bool isNotDivisible;
+    // condition 1: if (p-1) is not divisible with q and (q-1) is not divisible with p
+    if (mpz_cmp_ui(mod_value, 0) == 0)
+        isNotDivisible = false;
+    mpz_add_ui(larger_val, larger_val, 1);
+
+    mpz_sub_ui(smaller_val, smaller_val, 1);
+    mpz_mod(mod_value, larger_val, smaller_val);
+    if (mpz_cmp_ui(mod_value, 0) == 0)
+        isNotDivisible = false;
+
+    mpz_clears(larger_val, smaller_val, mod_value, NULL);
+
+    // condition 2: integer of log2(n) must be at least nbits
+    return isNotDivisible == true && mpz_sizeinbase(n, 2) - 1 >= nbits;
+}
+
+// makes a public key
+void ss_make_pub(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters) {
+    ss_make_pub_threads(p, q, n, nbits, iters, 1);
+}
 
-    mpz_inits(log_condition, larger_val, smaller_val, mod_value, n_bits, NULL);
-    mpz_set_ui(n_bits, nbits);
+// searches for p and q, on ps's threads or on the calling thread if ps is
+// NULL, and sets n = p^2 * q; every draw comes from the calling thread's state
+static void make_pub_search(
+    mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters, prime_search *ps) {
+    bool found = false;
 
     // loop to make p, q, n values until proper conditions are met
     do {
-        isNotDivisible = true; //true by default
         uint64_t upper_bound = ((2 * nbits) / 5);
         uint64_t lower_bound = (nbits / 5);
 
         // generate p_bits, q_bits
-        uint64_t p_bits = (random() % (upper_bound - lower_bound) + lower_bound);
+        uint64_t p_bits = (gmp_urandomm_ui(state, upper_bound - lower_bound) + lower_bound);
         uint64_t q_bits = (nbits - (2 * p_bits));
 
-        make_prime(p, p_bits, iters);
-        make_prime(q, q_bits, iters);
+        if (ps != NULL)
+            make_prime_parallel(p, p_bits, iters, ps);
+        else
+            make_prime_sieved(p, p_bits, iters);
 
-        //generate n_bits based on p and q
+        // skip a p that is too small for even the largest q to reach nbits
         mpz_mul(n, p, p);
-        mpz_mul(n, n, q);
+        mpz_mul_ui(n, n, 3);
+        mpz_mul_2exp(n, n, q_bits - 1);
+        if (mpz_sizeinbase(n, 2) - 1 < nbits)
+            continue;
 
-        // calculates whether p or q is larger or smaller, used for modular arithmetic for condition 1
-        if (mpz_cmp(p, q) > 0) {
-            mpz_set(larger_val, p);
-            mpz_set(smaller_val, q);
-        } else {
-            mpz_set(larger_val, q);
-            mpz_set(smaller_val, p);
+        // a valid p is kept, only q is redrawn unless this p keeps failing
+        for (int draw = 0; draw < Q_DRAWS && found == false; draw++) {
+            if (ps != NULL)
+                make_prime_parallel(q, q_bits, iters, ps);
+            else
+                make_prime_sieved(q, q_bits, iters);
+            found = pq_valid(n, p, q, nbits);
         }
+    } while (found == false);
+}
 
-        mpz_sub_ui(larger_val, larger_val, 1);
-        mpz_mod(mod_value, larger_val, smaller_val);
-
-        // condition 1: if (p-1) is not divisible with q and (q-1) is not divisible with p
-        if (mpz_cmp_ui(mod_value, 0) == 0)
-            isNotDivisible = false;
-        mpz_add_ui(larger_val, larger_val, 1);
-
-        mpz_sub_ui(smaller_val, smaller_val, 1);
-        mpz_mod(mod_value, larger_val, smaller_val);
-        if (mpz_cmp_ui(mod_value, 0) == 0)
-            isNotDivisible = false;
-
-        // condition 2: calculates integer of log2(n), later checks if log2(n) >= nbits
-        size_t log = mpz_sizeinbase(n, 2);
-        log = log - 1;
-        mpz_set_ui(log_condition, log);
-
-    } while (mpz_cmp(log_condition, n_bits) < 0
-             || isNotDivisible == false); //makes sure those 2 conditions are satisfied
-
-    mpz_clears(log_condition, larger_val, smaller_val, mod_value, n_bits, NULL);
+// makes a public key, searching for p and q on several threads
+void ss_make_pub_threads(
+    mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters, uint32_t threads) {
+    prime_search ps;
+    prime_search_init(&ps, threads);
+    make_pub_search(p, q, n, nbits, iters, &ps);
+    prime_search_clear(&ps);
 }
 
 // calculates least common multiple of a and b, stores it in r
@@ -97,6 +149,28 @@ void ss_make_priv(mpz_t d, mpz_t pq, const mpz_t p, const mpz_t q) {
     mpz_clears(mod, p_minus_1, q_minus_1, n, NULL);
 }
 
+void ss_crt_init(ss_crt *crt) {
+    mpz_inits(crt->p, crt->q, crt->dp, crt->dq, crt->qinv, NULL);
+}
+
+void ss_crt_clear(ss_crt *crt) {
+    mpz_clears(crt->p, crt->q, crt->dp, crt->dq, crt->qinv, NULL);
+}
+
+// generates the CRT components of the private key
+void ss_make_crt(ss_crt *crt, const mpz_t d, const mpz_t p, const mpz_t q) {
+    mpz_set(crt->p, p);
+    mpz_set(crt->q, q);
+
+    mpz_sub_ui(crt->dp, p, 1);
+    mpz_mod(crt->dp, d, crt->dp); // dp = d mod (p-1)
+
+    mpz_sub_ui(crt->dq, q, 1);
+    mpz_mod(crt->dq, d, crt->dq); // dq = d mod (q-1)
+
+    mod_inverse(crt->qinv, q, p);
+}
+
 // writes public key to file
 void ss_write_pub(const mpz_t n, const char username[], FILE *pbfile) {
     gmp_fprintf(pbfile, "%Zx\n", n);
@@ -104,9 +178,14 @@ void ss_write_pub(const mpz_t n, const char username[], FILE *pbfile) {
 }
 
 // writes private key to file
-void ss_write_priv(const mpz_t pq, const mpz_t d, FILE *pvfile) {
+void ss_write_priv(const mpz_t pq, const mpz_t d, const ss_crt *crt, FILE *pvfile) {
     gmp_fprintf(pvfile, "%Zx\n", pq);
     gmp_fprintf(pvfile, "%Zx", d);
+
+    // extended format: CRT components follow d, one per line
+    if (crt != NULL)
+        gmp_fprintf(pvfile, "\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx", crt->p, crt->q, crt->dp, crt->dq,
+            crt->qinv);
 }
 
 // reads public key from file
@@ -115,8 +194,15 @@ void ss_read_pub(mpz_t n, char username[], FILE *pbfile) {
 }
 
 // reads private key from file
-void ss_read_priv(mpz_t pq, mpz_t d, FILE *pvfile) {
+bool ss_read_priv(mpz_t pq, mpz_t d, ss_crt *crt, FILE *pvfile) {
     gmp_fscanf(pvfile, "%Zx %Zx", pq, d);
+
+    if (crt == NULL)
+        return false;
+
+    // two-field key files end after d
+    int res = gmp_fscanf(pvfile, "%Zx %Zx %Zx %Zx %Zx", crt->p, crt->q, crt->dp, crt->dq, crt->qinv);
+    return res == 5;
 }
 
 // generate ciphertext
@@ -124,44 +210,1370 @@ void ss_encrypt(mpz_t c, const mpz_t m, const mpz_t n) {
     pow_mod(c, m, n, n);
 }
 
-// encrypts plaintext from infile to outfile
-void ss_encrypt_file(FILE *infile, FILE *outfile, const mpz_t n) {
-    // calculates log 2(n)
-    size_t k = mpz_sizeinbase(n, 2);
-    k /= 2;
-    k -= 2;
-    k /= 8;
+struct ss_ctx {
+    int parts; // 2 for a CRT private key, 1 otherwise
+    powm_ctx mod[2]; // n, pq, or p and q
+    powm_recoding exp[2]; // n, d, or d mod (p - 1) and d mod (q - 1)
+    mpz_t qinv; // q^-1 mod p, for CRT recombination
+    mpz_t mp, mq; // scratch for the ss_ctx_* calls
+    size_t k; // plaintext bytes per block
+    mbpowm_ctx *mb[2]; // multi-buffer kernels for mod[i], both NULL if unavailable
+    struct lane_scratch *ls; // scratch for ss_ctx_*_batch, made on first use
+};
 
-    uint8_t *block_arr = (uint8_t *) calloc(k, sizeof(uint8_t));
+// per-thread scratch for ctx_encrypt_lanes and ctx_decrypt_lanes
+typedef struct lane_scratch {
+    mpz_t c[MBPOWM_MAX_LANES], m[MBPOWM_MAX_LANES];
+    mpz_t mp[MBPOWM_MAX_LANES], mq[MBPOWM_MAX_LANES];
+    mbpowm_scratch *mb[2];
+} lane_scratch;
+
+static ss_ctx *ctx_alloc(int parts) {
+    ss_ctx *ctx = (ss_ctx *) malloc(sizeof(ss_ctx));
+    ctx->parts = parts;
+    mpz_inits(ctx->qinv, ctx->mp, ctx->mq, NULL);
+    ctx->mb[0] = ctx->mb[1] = NULL;
+    ctx->ls = NULL;
+    return ctx;
+}
+
+// sets up multi-buffer kernels once the moduli and exponents are in place
+static ss_ctx *ctx_ready(ss_ctx *ctx) {
+    for (int i = 0; i < ctx->parts; i++)
+        ctx->mb[i] = mbpowm_create(ctx->mod[i].n, &ctx->exp[i], MBPOWM_AUTO);
+
+    // CRT needs both halves on the same lanes
+    if (ctx->parts == 2 && (ctx->mb[0] == NULL || ctx->mb[1] == NULL)) {
+        mbpowm_destroy(ctx->mb[0]);
+        mbpowm_destroy(ctx->mb[1]);
+        ctx->mb[0] = ctx->mb[1] = NULL;
+    }
+    return ctx;
+}
+
+// blocks handled per ctx_*_lanes call
+static uint32_t ctx_lanes(const ss_ctx *ctx) {
+    return ctx->mb[0] != NULL ? mbpowm_lanes(ctx->mb[0]) : 1;
+}
+
+static void lane_scratch_init(lane_scratch *ls, const ss_ctx *ctx) {
+    for (int i = 0; i < MBPOWM_MAX_LANES; i++)
+        mpz_inits(ls->c[i], ls->m[i], ls->mp[i], ls->mq[i], NULL);
+    for (int i = 0; i < 2; i++)
+        ls->mb[i] = i < ctx->parts && ctx->mb[i] != NULL ? mbpowm_scratch_create(ctx->mb[i]) : NULL;
+}
+
+static void lane_scratch_clear(lane_scratch *ls) {
+    for (int i = 0; i < MBPOWM_MAX_LANES; i++)
+        mpz_clears(ls->c[i], ls->m[i], ls->mp[i], ls->mq[i], NULL);
+    mbpowm_scratch_destroy(ls->mb[0]);
+    mbpowm_scratch_destroy(ls->mb[1]);
+}
+
+ss_ctx *ss_ctx_create_pub(const mpz_t n) {
+    ss_ctx *ctx = ctx_alloc(1);
+    powm_init(&ctx->mod[0], n);
+    powm_recode(&ctx->exp[0], n);
+    ctx->k = (mpz_sizeinbase(n, 2) / 2 - 2) / 8;
+    return ctx_ready(ctx);
+}
+
+ss_ctx *ss_ctx_create_priv(const mpz_t d, const mpz_t pq, const ss_crt *crt) {
+    if (crt == NULL) {
+        ss_ctx *ctx = ctx_alloc(1);
+        powm_init(&ctx->mod[0], pq);
+        powm_recode(&ctx->exp[0], d);
+        ctx->k = (mpz_sizeinbase(pq, 2) - 1) / 8;
+        return ctx_ready(ctx);
+    }
+
+    ss_ctx *ctx = ctx_alloc(2);
+    ctx->k = (mpz_sizeinbase(pq, 2) - 1) / 8;
+    powm_init(&ctx->mod[0], crt->p);
+    powm_init(&ctx->mod[1], crt->q);
+    powm_recode(&ctx->exp[0], crt->dp);
+    powm_recode(&ctx->exp[1], crt->dq);
+    mpz_set(ctx->qinv, crt->qinv);
+    return ctx_ready(ctx);
+}
+
+void ss_ctx_destroy(ss_ctx *ctx) {
+    for (int i = 0; i < ctx->parts; i++) {
+        powm_clear(&ctx->mod[i]);
+        powm_recoding_clear(&ctx->exp[i]);
+        mbpowm_destroy(ctx->mb[i]);
+    }
+    if (ctx->ls != NULL) {
+        lane_scratch_clear(ctx->ls);
+        free(ctx->ls);
+    }
+    mpz_clears(ctx->qinv, ctx->mp, ctx->mq, NULL);
+    free(ctx);
+}
+
+// recombines m = mq + q * ((mp - mq) * qinv mod p)
+static void crt_combine(const ss_ctx *ctx, mpz_t m, const mpz_t mp, const mpz_t mq) {
+    mpz_sub(m, mp, mq);
+    mpz_mul(m, m, ctx->qinv);
+    mpz_mod(m, m, ctx->mod[0].n);
+    mpz_mul(m, m, ctx->mod[1].n);
+    mpz_add(m, m, mq);
+}
+
+// m = c^d mod pq, or the CRT equivalent, with caller-owned scratch so
+// worker threads can share one context
+static void ctx_decrypt(const ss_ctx *ctx, mpz_t m, const mpz_t c, mpz_t mp, mpz_t mq) {
+    if (ctx->parts == 1) {
+        powm_recoded(m, c, &ctx->exp[0], &ctx->mod[0]);
+        return;
+    }
+
+    powm_recoded(mp, c, &ctx->exp[0], &ctx->mod[0]); // mp = c^dp mod p
+    powm_recoded(mq, c, &ctx->exp[1], &ctx->mod[1]); // mq = c^dq mod q
+    crt_combine(ctx, m, mp, mq);
+}
+
+// c[i] = m[i]^n mod n for count blocks, a lane's worth at a time when the
+// multi-buffer kernel is available
+static void ctx_encrypt_lanes(const ss_ctx *ctx, lane_scratch *ls, mpz_t *c, mpz_t *m, size_t count) {
+    STATS_START(t);
+    if (ctx->mb[0] == NULL) {
+        for (size_t i = 0; i < count; i++)
+            powm_recoded(c[i], m[i], &ctx->exp[0], &ctx->mod[0]);
+    } else {
+        mbpowm(ctx->mb[0], ls->mb[0], c, m, count);
+    }
+    STATS_STOP(STAT_POWM_NS, t);
+    STATS_ADD(STAT_BLOCKS, count);
+}
+
+// ctx_decrypt for count blocks, count at most ctx_lanes(ctx)
+static void ctx_decrypt_lanes(const ss_ctx *ctx, lane_scratch *ls, mpz_t *m, mpz_t *c, size_t count) {
+    STATS_START(t);
+    if (ctx->mb[0] == NULL) {
+        for (size_t i = 0; i < count; i++)
+            ctx_decrypt(ctx, m[i], c[i], ls->mp[0], ls->mq[0]);
+    } else if (ctx->parts == 1) {
+        mbpowm(ctx->mb[0], ls->mb[0], m, c, count);
+    } else {
+        mbpowm(ctx->mb[0], ls->mb[0], ls->mp, c, count);
+        mbpowm(ctx->mb[1], ls->mb[1], ls->mq, c, count);
+        for (size_t i = 0; i < count; i++)
+            crt_combine(ctx, m[i], ls->mp[i], ls->mq[i]);
+    }
+    STATS_STOP(STAT_POWM_NS, t);
+    STATS_ADD(STAT_BLOCKS, count);
+}
+
+void ss_ctx_encrypt(ss_ctx *ctx, mpz_t c, const mpz_t m) {
+    STATS_START(t);
+    powm_recoded(c, m, &ctx->exp[0], &ctx->mod[0]);
+    STATS_STOP(STAT_POWM_NS, t);
+    STATS_ADD(STAT_BLOCKS, 1);
+}
+
+void ss_ctx_decrypt(ss_ctx *ctx, mpz_t m, const mpz_t c) {
+    STATS_START(t);
+    ctx_decrypt(ctx, m, c, ctx->mp, ctx->mq);
+    STATS_STOP(STAT_POWM_NS, t);
+    STATS_ADD(STAT_BLOCKS, 1);
+}
+
+static lane_scratch *ctx_scratch(ss_ctx *ctx) {
+    if (ctx->ls == NULL) {
+        ctx->ls = (lane_scratch *) malloc(sizeof(lane_scratch));
+        lane_scratch_init(ctx->ls, ctx);
+    }
+    return ctx->ls;
+}
+
+void ss_ctx_encrypt_batch(ss_ctx *ctx, mpz_t *c, mpz_t *m, size_t count) {
+    lane_scratch *ls = ctx_scratch(ctx);
+    uint32_t lanes = ctx_lanes(ctx);
+    for (size_t i = 0; i < count; i += lanes)
+        ctx_encrypt_lanes(ctx, ls, c + i, m + i, count - i < lanes ? count - i : lanes);
+}
+
+void ss_ctx_decrypt_batch(ss_ctx *ctx, mpz_t *m, mpz_t *c, size_t count) {
+    lane_scratch *ls = ctx_scratch(ctx);
+    uint32_t lanes = ctx_lanes(ctx);
+    for (size_t i = 0; i < count; i += lanes)
+        ctx_decrypt_lanes(ctx, ls, m + i, c + i, count - i < lanes ? count - i : lanes);
+}
+
+// growable output buffer
+typedef struct {
+    uint8_t *data;
+    size_t len, cap;
+} byte_buf;
+
+static void byte_buf_append(byte_buf *b, const uint8_t *data, size_t len) {
+    // an empty carry or chunk may still have no buffer, and memcpy from or
+    // to NULL is undefined even for 0 bytes
+    if (len == 0)
+        return;
+    if (b->len + len > b->cap) {
+        b->cap = 2 * (b->len + len);
+        b->data = (uint8_t *) realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+// fread and fwrite for the file paths' headers and data, counted and timed
+// under SS_STATS
+static size_t io_read(void *buf, size_t len, FILE *infile) {
+    STATS_START(t);
+    size_t got = fread(buf, sizeof(uint8_t), len, infile);
+    STATS_STOP(STAT_IO_NS, t);
+    STATS_ADD(STAT_BYTES_IN, got);
+    return got;
+}
+
+static size_t io_write(const void *buf, size_t len, FILE *outfile) {
+    STATS_START(t);
+    size_t put = fwrite(buf, sizeof(uint8_t), len, outfile);
+    STATS_STOP(STAT_IO_NS, t);
+    STATS_ADD(STAT_BYTES_OUT, put);
+    return put;
+}
+
+// a streamed path's input or output: a fileio for regular files, else the
+// FILE itself
+typedef struct {
+    FILE *file;
+    fileio *fio;
+} io_stream;
+
+static void stream_open(io_stream *s, FILE *file, bool write, ss_io io) {
+    s->file = file;
+    s->fio = NULL;
+    if (io != SS_IO_STDIO)
+        s->fio = fileio_open(file, write, io == SS_IO_URING ? FILEIO_URING : FILEIO_PREAD);
+}
+
+static void stream_close(io_stream *s) {
+    if (s->fio != NULL)
+        fileio_close(s->fio);
+    s->fio = NULL;
+}
+
+static size_t stream_read(io_stream *s, void *buf, size_t len) {
+    if (s->fio == NULL)
+        return io_read(buf, len, s->file);
+    STATS_START(t);
+    size_t got = fileio_read(s->fio, buf, len);
+    STATS_STOP(STAT_IO_NS, t);
+    STATS_ADD(STAT_BYTES_IN, got);
+    return got;
+}
+
+static void stream_write(io_stream *s, const void *buf, size_t len) {
+    if (s->fio == NULL) {
+        io_write(buf, len, s->file);
+        return;
+    }
+    STATS_START(t);
+    fileio_write(s->fio, buf, len);
+    STATS_STOP(STAT_IO_NS, t);
+    STATS_ADD(STAT_BYTES_OUT, len);
+}
+
+// binary key file records, each a u32 tag and u32 length followed by the
+// payload zero-padded to 8 bytes; lengths count limbs, or bytes for KEY_USER
+enum {
+    KEY_N,
+    KEY_USER,
+    KEY_PQ,
+    KEY_D,
+    KEY_P,
+    KEY_Q,
+    KEY_DP,
+    KEY_DQ,
+    KEY_QINV,
+    KEY_N_MONT, // Montgomery constants: ninv, then R^2 mod the modulus
+    KEY_PQ_MONT,
+    KEY_P_MONT,
+    KEY_Q_MONT,
+    KEY_TAGS
+};
+
+#define KEY_HEADER_BYTES 32
+#define KEY_BYTE_ORDER   0x0102 // reads back as 0x0201 on a host of the other byte order
+
+// file header, in host byte order
+typedef struct {
+    uint8_t magic[4];
+    uint16_t version;
+    uint16_t kind; // SS_KEY_PUB or SS_KEY_PRIV
+    uint16_t limb_bytes; // sizeof(mp_limb_t) of the writer
+    uint16_t byte_order; // KEY_BYTE_ORDER
+    uint32_t records;
+    uint64_t total_bytes; // header included
+    uint64_t checksum; // FNV-1a of everything after the header
+} key_header;
+
+_Static_assert(sizeof(key_header) == KEY_HEADER_BYTES, "key_header must have no padding");
+
+struct ss_keyfile {
+    uint8_t *map;
+    size_t len;
+    bool owned; // false for a key inside a keystore's mapping
+    uint16_t kind;
+    const uint8_t *rec[KEY_TAGS]; // record payloads, NULL if absent
+    uint32_t rec_len[KEY_TAGS];
+};
+
+// records of a key file being written
+typedef struct {
+    byte_buf body;
+    uint32_t records;
+} key_builder;
+
+static uint64_t fnv1a(const uint8_t *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+static void key_record(key_builder *kb, uint32_t tag, const void *data, uint32_t len, size_t bytes) {
+    static const uint8_t zeros[8] = { 0 };
+    uint32_t head[2] = { tag, len };
+    byte_buf_append(&kb->body, (const uint8_t *) head, sizeof(head));
+    byte_buf_append(&kb->body, (const uint8_t *) data, bytes);
+    byte_buf_append(&kb->body, zeros, (8 - bytes % 8) % 8);
+    kb->records++;
+}
+
+static void key_mpz(key_builder *kb, uint32_t tag, const mpz_t x) {
+    key_record(kb, tag, mpz_limbs_read(x), mpz_size(x), mpz_size(x) * sizeof(mp_limb_t));
+}
+
+// stores the Montgomery constants powm_init derives for modulus x
+static void key_mont(key_builder *kb, uint32_t tag, const mpz_t x) {
+    powm_ctx ctx;
+    powm_init(&ctx, x);
+
+    if (ctx.mont) {
+        mp_size_t s = ctx.size;
+        mp_limb_t *limbs = (mp_limb_t *) malloc((s + 1) * sizeof(mp_limb_t));
+        limbs[0] = ctx.ninv;
+        mpn_copyi(limbs + 1, ctx.r2, s);
+        key_record(kb, tag, limbs, s + 1, (s + 1) * sizeof(mp_limb_t));
+        free(limbs);
+    }
+
+    powm_clear(&ctx);
+}
+
+static void key_write(key_builder *kb, uint16_t kind, FILE *outfile) {
+    key_header hdr = { { SS_MAGIC0, SS_MAGIC1, SS_MAGIC2, SS_KEY_MAGIC3 }, SS_KEY_VERSION, kind,
+        sizeof(mp_limb_t), KEY_BYTE_ORDER, kb->records, KEY_HEADER_BYTES + kb->body.len,
+        fnv1a(kb->body.data, kb->body.len) };
+
+    fwrite(&hdr, sizeof(uint8_t), KEY_HEADER_BYTES, outfile);
+    fwrite(kb->body.data, sizeof(uint8_t), kb->body.len, outfile);
+    free(kb->body.data);
+}
+
+static void key_pub(key_builder *kb, const mpz_t n, const char username[]) {
+    key_mpz(kb, KEY_N, n);
+    key_mont(kb, KEY_N_MONT, n);
+    key_record(kb, KEY_USER, username, strlen(username), strlen(username));
+}
+
+static void key_priv(key_builder *kb, const mpz_t pq, const mpz_t d, const ss_crt *crt) {
+    key_mpz(kb, KEY_PQ, pq);
+    key_mpz(kb, KEY_D, d);
+    key_mont(kb, KEY_PQ_MONT, pq);
+
+    if (crt != NULL) {
+        key_mpz(kb, KEY_P, crt->p);
+        key_mpz(kb, KEY_Q, crt->q);
+        key_mpz(kb, KEY_DP, crt->dp);
+        key_mpz(kb, KEY_DQ, crt->dq);
+        key_mpz(kb, KEY_QINV, crt->qinv);
+        key_mont(kb, KEY_P_MONT, crt->p);
+        key_mont(kb, KEY_Q_MONT, crt->q);
+    }
+}
+
+void ss_write_pub_bin(const mpz_t n, const char username[], FILE *pbfile) {
+    key_builder kb = { { 0 }, 0 };
+    key_pub(&kb, n, username);
+    key_write(&kb, SS_KEY_PUB, pbfile);
+}
+
+void ss_write_priv_bin(const mpz_t pq, const mpz_t d, const ss_crt *crt, FILE *pvfile) {
+    key_builder kb = { { 0 }, 0 };
+    key_priv(&kb, pq, d, crt);
+    key_write(&kb, SS_KEY_PRIV, pvfile);
+}
+
+static void key_file_error(const char *path, const char *why) {
+    fprintf(stderr, "%s: %s\n", path, why);
+    exit(1);
+}
+
+// checks and indexes the key file image map[0, len); NULL if it does not
+// start with the key file magic
+static ss_keyfile *key_parse(const char *path, uint8_t *map, size_t len) {
+    // anything without the magic is left to the text key readers, anything
+    // with it is a binary key file, whole or not
+    const uint8_t magic[4] = { SS_MAGIC0, SS_MAGIC1, SS_MAGIC2, SS_KEY_MAGIC3 };
+    if (len < sizeof(magic) || memcmp(map, magic, sizeof(magic)) != 0)
+        return NULL;
+    if (len < KEY_HEADER_BYTES)
+        key_file_error(path, "corrupt binary key file");
+
+    key_header hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    if (hdr.version != SS_KEY_VERSION || hdr.limb_bytes != sizeof(mp_limb_t)
+        || hdr.byte_order != KEY_BYTE_ORDER || (hdr.kind != SS_KEY_PUB && hdr.kind != SS_KEY_PRIV))
+        key_file_error(path, "unsupported binary key file");
+    if (hdr.total_bytes != (uint64_t) len
+        || fnv1a(map + KEY_HEADER_BYTES, len - KEY_HEADER_BYTES) != hdr.checksum)
+        key_file_error(path, "corrupt binary key file");
+
+    ss_keyfile *kf = (ss_keyfile *) calloc(1, sizeof(ss_keyfile));
+    kf->map = map;
+    kf->len = len;
+    kf->kind = hdr.kind;
+
+    size_t off = KEY_HEADER_BYTES;
+    for (uint32_t i = 0; i < hdr.records; i++) {
+        uint32_t head[2];
+        if (kf->len - off < sizeof(head))
+            key_file_error(path, "corrupt binary key file");
+        memcpy(head, map + off, sizeof(head));
+        off += sizeof(head);
+
+        size_t bytes = head[0] == KEY_USER ? head[1] : (size_t) head[1] * sizeof(mp_limb_t);
+        size_t padded = (bytes + 7) & ~(size_t) 7;
+        if (head[0] >= KEY_TAGS || kf->len - off < padded)
+            key_file_error(path, "corrupt binary key file");
+
+        // numbers are stored normalized, which powm_init_precomputed relies on
+        const mp_limb_t *limbs = (const mp_limb_t *) (map + off);
+        bool number = head[0] != KEY_USER && head[0] < KEY_N_MONT;
+        if (number == true && head[1] > 0 && limbs[head[1] - 1] == 0)
+            key_file_error(path, "corrupt binary key file");
+
+        kf->rec[head[0]] = map + off;
+        kf->rec_len[head[0]] = head[1];
+        off += padded;
+    }
+
+    if ((kf->kind == SS_KEY_PUB && kf->rec[KEY_N] == NULL)
+        || (kf->kind == SS_KEY_PRIV && (kf->rec[KEY_PQ] == NULL || kf->rec[KEY_D] == NULL)))
+        key_file_error(path, "binary key file is missing its key");
+
+    return kf;
+}
+
+ss_keyfile *ss_keyfile_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 4) { // too short for the magic
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t *map = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    ss_keyfile *kf = key_parse(path, map, st.st_size);
+    if (kf == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    kf->owned = true;
+    return kf;
+}
+
+void ss_keyfile_close(ss_keyfile *kf) {
+    if (kf->owned == true)
+        munmap(kf->map, kf->len);
+    free(kf);
+}
+
+
+int ss_keyfile_kind(const ss_keyfile *kf) {
+    return kf->kind;
+}
+
+// read-only mpz_t over a record's limbs
+static mpz_srcptr key_view(mpz_t x, const ss_keyfile *kf, int tag) {
+    return mpz_roinit_n(x, (const mp_limb_t *) kf->rec[tag], kf->rec_len[tag]);
+}
+
+bool ss_keyfile_read_pub(const ss_keyfile *kf, mpz_t n, char username[]) {
+    if (kf->kind != SS_KEY_PUB)
+        return false;
+
+    mpz_t x;
+    mpz_set(n, key_view(x, kf, KEY_N));
+
+    size_t len = kf->rec[KEY_USER] != NULL ? kf->rec_len[KEY_USER] : 0;
+    if (len > _POSIX_LOGIN_NAME_MAX - 1)
+        len = _POSIX_LOGIN_NAME_MAX - 1;
+    if (len > 0)
+        memcpy(username, kf->rec[KEY_USER], len);
+    username[len] = '\0';
+    return true;
+}
+
+// true if the file has all five CRT components
+static bool key_has_crt(const ss_keyfile *kf) {
+    return kf->rec[KEY_P] != NULL && kf->rec[KEY_Q] != NULL && kf->rec[KEY_DP] != NULL
+           && kf->rec[KEY_DQ] != NULL && kf->rec[KEY_QINV] != NULL;
+}
+
+bool ss_keyfile_read_priv(const ss_keyfile *kf, mpz_t pq, mpz_t d, ss_crt *crt) {
+    if (kf->kind != SS_KEY_PRIV)
+        return false;
+
+    mpz_t x;
+    mpz_set(pq, key_view(x, kf, KEY_PQ));
+    mpz_set(d, key_view(x, kf, KEY_D));
+
+    if (crt == NULL || key_has_crt(kf) == false)
+        return false;
+
+    mpz_set(crt->p, key_view(x, kf, KEY_P));
+    mpz_set(crt->q, key_view(x, kf, KEY_Q));
+    mpz_set(crt->dp, key_view(x, kf, KEY_DP));
+    mpz_set(crt->dq, key_view(x, kf, KEY_DQ));
+    mpz_set(crt->qinv, key_view(x, kf, KEY_QINV));
+    return true;
+}
+
+// sets up a modulus from its record, using the stored Montgomery constants when present
+static void key_modulus(powm_ctx *ctx, const ss_keyfile *kf, int tag, int mont_tag) {
+    uint32_t s = kf->rec_len[tag];
+    const mp_limb_t *mont = (const mp_limb_t *) kf->rec[mont_tag];
+
+    if (mont != NULL && s > 0 && kf->rec_len[mont_tag] == s + 1) {
+        powm_init_precomputed(ctx, (const mp_limb_t *) kf->rec[tag], s, mont[0], mont + 1);
+        return;
+    }
+
+    mpz_t x;
+    powm_init(ctx, key_view(x, kf, tag));
+}
+
+ss_ctx *ss_ctx_from_keyfile(const ss_keyfile *kf) {
+    mpz_t x;
+
+    if (kf->kind == SS_KEY_PUB) {
+        ss_ctx *ctx = ctx_alloc(1);
+        key_modulus(&ctx->mod[0], kf, KEY_N, KEY_N_MONT);
+        powm_recode(&ctx->exp[0], key_view(x, kf, KEY_N));
+        ctx->k = (mpz_sizeinbase(x, 2) / 2 - 2) / 8;
+        return ctx_ready(ctx);
+    }
+
+    if (key_has_crt(kf) == false) {
+        ss_ctx *ctx = ctx_alloc(1);
+        key_modulus(&ctx->mod[0], kf, KEY_PQ, KEY_PQ_MONT);
+        powm_recode(&ctx->exp[0], key_view(x, kf, KEY_D));
+        ctx->k = (mpz_sizeinbase(key_view(x, kf, KEY_PQ), 2) - 1) / 8;
+        return ctx_ready(ctx);
+    }
+
+    ss_ctx *ctx = ctx_alloc(2);
+    key_modulus(&ctx->mod[0], kf, KEY_P, KEY_P_MONT);
+    key_modulus(&ctx->mod[1], kf, KEY_Q, KEY_Q_MONT);
+    powm_recode(&ctx->exp[0], key_view(x, kf, KEY_DP));
+    powm_recode(&ctx->exp[1], key_view(x, kf, KEY_DQ));
+    mpz_set(ctx->qinv, key_view(x, kf, KEY_QINV));
+    ctx->k = (mpz_sizeinbase(key_view(x, kf, KEY_PQ), 2) - 1) / 8;
+    return ctx_ready(ctx);
+}
+
+// keystore: a header, a hash table of entry numbers, the entries, their ids,
+// then each key pair as two complete binary key file images
+#define STORE_HEADER_BYTES 40
+#define STORE_MAGIC3       'S'
+#define STORE_VERSION      1
+
+typedef struct {
+    uint8_t magic[4];
+    uint16_t version;
+    uint16_t limb_bytes; // sizeof(mp_limb_t) of the writer
+    uint16_t byte_order; // KEY_BYTE_ORDER
+    uint16_t reserved;
+    uint32_t count; // key pairs
+    uint32_t buckets; // hash table size, a power of two
+    uint32_t id_bytes; // ids, padded to 8
+    uint64_t total_bytes; // header included
+    uint64_t checksum; // FNV-1a of the table, entries and ids
+} store_header;
+
+_Static_assert(sizeof(store_header) == STORE_HEADER_BYTES, "store_header must have no padding");
+
+typedef struct {
+    uint64_t hash; // FNV-1a of the id
+    uint32_t id_off, id_len; // within the ids
+    uint64_t pub_off, pub_len; // key file images, offsets from the start of the file
+    uint64_t priv_off, priv_len;
+} store_entry;
+
+struct ss_keystore {
+    uint8_t *map;
+    size_t len;
+    char *path; // for error messages
+    uint32_t buckets;
+    const uint32_t *table; // entry number + 1 per bucket, 0 if empty
+    const store_entry *entries;
+    const char *ids;
+    uint32_t count, id_bytes;
+};
+
+typedef struct {
+    uint64_t nbits, iters;
+    const char *username;
+    gmp_randstate_t *streams; // one per key, so keys don't depend on the thread count
+    key_builder *pub, *priv;
+} store_batch;
+
+// makes key pair i from its own random stream
+static void store_key(void *arg, size_t i, uint32_t worker) {
+    store_batch *b = (store_batch *) arg;
+    (void) worker;
+
+    randstate_ptr prev = randstate_use(b->streams[i]);
+    mpz_t p, q, n, d, pq;
+    mpz_inits(p, q, n, d, pq, NULL);
+    make_pub_search(p, q, n, b->nbits, b->iters, NULL);
+    ss_make_priv(d, pq, p, q);
+    randstate_use(prev);
+
+    ss_crt crt;
+    ss_crt_init(&crt);
+    ss_make_crt(&crt, d, p, q);
+    key_pub(&b->pub[i], n, b->username);
+    key_priv(&b->priv[i], pq, d, &crt);
+
+    ss_crt_clear(&crt);
+    mpz_clears(p, q, n, d, pq, NULL);
+}
+
+static size_t pad8(size_t x) {
+    return (x + 7) & ~(size_t) 7;
+}
+
+void ss_write_keystore(FILE *outfile, uint32_t count, uint64_t nbits, uint64_t iters,
+    uint32_t threads, const char username[]) {
+    store_batch b = { nbits, iters, username, NULL, NULL, NULL };
+    b.streams = (gmp_randstate_t *) malloc(count * sizeof(gmp_randstate_t));
+    b.pub = (key_builder *) calloc(count, sizeof(key_builder));
+    b.priv = (key_builder *) calloc(count, sizeof(key_builder));
+    for (uint32_t i = 0; i < count; i++)
+        randstate_stream_init(b.streams[i]);
+
+    pool *workers = pool_create(threads);
+    pool_run(workers, store_key, &b, count);
+    pool_destroy(workers);
+
+    // ids are the key numbers
+    byte_buf ids = { 0 };
+    store_entry *entries = (store_entry *) calloc(count, sizeof(store_entry));
+    for (uint32_t i = 0; i < count; i++) {
+        char id[16];
+        int len = snprintf(id, sizeof(id), "%u", (unsigned) i);
+        entries[i].hash = fnv1a((const uint8_t *) id, len);
+        entries[i].id_off = ids.len;
+        entries[i].id_len = len;
+        byte_buf_append(&ids, (const uint8_t *) id, len);
+    }
+    uint32_t id_bytes = pad8(ids.len);
+
+    // at most half full, so probes stay short
+    uint32_t buckets = 2;
+    while (buckets < 2 * (uint64_t) count)
+        buckets *= 2;
+    uint32_t *table = (uint32_t *) calloc(buckets, sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t slot = entries[i].hash & (buckets - 1);
+        while (table[slot] != 0)
+            slot = (slot + 1) & (buckets - 1);
+        table[slot] = i + 1;
+    }
+
+    size_t table_bytes = pad8(buckets * sizeof(uint32_t));
+    uint64_t off = STORE_HEADER_BYTES + table_bytes + count * sizeof(store_entry) + id_bytes;
+    for (uint32_t i = 0; i < count; i++) {
+        entries[i].pub_off = off;
+        entries[i].pub_len = KEY_HEADER_BYTES + b.pub[i].body.len;
+        off += entries[i].pub_len;
+        entries[i].priv_off = off;
+        entries[i].priv_len = KEY_HEADER_BYTES + b.priv[i].body.len;
+        off += entries[i].priv_len;
+    }
+
+    // the index, checksummed as a whole
+    byte_buf index = { 0 };
+    static const uint8_t zeros[8] = { 0 };
+    byte_buf_append(&index, (const uint8_t *) table, buckets * sizeof(uint32_t));
+    byte_buf_append(&index, zeros, table_bytes - buckets * sizeof(uint32_t));
+    byte_buf_append(&index, (const uint8_t *) entries, count * sizeof(store_entry));
+    byte_buf_append(&index, ids.data, ids.len);
+    byte_buf_append(&index, zeros, id_bytes - ids.len);
+
+    store_header hdr = { { SS_MAGIC0, SS_MAGIC1, SS_MAGIC2, STORE_MAGIC3 }, STORE_VERSION,
+        sizeof(mp_limb_t), KEY_BYTE_ORDER, 0, count, buckets, id_bytes, off,
+        fnv1a(index.data, index.len) };
+    fwrite(&hdr, sizeof(uint8_t), STORE_HEADER_BYTES, outfile);
+    fwrite(index.data, sizeof(uint8_t), index.len, outfile);
+
+    // key file images are whole multiples of 8 bytes, so every one stays aligned
+    for (uint32_t i = 0; i < count; i++) {
+        key_write(&b.pub[i], SS_KEY_PUB, outfile);
+        key_write(&b.priv[i], SS_KEY_PRIV, outfile);
+        gmp_randclear(b.streams[i]);
+    }
+
+    free(index.data);
+    free(ids.data);
+    free(table);
+    free(entries);
+    free(b.streams);
+    free(b.pub);
+    free(b.priv);
+}
+
+ss_keystore *ss_keystore_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < STORE_HEADER_BYTES) {
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t *map = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const uint8_t magic[4] = { SS_MAGIC0, SS_MAGIC1, SS_MAGIC2, STORE_MAGIC3 };
+    if (memcmp(map, magic, sizeof(magic)) != 0) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    store_header hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    if (hdr.version != STORE_VERSION || hdr.limb_bytes != sizeof(mp_limb_t)
+        || hdr.byte_order != KEY_BYTE_ORDER)
+        key_file_error(path, "unsupported keystore");
+
+    // buckets must be a power of two with room to spare, or a probe might never end
+    uint64_t index_bytes = pad8((uint64_t) hdr.buckets * sizeof(uint32_t))
+                           + (uint64_t) hdr.count * sizeof(store_entry) + hdr.id_bytes;
+    if (hdr.total_bytes != (uint64_t) st.st_size || hdr.buckets == 0
+        || (hdr.buckets & (hdr.buckets - 1)) != 0 || hdr.count >= hdr.buckets
+        || index_bytes > (uint64_t) st.st_size - STORE_HEADER_BYTES
+        || fnv1a(map + STORE_HEADER_BYTES, index_bytes) != hdr.checksum)
+        key_file_error(path, "corrupt keystore");
+
+    ss_keystore *ks = (ss_keystore *) calloc(1, sizeof(ss_keystore));
+    ks->map = map;
+    ks->len = st.st_size;
+    ks->path = strdup(path);
+    ks->buckets = hdr.buckets;
+    ks->count = hdr.count;
+    ks->id_bytes = hdr.id_bytes;
+    ks->table = (const uint32_t *) (map + STORE_HEADER_BYTES);
+    ks->entries
+        = (const store_entry *) (map + STORE_HEADER_BYTES + pad8(hdr.buckets * sizeof(uint32_t)));
+    ks->ids = (const char *) (ks->entries + hdr.count);
+    return ks;
+}
+
+void ss_keystore_close(ss_keystore *ks) {
+    munmap(ks->map, ks->len);
+    free(ks->path);
+    free(ks);
+}
+
+uint32_t ss_keystore_count(const ss_keystore *ks) {
+    return ks->count;
+}
+
+ss_keyfile *ss_keystore_get(const ss_keystore *ks, const char *id, int kind) {
+    size_t len = strlen(id);
+    uint64_t hash = fnv1a((const uint8_t *) id, len);
+
+    for (uint32_t slot = hash & (ks->buckets - 1); ks->table[slot] != 0;
+         slot = (slot + 1) & (ks->buckets - 1)) {
+        if (ks->table[slot] > ks->count)
+            key_file_error(ks->path, "corrupt keystore");
+
+        const store_entry *e = &ks->entries[ks->table[slot] - 1];
+        if (e->hash != hash || e->id_len != len || (uint64_t) e->id_off + len > ks->id_bytes
+            || memcmp(ks->ids + e->id_off, id, len) != 0)
+            continue;
+
+        uint64_t off = kind == SS_KEY_PUB ? e->pub_off : e->priv_off;
+        uint64_t bytes = kind == SS_KEY_PUB ? e->pub_len : e->priv_len;
+        if (off % 8 != 0 || off > ks->len || bytes > ks->len - off)
+            key_file_error(ks->path, "corrupt keystore");
+
+        ss_keyfile *kf = key_parse(ks->path, ks->map + off, bytes);
+        if (kf == NULL || kf->kind != kind)
+            key_file_error(ks->path, "corrupt keystore");
+        return kf;
+    }
+
+    return NULL;
+}
+
+void ss_file_opts_init(ss_file_opts *opts) {
+    opts->threads = 1;
+    opts->format = SS_FORMAT_HEX;
+    opts->depth = 3;
+    opts->compress = false;
+    opts->io = SS_IO_URING;
+}
+
+bool ss_parse_depth(const char *arg, uint32_t *depth) {
+    // strtoul would take a sign and wrap "-1" around
+    if (arg == NULL || *arg < '0' || *arg > '9')
+        return false;
+
+    char *end;
+    unsigned long v = strtoul(arg, &end, 10);
+    if (*end != '\0' || v < 1 || v > SS_DEPTH_MAX)
+        return false;
+    *depth = (uint32_t) v;
+    return true;
+}
+
+bool ss_parse_io(const char *arg, ss_io *io) {
+    static const char *const names[] = { "uring", "pread", "stdio" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(arg, names[i]) == 0) {
+            *io = (ss_io) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void pack_header(uint8_t raw[SS_HEADER_BYTES], const ss_header *hdr) {
+    memset(raw, 0, SS_HEADER_BYTES);
+    raw[0] = SS_MAGIC0;
+    raw[1] = SS_MAGIC1;
+    raw[2] = SS_MAGIC2;
+    raw[3] = SS_MAGIC3;
+    raw[4] = hdr->version;
+    raw[5] = hdr->flags;
+    put_be32(raw + 8, hdr->block_bytes);
+    put_be32(raw + 12, hdr->plain_bytes);
+}
+
+static void ss_write_header(FILE *outfile, const ss_header *hdr) {
+    uint8_t raw[SS_HEADER_BYTES];
+    pack_header(raw, hdr);
+    io_write(raw, SS_HEADER_BYTES, outfile);
+}
+
+bool ss_read_header(FILE *infile, ss_header *hdr) {
+    int first = getc(infile);
+    if (first != SS_MAGIC0) {
+        if (first != EOF)
+            ungetc(first, infile); // hex ciphertext, leave it for the line reader
+        return false;
+    }
+    STATS_ADD(STAT_BYTES_IN, 1); // the magic byte, kept rather than pushed back
+
+    uint8_t raw[SS_HEADER_BYTES] = { SS_MAGIC0 };
+    if (io_read(raw + 1, SS_HEADER_BYTES - 1, infile) != SS_HEADER_BYTES - 1
+        || raw[1] != SS_MAGIC1 || raw[2] != SS_MAGIC2 || raw[3] != SS_MAGIC3
+        || raw[4] != SS_FORMAT_VERSION || (raw[5] & ~(SS_FLAG_HYBRID | SS_FLAG_INDEX | SS_FLAG_LZ)) != 0) {
+        fprintf(stderr, "unsupported ciphertext header\n");
+        exit(1);
+    }
+
+    hdr->version = raw[4];
+    hdr->flags = raw[5];
+    hdr->block_bytes = get_be32(raw + 8);
+    hdr->plain_bytes = get_be32(raw + 12);
+    return true;
+}
+
+// whether a header's block sizes can belong to ciphertext under key:
+// plain_bytes from 2 (the 0xFF prefix and one byte) up to k + 1, and
+// block_bytes those of n = p^2 * q. A private key without p and q only
+// has pq to go on, and pq < n < pq^2 bounds the width instead.
+static bool header_fits(const ss_ctx *key, uint32_t block_bytes, uint32_t plain_bytes) {
+    if (plain_bytes < 2 || plain_bytes > key->k + 1)
+        return false;
+
+    if (key->parts == 2) {
+        mpz_t n;
+        mpz_init(n);
+        mpz_mul(n, key->mod[0].n, key->mod[0].n);
+        mpz_mul(n, n, key->mod[1].n);
+        size_t width = (mpz_sizeinbase(n, 2) + 7) / 8;
+        mpz_clear(n);
+        return block_bytes == width;
+    }
+
+    size_t bytes = (mpz_sizeinbase(key->mod[0].n, 2) + 7) / 8;
+    return block_bytes >= bytes && block_bytes <= 2 * bytes;
+}
+
+// plaintext blocks read per worker thread before a batch is encrypted
+#define BATCH_BLOCKS 64
+
+// one batch of packed plaintext blocks on their way to ciphertext
+typedef struct {
+    size_t k; // bytes per block
+    size_t count; // blocks in the batch
+    uint8_t *blocks; // count blocks of k bytes
+    lane_scratch *scratch; // one per worker
+    mpz_t *c; // ciphertext, one per block
+    uint32_t lanes; // blocks per group
+    ss_ctx *key; // public key
+} enc_batch;
+
+// encrypts group g of the batch, same as ss_encrypt with n's setup shared
+static void enc_group(void *arg, size_t g, uint32_t worker) {
+    enc_batch *b = (enc_batch *) arg;
+    lane_scratch *ls = &b->scratch[worker];
+
+    size_t first = g * b->lanes;
+    size_t count = b->count - first < b->lanes ? b->count - first : b->lanes;
+    for (size_t i = 0; i < count; i++)
+        mpz_import(ls->m[i], b->k, sizeof(uint8_t), 1, 1, 0, b->blocks + (first + i) * b->k);
+
+    ctx_encrypt_lanes(b->key, ls, b->c + first, ls->m, count);
+}
 
-    unsigned long j;
+static void put_be64(uint8_t *p, uint64_t v) {
+    put_be32(p, (uint32_t) (v >> 32));
+    put_be32(p + 4, (uint32_t) v);
+}
+
+static uint64_t get_be64(const uint8_t *p) {
+    return ((uint64_t) get_be32(p) << 32) | get_be32(p + 4);
+}
+
+// writes the container index and footer after count blocks of width bytes,
+// each carrying plain bytes except the last, which carries last
+static void write_index(FILE *outfile, uint64_t count, size_t width, size_t plain, size_t last) {
+    uint8_t entry[SS_INDEX_ENTRY_BYTES];
+    uint64_t index_offset = SS_HEADER_BYTES + count * width;
+
+    for (uint64_t i = 0; i < count; i++) {
+        put_be64(entry, SS_HEADER_BYTES + i * width);
+        put_be64(entry + 8, i * plain);
+        put_be32(entry + 16, (uint32_t) (i == count - 1 ? last : plain));
+        io_write(entry, SS_INDEX_ENTRY_BYTES, outfile);
+    }
+
+    uint8_t footer[SS_FOOTER_BYTES] = { 0 };
+    put_be64(footer, index_offset);
+    put_be64(footer + 8, count);
+    put_be32(footer + 16, SS_INDEX_ENTRY_BYTES);
+    memcpy(footer + 20, SS_INDEX_MAGIC, 4);
+    io_write(footer, SS_FOOTER_BYTES, outfile);
+}
+
+// stores c big-endian, left-padded with zeros to width bytes
+static void export_block(uint8_t *out, size_t width, const mpz_t c) {
+    size_t used = mpz_sgn(c) != 0 ? mpz_sizeinbase(c, 256) : 0;
+    memset(out, 0, width - used);
+    mpz_export(out + width - used, NULL, 1, sizeof(uint8_t), 1, 0, c);
+}
+
+// session key material for the hybrid format: ChaCha20 key, then nonce base
+#define SESSION_BYTES (CHACHA_KEY_BYTES + CHACHA_NONCE_BYTES)
+
+// bytes per hybrid chunk record: length field, payload and tag
+#define HYBRID_SLOT (4 + SS_HYBRID_CHUNK + CHACHA_TAG_BYTES)
+
+// hybrid chunks sealed or opened per worker thread in each batch
+#define HYBRID_BATCH 8
+
+// one batch of hybrid chunk records, sealed or opened in place
+typedef struct {
+    uint8_t key[CHACHA_KEY_BYTES];
+    uint8_t nonce[CHACHA_NONCE_BYTES]; // chunk i uses this XOR i
+    uint8_t header[SS_HEADER_BYTES]; // authenticated with every chunk
+    uint64_t first; // file index of the batch's first chunk
+    size_t count;
+    uint8_t *slots; // count records of HYBRID_SLOT bytes
+    bool *ok; // chunks that authenticated
+} hybrid_batch;
+
+// fills buf from the kernel's CSPRNG; session keys must not come from the seeded state
+static void random_bytes(uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t got = getrandom(buf, len, 0);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "system randomness unavailable\n");
+            exit(1);
+        }
+        buf += got;
+        len -= (size_t) got;
+    }
+}
+
+// number of SS blocks the session key is packed into, end marker included
+static size_t session_blocks(size_t k) {
+    return SESSION_BYTES / (k - 1) + 1;
+}
+
+// nonce and associated data for record i of the batch
+static void hybrid_chunk_params(const hybrid_batch *b, size_t i,
+    uint8_t nonce[CHACHA_NONCE_BYTES], uint8_t aad[SS_HEADER_BYTES + 4]) {
+    uint64_t index = b->first + i;
+    memcpy(nonce, b->nonce, CHACHA_NONCE_BYTES);
+    for (int j = 0; j < 8; j++)
+        nonce[4 + j] ^= (uint8_t) (index >> (8 * j));
+
+    memcpy(aad, b->header, SS_HEADER_BYTES);
+    memcpy(aad + SS_HEADER_BYTES, b->slots + i * HYBRID_SLOT, 4);
+}
+
+// seals record i in place: length field stays, payload becomes ciphertext and tag
+static void hybrid_seal(void *arg, size_t i, uint32_t worker) {
+    (void) worker;
+    hybrid_batch *b = (hybrid_batch *) arg;
+    uint8_t *slot = b->slots + i * HYBRID_SLOT;
+    size_t len = get_be32(slot) & ~SS_HYBRID_FINAL;
+
+    uint8_t nonce[CHACHA_NONCE_BYTES], aad[SS_HEADER_BYTES + 4];
+    hybrid_chunk_params(b, i, nonce, aad);
+    aead_seal(slot + 4, slot + 4 + len, slot + 4, len, aad, sizeof(aad), b->key, nonce);
+}
+
+// wraps a fresh session key under n and streams the payload through ChaCha20-Poly1305
+static void hybrid_encrypt_file(
+    FILE *infile, FILE *outfile, ss_ctx *key, pool *workers, uint8_t flags) {
+    size_t k = key->k;
+    size_t width = (mpz_sizeinbase(key->mod[0].n, 2) + 7) / 8;
+    ss_header hdr = { SS_FORMAT_VERSION, SS_FLAG_HYBRID | flags, (uint32_t) width, (uint32_t) k };
+
+    hybrid_batch b;
+    pack_header(b.header, &hdr);
+    io_write(b.header, SS_HEADER_BYTES, outfile);
+
+    uint8_t session[SESSION_BYTES];
+    random_bytes(session, sizeof(session));
+    memcpy(b.key, session, CHACHA_KEY_BYTES);
+    memcpy(b.nonce, session + CHACHA_KEY_BYTES, CHACHA_NONCE_BYTES);
+
+    // the session key is packed like binary-format plaintext, 0x80 end marker included
+    uint8_t *block = (uint8_t *) malloc(k);
+    uint8_t *out = (uint8_t *) malloc(width);
     mpz_t m, c;
     mpz_inits(m, c, NULL);
 
-    block_arr[0] = 0xFF;
+    for (size_t i = 0, off = 0; i < session_blocks(k); i++, off += k - 1) {
+        size_t j = SESSION_BYTES - off < k - 1 ? SESSION_BYTES - off : k - 1;
+        block[0] = 0xFF;
+        memcpy(block + 1, session + off, j);
+        if (j < k - 1) {
+            block[j + 1] = 0x80;
+            memset(block + j + 2, 0, k - j - 2);
+        }
 
-    do {
-        j = fread(block_arr + 1, sizeof(uint8_t), k - 1, infile);
+        mpz_import(m, k, sizeof(uint8_t), 1, 1, 0, block);
+        ss_ctx_encrypt(key, c, m);
+        export_block(out, width, c);
+        io_write(out, width, outfile);
+    }
+
+    size_t cap = (size_t) pool_size(workers) * HYBRID_BATCH;
+    b.slots = (uint8_t *) malloc(cap * HYBRID_SLOT);
+    b.first = 0;
+
+    bool done = false;
+    while (done == false) {
+        b.count = 0;
+        while (b.count < cap && done == false) {
+            uint8_t *slot = b.slots + b.count * HYBRID_SLOT;
+            size_t len = io_read(slot + 4, SS_HYBRID_CHUNK, infile);
+
+            // a full chunk is only the last one if nothing follows it
+            int next = len == SS_HYBRID_CHUNK ? getc(infile) : EOF;
+            if (next != EOF)
+                ungetc(next, infile);
+            else
+                done = true;
 
-        // if the number of bytes left is less than k-1 or it hits 0, in other words we're coming to an end
-        if (j < (k - 1) || j == 0) {
-            block_arr[j + 1]
-                = 0; //makes sure to cut off anything after j in case it's less than k-1
-            mpz_import(
-                m, k, sizeof(uint8_t), 1, 1, 0, block_arr); // fills block_arr with binary data
-            ss_encrypt(c, m, n);
-            gmp_fprintf(outfile, "%Zx\n", c); // print to export file
-            break; // exit from loop
+            put_be32(slot, (uint32_t) len | (done == true ? SS_HYBRID_FINAL : 0));
+            b.count++;
         }
 
-        mpz_import(m, k, sizeof(uint8_t), 1, 1, 0, block_arr); // fills block_arr with binary data
-        ss_encrypt(c, m, n);
-        gmp_fprintf(outfile, "%Zx\n", c);
+        pool_run(workers, hybrid_seal, &b, b.count);
 
-    } while (true);
+        for (size_t i = 0; i < b.count; i++) {
+            uint8_t *slot = b.slots + i * HYBRID_SLOT;
+            size_t len = get_be32(slot) & ~SS_HYBRID_FINAL;
+            io_write(slot, 4 + len + CHACHA_TAG_BYTES, outfile);
+        }
+        b.first += b.count;
+    }
 
-    free(block_arr);
+    memset(session, 0, sizeof(session));
+    memset(b.key, 0, sizeof(b.key));
+    memset(block, 0, k);
     mpz_clears(m, c, NULL);
+    free(block);
+    free(out);
+    free(b.slots);
+}
+
+// one batch in flight between the encryption stages
+typedef struct {
+    uint8_t *blocks; // packed plaintext, up to cap blocks of k bytes
+    mpz_t *c; // ciphertext, one per block
+    size_t count; // blocks in the batch
+    bool last; // no batch follows this one
+} enc_slot;
+
+// reader, compute and writer stages of file encryption; slots cycle from
+// spare to the reader, filled to compute, done to the writer and back
+typedef struct {
+    io_stream in;
+    io_stream out;
+    ring *spare;
+    ring *filled;
+    ring *done;
+    size_t k; // plaintext bytes per block
+    size_t cap; // blocks per batch
+    size_t width; // bytes per binary ciphertext block
+    size_t digits; // most hex digits in a ciphertext block
+    bool binary;
+    uint64_t blocks; // blocks read, set by the reader
+    unsigned long tail; // data bytes in the final block, set by the reader
+} enc_pipe;
+
+// reader stage: packs plaintext into batches of blocks
+static void *enc_reader(void *arg) {
+    enc_pipe *p = (enc_pipe *) arg;
+    size_t k = p->k;
+
+    // block_arr carries over between blocks so the final short block keeps
+    // the same trailing bytes as a one-at-a-time pass
+    uint8_t *block_arr = (uint8_t *) calloc(k, sizeof(uint8_t));
+    block_arr[0] = 0xFF;
+
+    unsigned long j = 0;
+    bool done = false;
+
+    while (done == false) {
+        enc_slot *slot = (enc_slot *) ring_pop(p->spare);
+        slot->count = 0;
+
+        while (slot->count < p->cap && done == false) {
+            j = stream_read(&p->in, block_arr + 1, k - 1);
+
+            // if the number of bytes left is less than k-1 or it hits 0, in other words we're coming to an end
+            if (j < (k - 1) || j == 0) {
+                if (p->binary == true) {
+                    // binary-safe end marker: 0x80 followed by zeros
+                    block_arr[j + 1] = 0x80;
+                    memset(block_arr + j + 2, 0, k - j - 2);
+                } else {
+                    block_arr[j + 1]
+                        = 0; //makes sure to cut off anything after j in case it's less than k-1
+                }
+                done = true;
+            }
+
+            memcpy(slot->blocks + slot->count * k, block_arr, k);
+            slot->count++;
+            p->blocks++;
+        }
+
+        slot->last = done;
+        ring_push(p->filled, slot);
+    }
+
+    p->tail = j;
+    free(block_arr);
+    return NULL;
+}
+
+// writer stage: outputs ciphertext in input order
+static void *enc_writer(void *arg) {
+    enc_pipe *p = (enc_pipe *) arg;
+    uint8_t *out = (uint8_t *) malloc(p->width);
+    char *text = (char *) malloc(p->cap * (p->digits + 1)); // hex lines for a whole batch
+    bool last = false;
+
+    while (last == false) {
+        enc_slot *slot = (enc_slot *) ring_pop(p->done);
+
+        size_t len = 0;
+        for (size_t i = 0; i < slot->count; i++) {
+            if (p->binary == false) {
+                // same text as gmp_fprintf's "%Zx\n", written in one go below
+                len += hex_encode(text + len, slot->c[i]);
+                text[len++] = '\n';
+                continue;
+            }
+
+            export_block(out, p->width, slot->c[i]);
+            stream_write(&p->out, out, p->width);
+        }
+        stream_write(&p->out, text, len);
+
+        last = slot->last;
+        ring_push(p->spare, slot);
+    }
+
+    free(out);
+    free(text);
+    return NULL;
+}
+
+// encrypts plaintext from infile to outfile
+void ss_ctx_encrypt_file(ss_ctx *key, FILE *infile, FILE *outfile, const ss_file_opts *opts) {
+    ss_file_opts defaults;
+    if (opts == NULL) {
+        ss_file_opts_init(&defaults);
+        opts = &defaults;
+    }
+
+    const mpz_srcptr n = key->mod[0].n;
+    size_t k = key->k; // (log2(n) / 2 - 2) / 8
+
+    // the compressor sits in front of everything that reads the plaintext
+    uint8_t lz_flag = opts->compress == true ? SS_FLAG_LZ : 0;
+    if (opts->compress == true)
+        infile = lz_reader(infile);
+
+    if (opts->format == SS_FORMAT_HYBRID) {
+        pool *workers = pool_create(opts->threads);
+        hybrid_encrypt_file(infile, outfile, key, workers, lz_flag);
+        pool_destroy(workers);
+        if (opts->compress == true)
+            fclose(infile);
+        return;
+    }
+
+    bool indexed = opts->format == SS_FORMAT_CONTAINER;
+
+    pool *workers = pool_create(opts->threads);
+    uint32_t nworkers = pool_size(workers);
+
+    enc_pipe p;
+    p.k = k;
+    p.cap = (size_t) nworkers * BATCH_BLOCKS;
+    p.width = (mpz_sizeinbase(n, 2) + 7) / 8;
+    p.digits = mpz_size(n) * HEX_LIMB_DIGITS + 1;
+    p.binary = opts->format == SS_FORMAT_BINARY || indexed || opts->compress;
+    p.blocks = 0;
+
+    size_t depth = opts->depth > 0 ? opts->depth : 1;
+    p.spare = ring_create(depth);
+    p.filled = ring_create(depth);
+    p.done = ring_create(depth);
+
+    enc_slot *slots = (enc_slot *) malloc(depth * sizeof(enc_slot));
+    for (size_t i = 0; i < depth; i++) {
+        slots[i].blocks = (uint8_t *) malloc(p.cap * k);
+        slots[i].c = (mpz_t *) malloc(p.cap * sizeof(mpz_t));
+        for (size_t j = 0; j < p.cap; j++)
+            mpz_init(slots[i].c[j]);
+        ring_push(p.spare, &slots[i]);
+    }
+
+    enc_batch b;
+    b.k = k;
+    b.scratch = (lane_scratch *) malloc(nworkers * sizeof(lane_scratch));
+    for (uint32_t i = 0; i < nworkers; i++)
+        lane_scratch_init(&b.scratch[i], key);
+    b.lanes = ctx_lanes(key);
+    b.key = key;
+
+    if (p.binary == true) {
+        uint8_t flags = (indexed == true ? SS_FLAG_INDEX : 0) | lz_flag;
+        ss_header hdr = { SS_FORMAT_VERSION, flags, (uint32_t) p.width, (uint32_t) k };
+        ss_write_header(outfile, &hdr);
+    }
+
+    // after the header, which stays on stdio
+    stream_open(&p.in, infile, false, opts->io);
+    stream_open(&p.out, outfile, true, opts->io);
+
+    pthread_t reader, writer;
+    pthread_create(&reader, NULL, enc_reader, &p);
+    pthread_create(&writer, NULL, enc_writer, &p);
+
+    // compute stage: encrypt each batch while the next is read and the last is written
+    bool last = false;
+    while (last == false) {
+        enc_slot *slot = (enc_slot *) ring_pop(p.filled);
+        b.blocks = slot->blocks;
+        b.c = slot->c;
+        b.count = slot->count;
+        pool_run(workers, enc_group, &b, (b.count + b.lanes - 1) / b.lanes);
+        last = slot->last;
+        ring_push(p.done, slot);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    stream_close(&p.in);
+    stream_close(&p.out);
+
+    if (indexed == true)
+        write_index(outfile, p.blocks, p.width, k - 1, p.tail);
+    if (opts->compress == true)
+        fclose(infile);
+
+    pool_destroy(workers);
+    for (uint32_t i = 0; i < nworkers; i++)
+        lane_scratch_clear(&b.scratch[i]);
+    for (size_t i = 0; i < depth; i++) {
+        for (size_t j = 0; j < p.cap; j++)
+            mpz_clear(slots[i].c[j]);
+        free(slots[i].blocks);
+        free(slots[i].c);
+    }
+    ring_destroy(p.spare);
+    ring_destroy(p.filled);
+    ring_destroy(p.done);
+    free(slots);
+    free(b.scratch);
+}
+
+void ss_encrypt_file(FILE *infile, FILE *outfile, const mpz_t n, const ss_file_opts *opts) {
+    ss_ctx *key = ss_ctx_create_pub(n);
+    ss_ctx_encrypt_file(key, infile, outfile, opts);
+    ss_ctx_destroy(key);
 }
 
 // decrypt ciphertext
@@ -169,31 +1581,798 @@ void ss_decrypt(mpz_t m, const mpz_t c, const mpz_t d, const mpz_t pq) {
     pow_mod(m, c, d, pq);
 }
 
-// decrypt ciphertext from infile to outfile
-void ss_decrypt_file(FILE *infile, FILE *outfile, const mpz_t d, const mpz_t pq) {
-    size_t k = mpz_sizeinbase(pq, 2);
-    k -= 1;
-    k /= 8;
+// decrypt ciphertext with two half-size exponentiations mod p and mod q
+void ss_decrypt_crt(mpz_t m, const mpz_t c, const ss_crt *crt) {
+    mpz_t mp, mq, h;
+    mpz_inits(mp, mq, h, NULL);
 
-    uint8_t *block_arr = (uint8_t *) calloc(k, sizeof(uint8_t));
+    mpz_mod(h, c, crt->p);
+    pow_mod(mp, h, crt->dp, crt->p); // mp = c^dp mod p
+    mpz_mod(h, c, crt->q);
+    pow_mod(mq, h, crt->dq, crt->q); // mq = c^dq mod q
 
-    mpz_t c, m;
-    mpz_inits(c, m, NULL);
+    // recombine: m = mq + q * ((mp - mq) * qinv mod p)
+    mpz_sub(h, mp, mq);
+    mpz_mul(h, h, crt->qinv);
+    mpz_mod(h, h, crt->p);
+    mpz_mul(h, h, crt->q);
+    mpz_add(m, mq, h);
 
-    // iterate over each line block
-    do {
-        int res = gmp_fscanf(infile, "%Zx", c); // scan hexstring from that line
+    mpz_clears(mp, mq, h, NULL);
+}
+
+// per-worker scratch for decryption
+typedef struct {
+    lane_scratch ls;
+    size_t line[MBPOWM_MAX_LANES]; // record index of each lane
+    uint8_t *block; // exported plaintext block
+} dec_scratch;
+
+// one batch of ciphertext records, split into chunks of consecutive records
+typedef struct {
+    const ss_ctx *key; // private key
+    size_t k; // plaintext block bytes
+    dec_scratch *scratch; // one per worker
+    char **lines; // NUL-terminated hex lines, or fixed-width binary blocks
+    size_t nlines;
+    size_t width; // bytes per binary block, 0 for hex lines
+    bool final; // the last record of the batch is the final binary block
+    size_t per_chunk; // lines per chunk
+    byte_buf *out; // plaintext, one per chunk
+} dec_batch;
+
+// outputs a binary-format block: 0xFF, data, and on the final block 0x80 and zeros
+static void dec_binary_block(
+    const dec_batch *b, dec_scratch *sc, const mpz_t m, byte_buf *out, bool final) {
+    if (mpz_sizeinbase(m, 256) != b->k) {
+        fprintf(stderr, "ciphertext block does not match the private key\n");
+        exit(1);
+    }
+
+    mpz_export(sc->block, NULL, 1, sizeof(uint8_t), 1, 0, m);
+    size_t len = b->k - 1;
+    if (final == true) {
+        while (len > 0 && sc->block[len] == 0)
+            len--;
+        if (len == 0 || sc->block[len] != 0x80) {
+            fprintf(stderr, "final ciphertext block has no end marker\n");
+            exit(1);
+        }
+        len--; // data ends before the 0x80
+    }
+    byte_buf_append(out, sc->block + 1, len);
+}
+
+// decrypts one chunk of records into its output buffer, a lane's worth of
+// records at a time
+static void dec_chunk(void *arg, size_t chunk, uint32_t worker) {
+    dec_batch *b = (dec_batch *) arg;
+    dec_scratch *sc = &b->scratch[worker];
+    lane_scratch *ls = &sc->ls;
+    byte_buf *out = &b->out[chunk];
+    uint32_t lanes = ctx_lanes(b->key);
+
+    size_t first = chunk * b->per_chunk;
+    size_t last = first + b->per_chunk < b->nlines ? first + b->per_chunk : b->nlines;
+    out->len = 0;
+
+    for (size_t i = first; i < last;) {
+        size_t count = 0;
+        for (; i < last && count < lanes; i++) {
+            if (b->width > 0)
+                mpz_import(ls->c[count], b->width, sizeof(uint8_t), 1, 1, 0, b->lines[i]);
+            else if (hex_decode(ls->c[count], b->lines[i], strlen(b->lines[i])) == false
+                && mpz_set_str(ls->c[count], b->lines[i], 16) != 0) // skip anything that isn't a hexstring
+                continue;
+            sc->line[count++] = i;
+        }
+
+        ctx_decrypt_lanes(b->key, ls, ls->m, ls->c, count);
+
+        for (size_t l = 0; l < count; l++) {
+            mpz_srcptr m = ls->m[l];
+
+            if (b->width > 0) {
+                dec_binary_block(b, sc, m, out, b->final && sc->line[l] == b->nlines - 1);
+                continue;
+            }
+
+            // export to binary data starting at index 1, then output after the prepended
+            // byte up to the first 0 that cut off the final block
+            size_t j;
+            if (mpz_sizeinbase(m, 256) > b->k + 1)
+                continue; // too large to be a block under this key
+            mpz_export(sc->block + 1, &j, 1, sizeof(uint8_t), 1, 0, m);
+            if (j > 1) {
+                size_t len = strnlen((const char *) sc->block + 2, j - 1);
+                byte_buf_append(out, sc->block + 2, len);
+            }
+        }
+    }
+}
+
+// authenticates and decrypts record i in place
+static void hybrid_open(void *arg, size_t i, uint32_t worker) {
+    (void) worker;
+    hybrid_batch *b = (hybrid_batch *) arg;
+    uint8_t *slot = b->slots + i * HYBRID_SLOT;
+    size_t len = get_be32(slot) & ~SS_HYBRID_FINAL;
+
+    uint8_t nonce[CHACHA_NONCE_BYTES], aad[SS_HEADER_BYTES + 4];
+    hybrid_chunk_params(b, i, nonce, aad);
+    b->ok[i] = aead_open(slot + 4, slot + 4 + len, slot + 4, len, aad, sizeof(aad), b->key, nonce);
+}
+
+static void hybrid_truncated(void) {
+    fprintf(stderr, "truncated hybrid ciphertext\n");
+    exit(1);
+}
+
+// unwraps the session key with the private key and streams the payload back out
+static void hybrid_decrypt_file(
+    FILE *infile, FILE *outfile, dec_batch *db, const ss_header *hdr, pool *workers) {
+    hybrid_batch b;
+    pack_header(b.header, hdr);
+
+    dec_scratch *sc = &db->scratch[0];
+    byte_buf session = { 0 };
+    uint8_t *block = (uint8_t *) malloc(db->width);
+    size_t blocks = session_blocks(db->k);
+
+    for (size_t i = 0; i < blocks; i++) {
+        if (io_read(block, db->width, infile) != db->width)
+            hybrid_truncated();
+        mpz_import(sc->ls.c[0], db->width, sizeof(uint8_t), 1, 1, 0, block);
+        ctx_decrypt(db->key, sc->ls.m[0], sc->ls.c[0], sc->ls.mp[0], sc->ls.mq[0]);
+        dec_binary_block(db, sc, sc->ls.m[0], &session, i == blocks - 1);
+    }
+    if (session.len != SESSION_BYTES) {
+        fprintf(stderr, "malformed hybrid session key\n");
+        exit(1);
+    }
+    memcpy(b.key, session.data, CHACHA_KEY_BYTES);
+    memcpy(b.nonce, session.data + CHACHA_KEY_BYTES, CHACHA_NONCE_BYTES);
+
+    size_t cap = (size_t) pool_size(workers) * HYBRID_BATCH;
+    b.slots = (uint8_t *) malloc(cap * HYBRID_SLOT);
+    b.ok = (bool *) malloc(cap * sizeof(bool));
+    b.first = 0;
+
+    bool final = false;
+    while (final == false) {
+        b.count = 0;
+        while (b.count < cap && final == false) {
+            uint8_t *slot = b.slots + b.count * HYBRID_SLOT;
+            if (io_read(slot, 4, infile) != 4)
+                hybrid_truncated();
+
+            uint32_t field = get_be32(slot);
+            size_t len = field & ~SS_HYBRID_FINAL;
+            if (len > SS_HYBRID_CHUNK
+                || io_read(slot + 4, len + CHACHA_TAG_BYTES, infile)
+                       != len + CHACHA_TAG_BYTES)
+                hybrid_truncated();
+
+            final = (field & SS_HYBRID_FINAL) != 0;
+            b.count++;
+        }
+
+        pool_run(workers, hybrid_open, &b, b.count);
+
+        // nothing from a batch is released until all of it authenticates
+        for (size_t i = 0; i < b.count; i++) {
+            if (b.ok[i] == false) {
+                fprintf(stderr, "hybrid ciphertext failed authentication\n");
+                exit(1);
+            }
+        }
+        for (size_t i = 0; i < b.count; i++) {
+            uint8_t *slot = b.slots + i * HYBRID_SLOT;
+            io_write(slot + 4, get_be32(slot) & ~SS_HYBRID_FINAL, outfile);
+        }
+        b.first += b.count;
+    }
 
-        if (res == EOF) // if we reached end of file
-            break; //exit from loop
+    if (getc(infile) != EOF) {
+        STATS_ADD(STAT_BYTES_IN, 1);
+        fprintf(stderr, "trailing data after hybrid ciphertext\n");
+        exit(1);
+    }
 
-        ss_decrypt(m, c, d, pq);
+    memset(session.data, 0, session.len);
+    memset(b.key, 0, sizeof(b.key));
+    free(session.data);
+    free(block);
+    free(b.slots);
+    free(b.ok);
+}
+
+// ciphertext bytes read per worker thread before a batch is decrypted
+#define BATCH_BYTES (1 << 18)
+
+// chunks handed out per worker thread in each batch
+#define CHUNKS_PER_WORKER 4
+
+// one container index entry
+typedef struct {
+    uint64_t offset; // block offset in the file
+    uint64_t plain; // offset of the block's plaintext
+    uint32_t len; // plaintext bytes in the block
+} index_entry;
+
+static void index_corrupt(void) {
+    fprintf(stderr, "corrupt ciphertext index\n");
+    exit(1);
+}
+
+// reads the entry at the current position of infile
+static void read_entry(FILE *infile, index_entry *e) {
+    uint8_t raw[SS_INDEX_ENTRY_BYTES];
+    if (io_read(raw, SS_INDEX_ENTRY_BYTES, infile) != SS_INDEX_ENTRY_BYTES)
+        index_corrupt();
+    e->offset = get_be64(raw);
+    e->plain = get_be64(raw + 8);
+    e->len = get_be32(raw + 16);
+}
+
+static void seek_entry(FILE *infile, uint64_t index_offset, uint64_t i) {
+    if (fseeko(infile, (off_t) (index_offset + i * SS_INDEX_ENTRY_BYTES), SEEK_SET) != 0)
+        index_corrupt();
+}
+
+// decrypts plaintext bytes [offset, offset + len) of a container, reading
+// only the index entries and blocks that cover them
+static void indexed_decrypt(dec_batch *b, FILE *infile, FILE *outfile, pool *workers,
+    size_t max_chunks, uint64_t offset, uint64_t len) {
+    uint8_t footer[SS_FOOTER_BYTES];
+    if (fseeko(infile, -(off_t) SS_FOOTER_BYTES, SEEK_END) != 0) {
+        fprintf(stderr, "indexed ciphertext needs a seekable input\n");
+        exit(1);
+    }
+    if (io_read(footer, SS_FOOTER_BYTES, infile) != SS_FOOTER_BYTES
+        || get_be32(footer + 16) != SS_INDEX_ENTRY_BYTES
+        || memcmp(footer + 20, SS_INDEX_MAGIC, 4) != 0)
+        index_corrupt();
+
+    uint64_t index_offset = get_be64(footer);
+    uint64_t count = get_be64(footer + 8);
+    uint64_t end = len > UINT64_MAX - offset ? UINT64_MAX : offset + len;
+    if (count == 0)
+        index_corrupt();
+    if (len == 0)
+        return;
+
+    // binary search for the last block whose plaintext starts at or before offset
+    uint64_t lo = 0, hi = count - 1;
+    index_entry e;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo + 1) / 2;
+        seek_entry(infile, index_offset, mid);
+        read_entry(infile, &e);
+        if (e.plain <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    size_t cap = (size_t) pool_size(workers) * BATCH_BYTES / b->width + 1;
+    index_entry *entries = (index_entry *) malloc(cap * sizeof(index_entry));
+    uint8_t *blocks = (uint8_t *) malloc(cap * b->width);
+    char **lines = (char **) malloc(cap * sizeof(char *));
+    b->lines = lines;
+
+    bool past = false;
+    for (uint64_t i = lo; i < count && past == false; i += b->nlines) {
+        // entries for this batch, up to the first block that starts past the range
+        size_t n = 0;
+        seek_entry(infile, index_offset, i);
+        while (n < cap && i + n < count) {
+            read_entry(infile, &entries[n]);
+            if (n > 0 && entries[n].plain >= end) {
+                past = true;
+                break;
+            }
+            n++;
+        }
+
+        for (size_t j = 0; j < n; j++) {
+            if (fseeko(infile, (off_t) entries[j].offset, SEEK_SET) != 0
+                || io_read(blocks + j * b->width, b->width, infile) != b->width) {
+                fprintf(stderr, "truncated ciphertext block\n");
+                exit(1);
+            }
+            lines[j] = (char *) blocks + j * b->width;
+        }
+
+        b->nlines = n;
+        b->final = i + n == count;
+        size_t chunks = n < max_chunks ? n : max_chunks;
+        b->per_chunk = (n + chunks - 1) / chunks;
+        chunks = (n + b->per_chunk - 1) / b->per_chunk;
+        pool_run(workers, dec_chunk, b, chunks);
+
+        // keep only the part of the plaintext inside the range
+        uint64_t pos = entries[0].plain;
+        for (size_t c = 0; c < chunks; c++) {
+            uint64_t from = pos > offset ? pos : offset;
+            uint64_t to = pos + b->out[c].len < end ? pos + b->out[c].len : end;
+            if (from < to)
+                io_write(b->out[c].data + (from - pos), to - from, outfile);
+            pos += b->out[c].len;
+        }
+    }
+
+    b->lines = NULL;
+    free(entries);
+    free(blocks);
+    free(lines);
+}
+
+// one batch in flight between the decryption stages
+typedef struct {
+    char *buf; // whole records, plus room for a NUL after the last one
+    size_t cap;
+    char **lines; // records in buf
+    size_t nlines;
+    size_t lines_cap;
+    bool final; // the last record is the final binary block
+    byte_buf *out; // plaintext, one per chunk
+    size_t chunks; // chunks used
+    bool last; // no batch follows this one
+} dec_slot;
+
+// reader, compute and writer stages of streamed decryption, laid out like enc_pipe
+typedef struct {
+    io_stream in;
+    io_stream out;
+    ring *spare;
+    ring *filled;
+    ring *done;
+    size_t width; // bytes per binary block, 0 for hex lines
+    size_t want; // bytes read per batch
+} dec_pipe;
+
+static void slot_add_line(dec_slot *slot, char *line) {
+    if (slot->nlines == slot->lines_cap) {
+        slot->lines_cap *= 2;
+        slot->lines = (char **) realloc(slot->lines, slot->lines_cap * sizeof(char *));
+    }
+    slot->lines[slot->nlines++] = line;
+}
+
+// reader stage: cuts the input into batches of whole records, carrying the
+// partial record at the end of each batch over to the next
+static void *dec_reader(void *arg) {
+    dec_pipe *p = (dec_pipe *) arg;
+    byte_buf carry = { 0 };
+    bool eof = false;
+
+    while (eof == false) {
+        dec_slot *slot = (dec_slot *) ring_pop(p->spare);
+
+        size_t len = carry.len;
+        if (slot->cap < len + p->want + 1) {
+            slot->cap = len + p->want + 1;
+            slot->buf = (char *) realloc(slot->buf, slot->cap);
+        }
+        if (len > 0)
+            memcpy(slot->buf, carry.data, len);
+
+        size_t got = stream_read(&p->in, slot->buf + len, p->want);
+        len += got;
+        eof = got < p->want;
+
+        char *buf = slot->buf;
+        size_t end = len;
+        slot->nlines = 0;
+
+        if (p->width > 0) {
+            // whole blocks only; hold one back until EOF tells us which block is final
+            if (eof == true && len % p->width != 0) {
+                fprintf(stderr, "truncated ciphertext block\n");
+                exit(1);
+            }
+            end = len - len % p->width;
+            if (eof == false && end >= p->width)
+                end -= p->width;
+            slot->final = eof;
+
+            for (size_t start = 0; start < end; start += p->width)
+                slot_add_line(slot, buf + start);
+        }
+
+        // split on newline boundaries; the trailing partial line waits for more input
+        if (p->width == 0 && eof == false) {
+            while (end > 0 && buf[end - 1] != '\n')
+                end--;
+        }
+
+        carry.len = 0;
+        byte_buf_append(&carry, (const uint8_t *) buf + end, len - end);
+
+        for (size_t start = 0; p->width == 0 && start < end;) {
+            size_t stop = start;
+            while (stop < end && buf[stop] != '\n')
+                stop++;
+            buf[stop < end ? stop : end] = '\0'; // buf has room past len for the last line
+
+            slot_add_line(slot, buf + start);
+            start = stop + 1;
+        }
+
+        slot->last = eof;
+        ring_push(p->filled, slot);
+    }
+
+    free(carry.data);
+    return NULL;
+}
+
+// writer stage: outputs plaintext in input order
+static void *dec_writer(void *arg) {
+    dec_pipe *p = (dec_pipe *) arg;
+    bool last = false;
+
+    while (last == false) {
+        dec_slot *slot = (dec_slot *) ring_pop(p->done);
+        for (size_t i = 0; i < slot->chunks; i++)
+            if (slot->out[i].len > 0) // an empty chunk may have no buffer at all
+                stream_write(&p->out, slot->out[i].data, slot->out[i].len);
+        last = slot->last;
+        ring_push(p->spare, slot);
+    }
+
+    return NULL;
+}
+
+// decrypts hex or plain binary ciphertext front to back, overlapping reads,
+// exponentiation and writes across up to depth batches
+static void streamed_decrypt(dec_batch *b, FILE *infile, FILE *outfile, pool *workers,
+    size_t max_chunks, uint32_t depth, ss_io io) {
+    dec_pipe p;
+    stream_open(&p.in, infile, false, io);
+    stream_open(&p.out, outfile, true, io);
+    p.width = b->width;
+    p.want = (size_t) pool_size(workers) * BATCH_BYTES + b->width;
+
+    depth = depth > 0 ? depth : 1;
+    p.spare = ring_create(depth);
+    p.filled = ring_create(depth);
+    p.done = ring_create(depth);
+
+    dec_slot *slots = (dec_slot *) calloc(depth, sizeof(dec_slot));
+    for (uint32_t i = 0; i < depth; i++) {
+        slots[i].lines_cap = 1024;
+        slots[i].lines = (char **) malloc(slots[i].lines_cap * sizeof(char *));
+        slots[i].out = (byte_buf *) calloc(max_chunks, sizeof(byte_buf));
+        ring_push(p.spare, &slots[i]);
+    }
+
+    byte_buf *own_out = b->out;
+
+    pthread_t reader, writer;
+    pthread_create(&reader, NULL, dec_reader, &p);
+    pthread_create(&writer, NULL, dec_writer, &p);
+
+    // compute stage
+    bool last = false;
+    while (last == false) {
+        dec_slot *slot = (dec_slot *) ring_pop(p.filled);
+        b->lines = slot->lines;
+        b->nlines = slot->nlines;
+        b->final = slot->final;
+        b->out = slot->out;
+
+        size_t chunks = b->nlines < max_chunks ? b->nlines : max_chunks;
+        if (chunks > 0) {
+            b->per_chunk = (b->nlines + chunks - 1) / chunks;
+            chunks = (b->nlines + b->per_chunk - 1) / b->per_chunk;
+            pool_run(workers, dec_chunk, b, chunks);
+        }
+        slot->chunks = chunks;
+
+        last = slot->last;
+        ring_push(p.done, slot);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    stream_close(&p.in);
+    stream_close(&p.out);
+    b->out = own_out;
+
+    for (uint32_t i = 0; i < depth; i++) {
+        for (size_t j = 0; j < max_chunks; j++)
+            free(slots[i].out[j].data);
+        free(slots[i].out);
+        free(slots[i].lines);
+        free(slots[i].buf);
+    }
+    ring_destroy(p.spare);
+    ring_destroy(p.filled);
+    ring_destroy(p.done);
+    free(slots);
+}
+
+// decrypts all of infile, or with ranged set only plaintext bytes [offset, offset + count)
+static void decrypt_file(ss_ctx *key, FILE *infile, FILE *outfile, const ss_file_opts *opts,
+    bool ranged, uint64_t offset, uint64_t count) {
+    ss_file_opts defaults;
+    if (opts == NULL) {
+        ss_file_opts_init(&defaults);
+        opts = &defaults;
+    }
+
+    size_t k = key->k; // (log2(pq) - 1) / 8
+
+    pool *workers = pool_create(opts->threads);
+    uint32_t nworkers = pool_size(workers);
+    size_t max_chunks = (size_t) nworkers * CHUNKS_PER_WORKER;
+
+    dec_batch b;
+    b.key = key;
+    b.k = k;
+    b.width = 0;
+    b.final = false;
+    b.lines = NULL;
+
+    // binary ciphertext starts with a header, hex ciphertext goes straight to the lines
+    ss_header hdr = { 0 };
+    if (ss_read_header(infile, &hdr) == true) {
+        // the sizes set the scratch, the reads and the session key's
+        // unpacking on every path, so a forged header stops here
+        if (header_fits(key, hdr.block_bytes, hdr.plain_bytes) == false) {
+            fprintf(stderr, "unsupported ciphertext header\n");
+            exit(1);
+        }
+        b.k = hdr.plain_bytes;
+        b.width = hdr.block_bytes;
+    }
+
+    b.scratch = (dec_scratch *) malloc(nworkers * sizeof(dec_scratch));
+    for (uint32_t i = 0; i < nworkers; i++) {
+        lane_scratch_init(&b.scratch[i].ls, key);
+        b.scratch[i].block = (uint8_t *) calloc((k > b.k ? k : b.k) + 2, sizeof(uint8_t));
+    }
+    b.out = (byte_buf *) calloc(max_chunks, sizeof(byte_buf));
+
+    bool indexed = b.width > 0 && (hdr.flags & SS_FLAG_INDEX) != 0;
+    if (ranged == true && indexed == false) {
+        fprintf(stderr, "ranged decryption needs indexed ciphertext\n");
+        exit(1);
+    }
+
+    // compressed plaintext is decompressed on its way out, whichever path decrypts it
+    bool compressed = b.width > 0 && (hdr.flags & SS_FLAG_LZ) != 0;
+    if (ranged == true && compressed == true) {
+        fprintf(stderr, "ranged decryption can't seek into compressed plaintext\n");
+        exit(1);
+    }
+    if (compressed == true)
+        outfile = lz_writer(outfile);
+
+    bool eof = false;
+    if (b.width > 0 && (hdr.flags & SS_FLAG_HYBRID) != 0) {
+        hybrid_decrypt_file(infile, outfile, &b, &hdr, workers);
+        eof = true; // the hybrid path consumed the whole file
+    } else if (indexed == true) {
+        indexed_decrypt(&b, infile, outfile, workers, max_chunks, offset, count);
+        eof = true; // blocks are located through the index instead of read in order
+    }
+
+    if (eof == false)
+        streamed_decrypt(&b, infile, outfile, workers, max_chunks, opts->depth, opts->io);
+    if (compressed == true)
+        fclose(outfile);
+
+    pool_destroy(workers);
+    for (uint32_t i = 0; i < nworkers; i++) {
+        lane_scratch_clear(&b.scratch[i].ls);
+        free(b.scratch[i].block);
+    }
+    for (size_t i = 0; i < max_chunks; i++)
+        free(b.out[i].data);
+    free(b.scratch);
+    free(b.out);
+}
+
+void ss_ctx_decrypt_file(ss_ctx *key, FILE *infile, FILE *outfile, const ss_file_opts *opts) {
+    decrypt_file(key, infile, outfile, opts, false, 0, UINT64_MAX);
+}
+
+void ss_ctx_decrypt_range(ss_ctx *key, FILE *infile, FILE *outfile, uint64_t offset, uint64_t len,
+    const ss_file_opts *opts) {
+    decrypt_file(key, infile, outfile, opts, true, offset, len);
+}
+
+void ss_decrypt_file(FILE *infile, FILE *outfile, const mpz_t d, const mpz_t pq,
+    const ss_crt *crt, const ss_file_opts *opts) {
+    ss_ctx *key = ss_ctx_create_priv(d, pq, crt);
+    ss_ctx_decrypt_file(key, infile, outfile, opts);
+    ss_ctx_destroy(key);
+}
+
+struct ss_request {
+    bool decrypt;
+    bool hex; // hex ciphertext lines rather than the binary format
+    size_t k; // bytes per packed plaintext block
+    size_t width; // bytes per binary ciphertext block
+    size_t count;
+    mpz_t *blocks;
+};
+
+static ss_request *request_alloc(bool decrypt, size_t k, size_t width, size_t count) {
+    ss_request *r = (ss_request *) calloc(1, sizeof(ss_request));
+    r->decrypt = decrypt;
+    r->k = k;
+    r->width = width;
+    r->count = count;
+    r->blocks = (mpz_t *) malloc((count > 0 ? count : 1) * sizeof(mpz_t));
+    for (size_t i = 0; i < count; i++)
+        mpz_init(r->blocks[i]);
+    return r;
+}
+
+static void request_free(ss_request *r) {
+    for (size_t i = 0; i < r->count; i++)
+        mpz_clear(r->blocks[i]);
+    free(r->blocks);
+    free(r);
+}
+
+ss_request *ss_request_encrypt(const ss_ctx *ctx, const uint8_t *data, size_t len) {
+    size_t k = ctx->k;
+    size_t width = (mpz_sizeinbase(ctx->mod[0].n, 2) + 7) / 8;
+
+    // packed as enc_reader packs the binary format: the final block is the
+    // first one short of k - 1 data bytes, and ends in 0x80 and zeros
+    ss_request *r = request_alloc(false, k, width, len / (k - 1) + 1);
+    uint8_t *block = (uint8_t *) malloc(k);
+    block[0] = 0xFF;
+
+    for (size_t i = 0, off = 0; i < r->count; i++, off += k - 1) {
+        size_t j = len - off < k - 1 ? len - off : k - 1;
+        memcpy(block + 1, data + off, j);
+        if (i == r->count - 1) {
+            block[j + 1] = 0x80;
+            memset(block + j + 2, 0, k - j - 2);
+        }
+        mpz_import(r->blocks[i], k, 1, sizeof(uint8_t), 1, 0, block);
+    }
+
+    free(block);
+    return r;
+}
+
+ss_request *ss_request_decrypt(const ss_ctx *ctx, const uint8_t *data, size_t len) {
+    size_t k = ctx->k;
+
+    // hex ciphertext: one block per line, lines that aren't hexstrings skipped
+    if (len == 0 || data[0] != SS_MAGIC0) {
+        size_t lines = 0;
+        for (size_t i = 0; i < len; i++)
+            lines += data[i] == '\n';
+
+        ss_request *r = request_alloc(true, k, 0, lines + 1);
+        char *line = (char *) malloc(len + 1);
+        size_t count = 0;
+        for (size_t start = 0; start < len;) {
+            const uint8_t *nl = (const uint8_t *) memchr(data + start, '\n', len - start);
+            size_t end = nl != NULL ? (size_t) (nl - data) : len;
+            memcpy(line, data + start, end - start);
+            line[end - start] = '\0';
+            if (hex_decode(r->blocks[count], line, end - start) == true
+                || mpz_set_str(r->blocks[count], line, 16) == 0)
+                count++;
+            start = end + 1;
+        }
+        free(line);
+
+        for (size_t i = count; i < r->count; i++)
+            mpz_clear(r->blocks[i]);
+        r->count = count;
+        r->hex = true;
+        return r;
+    }
+
+    // hybrid and compressed ciphertext are left to the file paths; like
+    // ss_ctx_decrypt_file, blocks are unpacked with the header's plain_bytes,
+    // which a block decrypted under this key can be no larger than
+    const uint8_t magic[4] = { SS_MAGIC0, SS_MAGIC1, SS_MAGIC2, SS_MAGIC3 };
+    if (len < SS_HEADER_BYTES || memcmp(data, magic, sizeof(magic)) != 0
+        || data[4] != SS_FORMAT_VERSION || (data[5] & ~SS_FLAG_INDEX) != 0
+        || header_fits(ctx, get_be32(data + 8), get_be32(data + 12)) == false)
+        return NULL;
+
+    size_t width = get_be32(data + 8);
+    k = get_be32(data + 12);
+    size_t body = len - SS_HEADER_BYTES;
+
+    // a container's blocks end where its index starts
+    if ((data[5] & SS_FLAG_INDEX) != 0) {
+        const uint8_t *footer = data + len - SS_FOOTER_BYTES;
+        if (body < SS_FOOTER_BYTES || memcmp(footer + 20, SS_INDEX_MAGIC, 4) != 0)
+            return NULL;
+        uint64_t count = get_be64(footer + 8);
+        if (count > body / width)
+            return NULL;
+        body = count * width;
+    }
+
+    if (body == 0 || body % width != 0)
+        return NULL;
+
+    ss_request *r = request_alloc(true, k, width, body / width);
+    for (size_t i = 0; i < r->count; i++)
+        mpz_import(r->blocks[i], width, 1, sizeof(uint8_t), 1, 0, data + SS_HEADER_BYTES + i * width);
+    return r;
+}
+
+mpz_t *ss_request_blocks(ss_request *r, size_t *count) {
+    *count = r->count;
+    return r->blocks;
+}
+
+bool ss_request_finish(ss_request *r, uint8_t **out, size_t *len) {
+    byte_buf b = { 0 };
+    uint8_t *block = (uint8_t *) calloc(r->k + 2, sizeof(uint8_t));
+    bool ok = true;
+
+    if (r->decrypt == false) {
+        // the binary format, exactly as ss_ctx_encrypt_file writes it
+        ss_header hdr = { SS_FORMAT_VERSION, 0, (uint32_t) r->width, (uint32_t) r->k };
+        b.cap = SS_HEADER_BYTES + r->count * r->width;
+        b.data = (uint8_t *) malloc(b.cap);
+        pack_header(b.data, &hdr);
+        b.len = b.cap;
+
+        for (size_t i = 0; i < r->count; i++) {
+            uint8_t *c = b.data + SS_HEADER_BYTES + i * r->width;
+            size_t used = mpz_sgn(r->blocks[i]) != 0 ? mpz_sizeinbase(r->blocks[i], 256) : 0;
+            memset(c, 0, r->width - used);
+            mpz_export(c + r->width - used, NULL, 1, sizeof(uint8_t), 1, 0, r->blocks[i]);
+        }
+    }
+
+    for (size_t i = 0; i < r->count && r->decrypt == true && r->hex == true; i++) {
+        // same as dec_chunk: data runs to the first 0 after the prepended byte
         size_t j;
-        mpz_export(block_arr + 1, &j, 1, sizeof(uint8_t), 1, 0,
-            m); // export to binary data, starting at index 1
-        fprintf(outfile, "%s", &block_arr[2]); // output after the prepended byte
-    } while (true);
+        if (mpz_sizeinbase(r->blocks[i], 256) > r->k + 1)
+            continue;
+        mpz_export(block + 1, &j, 1, sizeof(uint8_t), 1, 0, r->blocks[i]);
+        if (j > 1)
+            byte_buf_append(&b, block + 2, strnlen((const char *) block + 2, j - 1));
+    }
 
-    free(block_arr);
-    mpz_clears(c, m, NULL);
+    for (size_t i = 0; i < r->count && r->decrypt == true && r->hex == false && ok == true; i++) {
+        // same checks as dec_binary_block, failing instead of exiting
+        if (mpz_sizeinbase(r->blocks[i], 256) != r->k) {
+            ok = false;
+            break;
+        }
+
+        mpz_export(block, NULL, 1, sizeof(uint8_t), 1, 0, r->blocks[i]);
+        size_t n = r->k - 1;
+        if (i == r->count - 1) {
+            while (n > 0 && block[n] == 0)
+                n--;
+            ok = n > 0 && block[n] == 0x80;
+            n--;
+        }
+        if (ok == true)
+            byte_buf_append(&b, block + 1, n);
+    }
+
+    free(block);
+    request_free(r);
+
+    if (ok == false) {
+        free(b.data);
+        return false;
+    }
+
+    // an empty plaintext still gets a buffer the caller can free
+    *out = b.data != NULL ? b.data : (uint8_t *) malloc(1);
+    *len = b.len;
+    return true;
 }
@@ -5,6 +5,112 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+//
+// CRT components of an SS private key. Decryption with these splits the
+// exponentiation mod pq into two half-size exponentiations mod p and mod q.
+//
+typedef struct {
+    mpz_t p; // first prime
+    mpz_t q; // second prime
+    mpz_t dp; // d mod (p - 1)
+    mpz_t dq; // d mod (q - 1)
+    mpz_t qinv; // q^-1 mod p
+} ss_crt;
+
+//
+// Ciphertext formats written by ss_encrypt_file.
+//
+// SS_FORMAT_HEX: one hexstring per block, one block per line.
+//
+// SS_FORMAT_BINARY: a header followed by blocks of exactly block_bytes
+// bytes each, so block i starts at SS_HEADER_BYTES + i * block_bytes. Each
+// block is the ciphertext integer exported big-endian and left-padded with
+// zeros to the width of n. The final block's plaintext ends in 0x80 and
+// zero padding, so binary data round-trips exactly.
+//
+// SS_FORMAT_HYBRID: a header with SS_FLAG_HYBRID set, then a random session
+// key (32-byte ChaCha20 key and 12-byte nonce) packed and encrypted exactly
+// like binary-format blocks, then the payload in chunks of up to
+// SS_HYBRID_CHUNK bytes. Each chunk is stored as a big-endian u32 length,
+// with SS_HYBRID_FINAL set on the last chunk, followed by the
+// ChaCha20-Poly1305 ciphertext and its 16-byte tag. Chunk i is sealed with
+// the session nonce XOR i (little-endian, into the last 8 bytes) and the
+// header and length field as associated data, so chunks cannot be altered,
+// reordered, dropped or truncated without failing authentication.
+//
+// SS_FORMAT_CONTAINER: the binary format with SS_FLAG_INDEX set, followed
+// by an index with one entry per block and a footer, so a plaintext range
+// can be decrypted without reading the blocks before it. Index entries are
+// SS_INDEX_ENTRY_BYTES each: block offset (u64), offset of the block's
+// plaintext (u64) and plaintext length (u32). The footer is the last
+// SS_FOOTER_BYTES of the file: index offset (u64), block count (u64),
+// entry size (u32) and SS_INDEX_MAGIC. All fields are big-endian.
+//
+// With ss_file_opts.compress, any header-carrying format sets SS_FLAG_LZ
+// and encrypts the plaintext as an lz.h framed stream instead of as it is;
+// hex output has no header, so the binary format is written in its place.
+// Index entries of a compressed container then refer to the compressed
+// stream, which rules out ranged decryption.
+//
+typedef enum {
+    SS_FORMAT_HEX,
+    SS_FORMAT_BINARY,
+    SS_FORMAT_HYBRID,
+    SS_FORMAT_CONTAINER
+} ss_format;
+
+//
+// Binary ciphertext header, stored as:
+//  magic[4] (0x89 'S' 'S' 'C'), version, flags, 2 reserved bytes,
+//  block_bytes (big-endian u32), plain_bytes (big-endian u32)
+//
+#define SS_HEADER_BYTES   16
+#define SS_FORMAT_VERSION 1
+#define SS_MAGIC0         0x89
+#define SS_MAGIC1         'S'
+#define SS_MAGIC2         'S'
+#define SS_MAGIC3         'C'
+
+#define SS_FLAG_HYBRID  0x01 // payload sealed under an SS-wrapped session key
+#define SS_FLAG_INDEX   0x02 // blocks are followed by an index and footer
+#define SS_FLAG_LZ      0x04 // plaintext is an lz.h framed stream
+#define SS_HYBRID_CHUNK (1 << 16)
+#define SS_HYBRID_FINAL 0x80000000u
+
+#define SS_INDEX_ENTRY_BYTES 20
+#define SS_FOOTER_BYTES      24
+#define SS_INDEX_MAGIC       "SSIX"
+
+typedef struct {
+    uint8_t version; // SS_FORMAT_VERSION
+    uint8_t flags; // SS_FLAG_* bits
+    uint32_t block_bytes; // bytes per ciphertext block
+    uint32_t plain_bytes; // bytes per packed plaintext block, including the 0xFF prefix
+} ss_header;
+
+//
+// How the streamed file paths move data. Regular files go through fileio.h,
+// with io_uring (falling back to pread/pwrite where the kernel refuses it)
+// or with pread/pwrite alone; pipes, terminals and compressed streams stay
+// on stdio whatever is chosen, as do the hybrid format and ranged reads.
+//
+typedef enum {
+    SS_IO_URING,
+    SS_IO_PREAD,
+    SS_IO_STDIO
+} ss_io;
+
+//
+// Tunables for the file encryption and decryption paths.
+//
+typedef struct {
+    uint32_t threads; // worker threads for block exponentiation, 1 runs in-line
+    ss_format format; // ciphertext format written by ss_encrypt_file
+    uint32_t depth; // batches in flight between the reader, compute and writer stages
+    bool compress; // LZ-compress the plaintext before it is packed into blocks
+    ss_io io; // how regular files are read and written
+} ss_file_opts;
+
 //
 // Generates the components for a new SS key.
 //
@@ -20,6 +126,16 @@
 //
 void ss_make_pub(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters);
 
+//
+// Same as ss_make_pub, with prime candidates searched for on several threads.
+// The key only depends on the random seed and the number of threads.
+//
+// Requires:
+//  threads: number of search threads, 1 behaves exactly like ss_make_pub
+//
+void ss_make_pub_threads(
+    mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters, uint32_t threads);
+
 //
 // Generates components for a new SS private key.
 //
@@ -34,6 +150,27 @@ void ss_make_pub(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters);
 //
 void ss_make_priv(mpz_t d, mpz_t pq, const mpz_t p, const mpz_t q);
 
+//
+// Initializes/frees the mpz_t members of a CRT key.
+//
+void ss_crt_init(ss_crt *crt);
+
+void ss_crt_clear(ss_crt *crt);
+
+//
+// Generates the CRT components of an SS private key.
+//
+// Provides:
+//  crt: p, q, d mod (p - 1), d mod (q - 1) and q^-1 mod p
+//
+// Requires:
+//  d: private exponent
+//  p: first prime number
+//  q: second prime number
+//  crt: initialized with ss_crt_init
+//
+void ss_make_crt(ss_crt *crt, const mpz_t d, const mpz_t p, const mpz_t q);
+
 //
 // Export SS public key to output stream
 //
@@ -50,9 +187,154 @@ void ss_write_pub(const mpz_t n, const char username[], FILE *pbfile);
 // Requires:
 //  pq: private modulus
 //  d:  private exponent
+//  crt: CRT components appended after d, or NULL for the two-field format
 //  pvfile: open and writable file stream
 //
-void ss_write_priv(const mpz_t pq, const mpz_t d, FILE *pvfile);
+void ss_write_priv(const mpz_t pq, const mpz_t d, const ss_crt *crt, FILE *pvfile);
+
+//
+// Binary key files hold the raw limbs of the key along with everything
+// derived from it that setup would otherwise recompute: the Montgomery
+// constants of each modulus and the CRT components. They are mapped into
+// memory and used in place, with no parsing. Layout, in host byte order:
+//  magic[4] (0x89 'S' 'S' 'K'), version u16, kind u16, limb bytes u16,
+//  byte-order mark u16, record count u32, total bytes u64,
+//  FNV-1a checksum of everything after the 32-byte header u64,
+// then records of a u32 tag and u32 length followed by the payload,
+// zero-padded to 8 bytes. Files from a host with a different limb size or
+// byte order are rejected.
+//
+#define SS_KEY_MAGIC3  'K'
+#define SS_KEY_VERSION 1
+#define SS_KEY_PUB     1
+#define SS_KEY_PRIV    2
+
+typedef struct ss_keyfile ss_keyfile;
+
+//
+// Export SS public key to output stream as a binary key file
+//
+// Requires:
+//  n: public modulus/exponent
+//  username: login name of keyholder ($USER)
+//  pbfile: open and writable file stream
+//
+void ss_write_pub_bin(const mpz_t n, const char username[], FILE *pbfile);
+
+//
+// Export SS private key to output stream as a binary key file
+//
+// Requires:
+//  pq: private modulus
+//  d:  private exponent
+//  crt: CRT components, or NULL to leave them out
+//  pvfile: open and writable file stream
+//
+void ss_write_priv_bin(const mpz_t pq, const mpz_t d, const ss_crt *crt, FILE *pvfile);
+
+//
+// Maps a binary key file.
+//
+// Provides:
+//  returns the mapped key, or NULL if path can't be opened or is not a
+//  binary key file (e.g. a text key); exits with an error if the file is
+//  a binary key file that fails its checks
+//
+ss_keyfile *ss_keyfile_open(const char *path);
+
+//
+// Unmaps a key file. Contexts made from it must be destroyed first.
+//
+void ss_keyfile_close(ss_keyfile *kf);
+
+//
+// Returns SS_KEY_PUB or SS_KEY_PRIV.
+//
+int ss_keyfile_kind(const ss_keyfile *kf);
+
+//
+// Copies the public key out of a mapped key file.
+//
+// Provides:
+//  n: public modulus
+//  username: $USER of the pubkey creator, truncated to _POSIX_LOGIN_NAME_MAX - 1
+//  returns false if kf holds a private key
+//
+bool ss_keyfile_read_pub(const ss_keyfile *kf, mpz_t n, char username[]);
+
+//
+// Copies the private key out of a mapped key file.
+//
+// Provides:
+//  pq: private modulus
+//  d:  private exponent
+//  crt: CRT components, if the key file has them
+//  returns true if crt was filled, false if it wasn't or kf holds a public key
+//
+bool ss_keyfile_read_priv(const ss_keyfile *kf, mpz_t pq, mpz_t d, ss_crt *crt);
+
+//
+// A keystore holds many key pairs in one file, each stored as a pair of
+// binary key file images, behind an open-addressing hash table of their ids
+// so that finding a key costs the same however many the store holds. The
+// index is checksummed when the store is opened and each key when it is
+// looked up. Layout, in host byte order:
+//  magic[4] (0x89 'S' 'S' 'S'), version u16, limb bytes u16, byte-order
+//  mark u16, reserved u16, key count u32, bucket count u32, id bytes u32,
+//  total bytes u64, FNV-1a checksum of the index u64,
+// then the index: one u32 per bucket (entry number + 1, or 0 if empty,
+// padded to 8 bytes), one 48-byte entry per key holding the FNV-1a hash of
+// its id, where the id is, and the offset and length of its public and
+// private key file images, and the ids (padded to 8 bytes). The key file
+// images follow, each starting on an 8-byte boundary.
+//
+typedef struct ss_keystore ss_keystore;
+
+//
+// Generates count key pairs, spread over threads threads, and writes them
+// to outfile as a keystore. Key i has the id "i" (in decimal). Each key is
+// made from a random stream of its own, so the keys only depend on the seed.
+//
+// Requires:
+//  outfile: open and writable file stream
+//  count: 1 or more
+//  username: login name of keyholder ($USER), stored in every public key
+//  randstate_init called
+//
+void ss_write_keystore(FILE *outfile, uint32_t count, uint64_t nbits, uint64_t iters,
+    uint32_t threads, const char username[]);
+
+//
+// Maps a keystore.
+//
+// Provides:
+//  returns the mapped store, or NULL if path can't be opened or is not a
+//  keystore; exits with an error if the index fails its checks
+//
+ss_keystore *ss_keystore_open(const char *path);
+
+//
+// Unmaps a keystore. Key files taken from it must be closed first.
+//
+void ss_keystore_close(ss_keystore *ks);
+
+//
+// Number of key pairs in the store.
+//
+uint32_t ss_keystore_count(const ss_keystore *ks);
+
+//
+// Looks up one half of a key pair by id, with a single hash probe sequence.
+// The key file points into the store's mapping; close it with
+// ss_keyfile_close before closing the store.
+//
+// Provides:
+//  returns the key, or NULL if the store has no key with that id
+//
+// Requires:
+//  kind: SS_KEY_PUB or SS_KEY_PRIV
+//
+ss_keyfile *ss_keystore_get(const ss_keystore *ks, const char *id, int kind);
 
 //
 // Import SS public key from input stream
@@ -74,12 +356,15 @@ void ss_read_pub(mpz_t n, char username[], FILE *pbfile);
 // Provides:
 //  pq: private modulus
 //  d:  private exponent
+//  crt: CRT components, if the key file has them
+//  returns true if crt was filled, false for a two-field key file
 //
 // Requires:
 //  pvfile: open and readable file stream
+//  crt: initialized with ss_crt_init, or NULL to ignore CRT components
 //  all mpz_t arguments to be initialized
 //
-void ss_read_priv(mpz_t pq, mpz_t d, FILE *pvfile);
+bool ss_read_priv(mpz_t pq, mpz_t d, ss_crt *crt, FILE *pvfile);
 
 //
 // Encrypt number m into number c
@@ -94,18 +379,139 @@ void ss_read_priv(mpz_t pq, mpz_t d, FILE *pvfile);
 //
 void ss_encrypt(mpz_t c, const mpz_t m, const mpz_t n);
 
+//
+// Per-key encryption/decryption state: reduction constants and the
+// exponent recoding are computed once when the context is created, and
+// every call after that only exponentiates. A context keeps scratch of its
+// own, so use one context per thread.
+//
+typedef struct ss_ctx ss_ctx;
+
+//
+// Creates an encryption context from a public key.
+//
+// Requires:
+//  n: public exponent/modulus
+//
+ss_ctx *ss_ctx_create_pub(const mpz_t n);
+
+//
+// Creates a decryption context from a private key.
+//
+// Requires:
+//  d: private exponent
+//  pq: private modulus
+//  crt: CRT components of the private key, or NULL to decrypt mod pq
+//
+ss_ctx *ss_ctx_create_priv(const mpz_t d, const mpz_t pq, const ss_crt *crt);
+
+//
+// Creates an encryption or decryption context, matching the kind of key,
+// straight from a mapped key file. The moduli and Montgomery constants are
+// used in place, so kf must stay open until the context is destroyed.
+//
+ss_ctx *ss_ctx_from_keyfile(const ss_keyfile *kf);
+
+//
+// Frees a context.
+//
+void ss_ctx_destroy(ss_ctx *ctx);
+
+//
+// Same as ss_encrypt, with the key state of a public context.
+//
+void ss_ctx_encrypt(ss_ctx *ctx, mpz_t c, const mpz_t m);
+
+//
+// Same as ss_decrypt/ss_decrypt_crt, with the key state of a private context.
+//
+void ss_ctx_decrypt(ss_ctx *ctx, mpz_t m, const mpz_t c);
+
+//
+// Encrypts count blocks with a public context.
+//
+// Provides:
+//  c: c[i] is the encryption of m[i]
+//
+// Requires:
+//  m: count initialized plaintext integers, left unchanged
+//  c: count initialized mpz_t; c may be the same array as m
+//
+void ss_ctx_encrypt_batch(ss_ctx *ctx, mpz_t *c, mpz_t *m, size_t count);
+
+//
+// Decrypts count blocks with a private context.
+//
+// Provides:
+//  m: m[i] is the decryption of c[i]
+//
+// Requires:
+//  c: count initialized ciphertext integers, left unchanged
+//  m: count initialized mpz_t; m may be the same array as c
+//
+void ss_ctx_decrypt_batch(ss_ctx *ctx, mpz_t *m, mpz_t *c, size_t count);
+
+//
+// Sets file options to their defaults (one thread, hex format).
+//
+void ss_file_opts_init(ss_file_opts *opts);
+
+//
+// Most batches ss_file_opts.depth may put in flight; each holds a whole
+// batch of blocks per worker.
+//
+#define SS_DEPTH_MAX 64
+
+//
+// Parses a pipeline depth.
+//
+// Provides:
+//  depth: the depth, if true is returned
+//  returns false unless arg is a whole number from 1 to SS_DEPTH_MAX
+//
+bool ss_parse_depth(const char *arg, uint32_t *depth);
+
+//
+// Parses an I/O backend name: "uring", "pread" or "stdio".
+//
+// Provides:
+//  io: the backend, if true is returned
+//  returns false for any other name
+//
+bool ss_parse_io(const char *arg, ss_io *io);
+
+//
+// Detects and reads a binary ciphertext header.
+//
+// Provides:
+//  hdr: the header, if one was found
+//  returns true for binary ciphertext; for hex ciphertext returns false and
+//  leaves the stream where it was
+//
+// Requires:
+//  infile: open and readable file stream, positioned at the start of the ciphertext
+//
+bool ss_read_header(FILE *infile, ss_header *hdr);
+
 //
 // Encrypt an arbitrary file
 //
 // Provides:
-//  fills outfile with the encrypted contents of infile
+//  fills outfile with the encrypted contents of infile; the output does not
+//  depend on the number of threads
 //
 // Requires:
 //  infile: open and readable file stream
 //  outfile: open and writable file stream
 //  n: public exponent and modulus
+//  opts: file options, or NULL for the defaults
+//
+void ss_encrypt_file(FILE *infile, FILE *outfile, const mpz_t n, const ss_file_opts *opts);
+
+//
+// Same as ss_encrypt_file, with the key state of a public context.
 //
-void ss_encrypt_file(FILE *infile, FILE *outfile, const mpz_t n);
+void ss_ctx_encrypt_file(ss_ctx *ctx, FILE *infile, FILE *outfile, const ss_file_opts *opts);
 
 //
 // Decrypt number c into number m
@@ -121,16 +527,104 @@ void ss_encrypt_file(FILE *infile, FILE *outfile, const mpz_t n);
 //
 void ss_decrypt(mpz_t m, const mpz_t c, const mpz_t d, const mpz_t pq);
 
+//
+// Decrypt number c into number m using the CRT components of the private key
+//
+// Provides:
+//  m: decrypted/original integer
+//
+// Requires:
+//  c: encrypted integer
+//  crt: CRT components of the private key
+//  all mpz_t arguments to be initialized
+//
+void ss_decrypt_crt(mpz_t m, const mpz_t c, const ss_crt *crt);
+
 //
 // Decrypt a file back into its original form.
 //
 // Provides:
-//  fills outfile with the unencrypted data from infile
+//  fills outfile with the unencrypted data from infile; hex, binary,
+//  hybrid and container ciphertext are told apart by the header, and
+//  container ciphertext must be seekable. Hybrid chunks are only
+//  written once they authenticate; a forged or truncated file exits with an
+//  error, possibly after earlier chunks were written.
 //
 // Requires:
 //  infile: open and readable file stream to encrypted data
 //  outfile: open and writable file stream
 //  d: private exponent
 //  pq: private modulus
+//  crt: CRT components of the private key, or NULL to decrypt mod pq
+//  opts: file options, or NULL for the defaults
+//
+void ss_decrypt_file(FILE *infile, FILE *outfile, const mpz_t d, const mpz_t pq,
+    const ss_crt *crt, const ss_file_opts *opts);
+
+//
+// Same as ss_decrypt_file, with the key state of a private context.
+//
+void ss_ctx_decrypt_file(ss_ctx *ctx, FILE *infile, FILE *outfile, const ss_file_opts *opts);
+
+//
+// Decrypts part of a container (SS_FORMAT_CONTAINER) file.
+//
+// Provides:
+//  fills outfile with plaintext bytes [offset, offset + len), or fewer if
+//  the plaintext ends first; only the blocks covering the range are read
+//  and decrypted
+//
+// Requires:
+//  infile: open, readable and seekable stream to container ciphertext
+//  outfile: open and writable file stream
+//  ctx: private context
+//  opts: file options, or NULL for the defaults
+//
+void ss_ctx_decrypt_range(ss_ctx *ctx, FILE *infile, FILE *outfile, uint64_t offset, uint64_t len,
+    const ss_file_opts *opts);
+
+//
+// In-memory requests, for callers that pool the blocks of many small
+// requests into shared batches (ssd). A request splits its input into
+// blocks, the caller exponentiates them in place with ss_ctx_encrypt_batch
+// or ss_ctx_decrypt_batch on any context for the same key, and
+// ss_request_finish assembles the output. Malformed input is reported
+// through return values, never by exiting.
+//
+typedef struct ss_request ss_request;
+
+//
+// Starts encrypting len bytes into the binary format (SS_FORMAT_BINARY).
+//
+// Requires:
+//  ctx: public context
+//
+ss_request *ss_request_encrypt(const ss_ctx *ctx, const uint8_t *data, size_t len);
+
+//
+// Starts decrypting hex or binary ciphertext, including containers.
+//
+// Provides:
+//  returns NULL if data is hybrid or compressed ciphertext, has a header
+//  that doesn't match the key, or is cut off
+//
+// Requires:
+//  ctx: private context
+//
+ss_request *ss_request_decrypt(const ss_ctx *ctx, const uint8_t *data, size_t len);
+
+//
+// The blocks to exponentiate in place.
+//
+mpz_t *ss_request_blocks(ss_request *r, size_t *count);
+
+//
+// Assembles the output and frees the request.
+//
+// Provides:
+//  out: the ciphertext or plaintext, freed by the caller with free
+//  len: its length
+//  returns false, with nothing to free, if a decrypted block isn't a valid
+//  block under the key
 //
-void ss_decrypt_file(FILE *infile, FILE *outfile, const mpz_t d, const mpz_t pq);
+bool ss_request_finish(ss_request *r, uint8_t **out, size_t *len);
@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "randstate.h"
+#include "arena.h"
+#include "numtheory.h"
+#include "ss.h"
+#include "pool.h"
+#include "powm.h"
+#include "mbpowm.h"
+
+#define OPTIONS "hjbHmNAk:p:t:q:i:s:l:o:"
+
+#define MAX_SIZES 32
+
+// seconds on the monotonic clock
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// parses a comma-separated list of sizes, each optionally suffixed with K or M
+static int parse_sizes(const char *arg, uint64_t *sizes) {
+    int count = 0;
+    char *end;
+
+    while (*arg != '\0' && count < MAX_SIZES) {
+        uint64_t v = strtoull(arg, &end, 10);
+        if (*end == 'K' || *end == 'k')
+            v <<= 10, end++;
+        else if (*end == 'M' || *end == 'm')
+            v <<= 20, end++;
+        sizes[count++] = v > 0 ? v : 1;
+
+        if (*end != ',')
+            break;
+        arg = end + 1;
+    }
+
+    return count;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// p-th percentile of sorted samples
+static double percentile(const double *sorted, size_t count, double p) {
+    size_t i = (size_t) (p / 100.0 * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+typedef struct {
+    uint64_t bits;
+    uint64_t payload;
+    double keygen_s;
+    double enc_mbps, dec_mbps;
+    double enc_lat[3], dec_lat[3]; // p50, p90, p99 in microseconds
+    uint64_t gmp_allocs, gmp_mallocs; // GMP allocations, and those that reached malloc
+    bool ok;
+} bench_row;
+
+// times single-block ss_encrypt and ss_decrypt calls on random blocks
+static void block_latency(bench_row *row, const mpz_t n, const mpz_t d, const mpz_t pq,
+    const ss_crt *crt, uint32_t samples) {
+    double *enc = (double *) malloc(samples * sizeof(double));
+    double *dec = (double *) malloc(samples * sizeof(double));
+    mpz_t m, c, r;
+    mpz_inits(m, c, r, NULL);
+
+    // blocks are the size ss_encrypt_file packs: 0xFF followed by k-1 bytes
+    size_t k = (mpz_sizeinbase(n, 2) / 2 - 2) / 8;
+
+    for (uint32_t i = 0; i < samples; i++) {
+        mpz_urandomb(m, state, 8 * (k - 1));
+        mpz_set_ui(r, 0xFF);
+        mpz_mul_2exp(r, r, 8 * (k - 1));
+        mpz_ior(m, m, r);
+
+        double t0 = now();
+        ss_encrypt(c, m, n);
+        double t1 = now();
+        if (crt != NULL)
+            ss_decrypt_crt(r, c, crt);
+        else
+            ss_decrypt(r, c, d, pq);
+        double t2 = now();
+
+        enc[i] = (t1 - t0) * 1e6;
+        dec[i] = (t2 - t1) * 1e6;
+        if (mpz_cmp(r, m) != 0)
+            row->ok = false;
+    }
+
+    qsort(enc, samples, sizeof(double), cmp_double);
+    qsort(dec, samples, sizeof(double), cmp_double);
+    const double pct[3] = { 50, 90, 99 };
+    for (int i = 0; i < 3; i++) {
+        row->enc_lat[i] = percentile(enc, samples, pct[i]);
+        row->dec_lat[i] = percentile(dec, samples, pct[i]);
+    }
+
+    mpz_clears(m, c, r, NULL);
+    free(enc);
+    free(dec);
+}
+
+// runs ss_encrypt_file and ss_decrypt_file over an in-memory payload
+static void file_throughput(bench_row *row, const mpz_t n, const mpz_t d, const mpz_t pq,
+    const ss_crt *crt, const ss_file_opts *opts) {
+    // printable payload, so the hex format round-trips too
+    char *plain = (char *) malloc(row->payload);
+    for (uint64_t i = 0; i < row->payload; i++)
+        plain[i] = ' ' + gmp_urandomm_ui(state, 95);
+
+    char *cipher = NULL, *out = NULL;
+    size_t cipher_len = 0, out_len = 0;
+
+    FILE *infile = fmemopen(plain, row->payload, "r");
+    FILE *outfile = open_memstream(&cipher, &cipher_len);
+    double t0 = now();
+    ss_encrypt_file(infile, outfile, n, opts);
+    fflush(outfile);
+    double t1 = now();
+    fclose(infile);
+    fclose(outfile);
+
+    infile = fmemopen(cipher, cipher_len, "r");
+    outfile = open_memstream(&out, &out_len);
+    double t2 = now();
+    ss_decrypt_file(infile, outfile, d, pq, crt, opts);
+    fflush(outfile);
+    double t3 = now();
+    fclose(infile);
+    fclose(outfile);
+
+    row->enc_mbps = row->payload / (t1 - t0) / 1e6;
+    row->dec_mbps = row->payload / (t3 - t2) / 1e6;
+    if (out_len != row->payload || memcmp(out, plain, row->payload) != 0)
+        row->ok = false;
+
+    free(plain);
+    free(cipher);
+    free(out);
+}
+
+// checks every multi-buffer kernel the CPU has against pow_mod for a^e mod
+// n on random bases, and times both; returns false on any mismatch
+static bool lanes_check(FILE *outfile, uint64_t bits, const char *modulus, const mpz_t n,
+    const mpz_t e, uint32_t samples, bool json, bool *first) {
+    const mbpowm_isa isas[] = { MBPOWM_IFMA, MBPOWM_AVX2 };
+    bool ok = true;
+
+    powm_recoding rec;
+    powm_recode(&rec, e);
+
+    for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); k++) {
+        mbpowm_ctx *ctx = mbpowm_create(n, &rec, isas[k]);
+        if (ctx == NULL)
+            continue;
+
+        mbpowm_scratch *scratch = mbpowm_scratch_create(ctx);
+        uint32_t lanes = mbpowm_lanes(ctx);
+        size_t blocks = (samples + lanes - 1) / lanes * lanes;
+        mpz_t *a = (mpz_t *) malloc(blocks * sizeof(mpz_t));
+        mpz_t *o = (mpz_t *) malloc(blocks * sizeof(mpz_t));
+        mpz_t r;
+        mpz_init(r);
+        for (size_t i = 0; i < blocks; i++) {
+            mpz_inits(a[i], o[i], NULL);
+            mpz_urandomm(a[i], state, n);
+        }
+
+        double t0 = now();
+        for (size_t i = 0; i < blocks; i += lanes)
+            mbpowm(ctx, scratch, o + i, a + i, lanes);
+        double t1 = now();
+
+        bool match = true;
+        for (size_t i = 0; i < blocks; i++) {
+            pow_mod(r, a[i], e, n);
+            match = match && mpz_cmp(r, o[i]) == 0;
+        }
+        double t2 = now();
+        ok = ok && match;
+
+        double lane_us = (t1 - t0) * 1e6 / blocks, scalar_us = (t2 - t1) * 1e6 / blocks;
+        if (json == true)
+            fprintf(outfile,
+                "%s  {\"bits\": %lu, \"modulus\": \"%s\", \"kernel\": \"%s\", \"lanes\": %u, "
+                "\"blocks\": %zu, \"lanes_us\": %.2f, \"scalar_us\": %.2f, \"speedup\": %.2f, "
+                "\"ok\": %s}",
+                *first ? "" : ",\n", bits, modulus, mbpowm_name(ctx), lanes, blocks, lane_us,
+                scalar_us, scalar_us / lane_us, match ? "true" : "false");
+        else
+            fprintf(outfile, "%lu,%s,%s,%u,%zu,%.2f,%.2f,%.2f,%d\n", bits, modulus,
+                mbpowm_name(ctx), lanes, blocks, lane_us, scalar_us, scalar_us / lane_us, match);
+        *first = false;
+        fflush(outfile);
+
+        for (size_t i = 0; i < blocks; i++)
+            mpz_clears(a[i], o[i], NULL);
+        mpz_clear(r);
+        free(a);
+        free(o);
+        mbpowm_scratch_destroy(scratch);
+        mbpowm_destroy(ctx);
+    }
+
+    powm_recoding_clear(&rec);
+    return ok;
+}
+
+// the primitives backend_check compares
+enum { NT_GCD, NT_INVERSE, NT_POW, NT_PRIME, NT_PRIMITIVES };
+static const char *const nt_names[NT_PRIMITIVES] = { "gcd", "mod_inverse", "pow_mod", "is_prime" };
+
+// runs primitive prim of backend b on every input; is_prime sets o[i] to 0 or 1
+static void nt_run(const nt_backend *b, int prim, mpz_t *o, mpz_t *x, mpz_t *y, mpz_t *z,
+    size_t count, uint64_t iters) {
+    for (size_t i = 0; i < count; i++) {
+        if (prim == NT_GCD)
+            b->gcd(o[i], x[i], y[i]);
+        else if (prim == NT_INVERSE)
+            b->mod_inverse(o[i], x[i], y[i]);
+        else if (prim == NT_POW)
+            b->pow_mod(o[i], x[i], z[i], y[i]);
+        else
+            mpz_set_ui(o[i], b->is_prime(x[i], iters));
+    }
+}
+
+// random inputs of about bits bits for primitive prim
+static void nt_inputs(int prim, mpz_t *x, mpz_t *y, mpz_t *z, size_t count, uint64_t bits) {
+    for (size_t i = 0; i < count; i++) {
+        if (prim == NT_GCD) {
+            // every other pair shares a random factor
+            mpz_urandomb(x[i], state, bits);
+            mpz_urandomb(y[i], state, bits);
+            mpz_urandomb(z[i], state, bits / 4 + 1);
+            if (i % 2 == 0) {
+                mpz_mul(x[i], x[i], z[i]);
+                mpz_mul(y[i], y[i], z[i]);
+            }
+        } else if (prim == NT_INVERSE || prim == NT_POW) {
+            // moduli of exactly bits bits, odd and even in turn; many of the
+            // pairs share a factor and have no inverse
+            mpz_urandomb(y[i], state, bits);
+            mpz_setbit(y[i], bits - 1);
+            if (i % 2 == 0)
+                mpz_setbit(y[i], 0);
+            else
+                mpz_clrbit(y[i], 0);
+            mpz_urandomm(x[i], state, y[i]);
+            mpz_urandomb(z[i], state, bits);
+        } else if (i < 4) {
+            mpz_set_ui(x[i], i); // 0 to 3 are special cases in is_prime
+        } else {
+            // a quarter primes, the rest odd numbers that are nearly all composite
+            mpz_urandomb(x[i], state, bits);
+            mpz_setbit(x[i], bits - 1);
+            mpz_setbit(x[i], 0);
+            if (i % 4 == 0)
+                mpz_nextprime(x[i], x[i]);
+        }
+    }
+}
+
+// checks the native and GMP backends of each numtheory primitive against
+// each other on random inputs, and times both; returns false on any mismatch
+static bool backend_check(FILE *outfile, uint64_t bits, uint32_t samples, uint64_t iters,
+    bool json, bool *first) {
+    bool ok = true;
+
+    for (int prim = 0; prim < NT_PRIMITIVES; prim++) {
+        // primes cost dozens of exponentiations each, so is_prime gets fewer inputs
+        size_t count = prim == NT_PRIME ? (samples / 8 > 8 ? samples / 8 : 8) : samples;
+        mpz_t *in = (mpz_t *) malloc(5 * count * sizeof(mpz_t));
+        mpz_t *x = in, *y = in + count, *z = in + 2 * count, *own = in + 3 * count,
+              *gmp = in + 4 * count;
+        for (size_t i = 0; i < 5 * count; i++)
+            mpz_init(in[i]);
+        nt_inputs(prim, x, y, z, count, bits);
+
+        double t0 = now();
+        nt_run(&nt_backend_own, prim, own, x, y, z, count, iters);
+        double t1 = now();
+        nt_run(&nt_backend_gmp, prim, gmp, x, y, z, count, iters);
+        double t2 = now();
+
+        bool match = true;
+        for (size_t i = 0; i < count; i++)
+            match = match && mpz_cmp(own[i], gmp[i]) == 0;
+        ok = ok && match;
+
+        double own_us = (t1 - t0) * 1e6 / count, gmp_us = (t2 - t1) * 1e6 / count;
+        if (json == true)
+            fprintf(outfile,
+                "%s  {\"bits\": %lu, \"primitive\": \"%s\", \"samples\": %zu, \"own_us\": %.2f, "
+                "\"gmp_us\": %.2f, \"speedup\": %.2f, \"active\": \"%s\", \"ok\": %s}",
+                *first ? "" : ",\n", bits, nt_names[prim], count, own_us, gmp_us,
+                own_us / gmp_us, nt_backend_active->name, match ? "true" : "false");
+        else
+            fprintf(outfile, "%lu,%s,%zu,%.2f,%.2f,%.2f,%s,%d\n", bits, nt_names[prim], count,
+                own_us, gmp_us, own_us / gmp_us, nt_backend_active->name, match);
+        *first = false;
+        fflush(outfile);
+
+        for (size_t i = 0; i < 5 * count; i++)
+            mpz_clear(in[i]);
+        free(in);
+    }
+
+    return ok;
+}
+
+static void print_row(FILE *outfile, const bench_row *row, const ss_file_opts *opts, bool json,
+    bool first) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    const char *format = opts->format == SS_FORMAT_BINARY ? "binary"
+                         : opts->format == SS_FORMAT_HYBRID ? "hybrid"
+                                                            : "hex";
+
+    if (json == true) {
+        fprintf(outfile,
+            "%s  {\"bits\": %lu, \"payload_bytes\": %lu, \"threads\": %u, \"format\": \"%s\", "
+            "\"keygen_s\": %.6f, \"encrypt_mbps\": %.4f, \"decrypt_mbps\": %.4f, "
+            "\"encrypt_block_us\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f}, "
+            "\"decrypt_block_us\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f}, "
+            "\"peak_rss_kb\": %ld, \"gmp_allocs\": %lu, \"gmp_mallocs\": %lu, \"ok\": %s}",
+            first ? "" : ",\n", row->bits, row->payload, opts->threads, format, row->keygen_s,
+            row->enc_mbps, row->dec_mbps, row->enc_lat[0], row->enc_lat[1], row->enc_lat[2],
+            row->dec_lat[0], row->dec_lat[1], row->dec_lat[2], usage.ru_maxrss, row->gmp_allocs,
+            row->gmp_mallocs, row->ok ? "true" : "false");
+        return;
+    }
+
+    fprintf(outfile, "%lu,%lu,%u,%s,%.6f,%.4f,%.4f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%ld,%lu,%lu,%d\n",
+        row->bits, row->payload, opts->threads, format, row->keygen_s, row->enc_mbps,
+        row->dec_mbps, row->enc_lat[0], row->enc_lat[1], row->enc_lat[2], row->dec_lat[0],
+        row->dec_lat[1], row->dec_lat[2], usage.ru_maxrss, row->gmp_allocs, row->gmp_mallocs,
+        row->ok);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    bool help = false;
+    bool json = false;
+    bool lanes = false;
+    bool backends = false;
+    bool arena = true;
+
+    uint64_t key_sizes[MAX_SIZES] = { 256, 512, 1024, 2048, 4096 };
+    uint64_t payloads[MAX_SIZES] = { 64 << 10, 1 << 20 };
+    int nkeys = 5, npayloads = 2;
+    uint64_t iters = 50;
+    uint32_t samples = 200;
+    long seed = 2022;
+    char *output_file = NULL;
+
+    ss_file_opts opts;
+    ss_file_opts_init(&opts);
+
+    int optInd = optind + 1;
+
+    // manages user inputs
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': {
+            help = true;
+            break;
+        }
+
+        case 'j': {
+            json = true;
+            break;
+        }
+
+        case 'm': {
+            lanes = true;
+            break;
+        }
+
+        case 'N': {
+            backends = true;
+            break;
+        }
+
+        case 'A': {
+            arena = false;
+            break;
+        }
+
+        case 'b': {
+            opts.format = SS_FORMAT_BINARY;
+            break;
+        }
+
+        case 'H': {
+            opts.format = SS_FORMAT_HYBRID;
+            break;
+        }
+
+        case 'k': {
+            nkeys = parse_sizes(argv[optInd], key_sizes);
+            break;
+        }
+
+        case 'p': {
+            npayloads = parse_sizes(argv[optInd], payloads);
+            break;
+        }
+
+        case 't': {
+            if (pool_parse_threads(argv[optInd], &opts.threads) == false) {
+                fprintf(stderr, "-t: threads must be from 1 to %u\n", pool_max_threads());
+                return 1;
+            }
+            break;
+        }
+
+        case 'q': {
+            if (ss_parse_depth(argv[optInd], &opts.depth) == false) {
+                fprintf(stderr, "-q: depth must be from 1 to %d\n", SS_DEPTH_MAX);
+                return 1;
+            }
+            break;
+        }
+
+        case 'i': {
+            help = help || parse_iters(argv[optInd], &iters) == false;
+            break;
+        }
+
+        case 's': {
+            seed = atoi(argv[optInd]);
+            break;
+        }
+
+        case 'l': {
+            samples = atoi(argv[optInd]);
+            break;
+        }
+
+        case 'o': {
+            output_file = argv[optInd];
+            break;
+        }
+
+        default: {
+            help = true;
+            break;
+        }
+        }
+        optInd = optind + 1;
+    }
+
+    // usage message
+    if (help == true || samples == 0) {
+        printf("SYNOPSIS:\n   Benchmarks SS key generation, encryption and "
+               "decryption.\n\nUSAGE\n   ./ssbench [hjbHmNAk:p:t:q:i:s:l:o:]\n\nOPTIONS\n  "
+               "-h\t\t\tDisplay program help and usage.\n  -j\t\t\tReport JSON instead of CSV.\n  "
+               "-b\t\t\tUse the binary ciphertext format.\n  -H\t\t\tUse the hybrid ciphertext "
+               "format.\n  -m\t\t\tCheck the multi-buffer kernels against pow_mod instead; exits 1 "
+               "on a mismatch.\n  -N\t\t\tCheck the native numtheory primitives against GMP's and "
+               "report the speedup; exits 1 on a mismatch.\n  -A\t\t\tSend GMP allocations to "
+               "malloc instead of the per-thread caches.\n  -k bits,...\t\tKey sizes to sweep "
+               "(default: 256,512,1024,2048,4096).\n  -p bytes,...\t\tPayload sizes, K and M "
+               "suffixes allowed (default: 64K,1M).\n  -t threads\t\tWorker threads for the file "
+               "paths (default: 1).\n  -q depth\t\tBatches in flight between the file path stages "
+               "(default: 3).\n  -i iterations\t\tMiller-Rabin iterations, 'bpsw' or 'auto' "
+               "(default: 50).\n  -s seed\t\tRandom seed (default: 2022).\n  -l samples\t\tBlocks "
+               "timed for latency percentiles (default: 200).\n  -o outfile\t\tOutput file for "
+               "results (default: stdout).\n");
+        return 0;
+    }
+
+    // GMP allocations are counted either way, so -A shows what the caches save
+    arena_install(arena);
+
+    FILE *outfile = stdout;
+
+    // if output file provided, use that instead of stdout
+    if (output_file != NULL) {
+        outfile = fopen(output_file, "w");
+
+        if (outfile == NULL) {
+            printf("%s: No such file or directory\n", output_file);
+            return 0;
+        }
+    }
+
+    if (json == true)
+        fprintf(outfile, "[\n");
+    else if (lanes == true)
+        fprintf(outfile, "bits,modulus,kernel,lanes,blocks,lanes_us,scalar_us,speedup,ok\n");
+    else if (backends == true)
+        fprintf(outfile, "bits,primitive,samples,own_us,gmp_us,speedup,active,ok\n");
+    else
+        fprintf(outfile, "bits,payload_bytes,threads,format,keygen_s,encrypt_mbps,decrypt_mbps,"
+                         "enc_p50_us,enc_p90_us,enc_p99_us,dec_p50_us,dec_p90_us,dec_p99_us,"
+                         "peak_rss_kb,gmp_allocs,gmp_mallocs,ok\n");
+
+    randstate_init(seed);
+    mpz_t p, q, n, d, pq;
+    mpz_inits(p, q, n, d, pq, NULL);
+    ss_crt crt;
+    ss_crt_init(&crt);
+    bool first = true;
+    bool ok = true;
+
+    for (int i = 0; i < nkeys && lanes == true; i++) {
+        ss_make_pub_threads(p, q, n, key_sizes[i], iters, opts.threads);
+        ss_make_priv(d, pq, p, q);
+        ss_make_crt(&crt, d, p, q);
+
+        // the encryption exponent mod n and the CRT decryption exponent mod p
+        ok &= lanes_check(outfile, key_sizes[i], "n", n, n, samples, json, &first);
+        ok &= lanes_check(outfile, key_sizes[i], "p", crt.p, crt.dp, samples, json, &first);
+    }
+
+    for (int i = 0; i < nkeys && backends == true && lanes == false; i++)
+        ok &= backend_check(outfile, key_sizes[i], samples, iters, json, &first);
+
+    for (int i = 0; i < nkeys && lanes == false && backends == false; i++) {
+        bench_row row = { 0 };
+        row.bits = key_sizes[i];
+
+        double t0 = now();
+        ss_make_pub_threads(p, q, n, row.bits, iters, opts.threads);
+        ss_make_priv(d, pq, p, q);
+        ss_make_crt(&crt, d, p, q);
+        row.keygen_s = now() - t0;
+
+        for (int j = 0; j < npayloads; j++) {
+            row.payload = payloads[j];
+            row.ok = true;
+            arena_stats before, after;
+            arena_stats_get(&before);
+            block_latency(&row, n, d, pq, &crt, samples);
+            file_throughput(&row, n, d, pq, &crt, &opts);
+            arena_stats_get(&after);
+            row.gmp_allocs = after.requests - before.requests;
+            row.gmp_mallocs = after.mallocs - before.mallocs;
+            print_row(outfile, &row, &opts, json, first);
+            first = false;
+            fflush(outfile);
+        }
+    }
+
+    if (json == true)
+        fprintf(outfile, "\n]\n");
+
+    randstate_clear();
+    ss_crt_clear(&crt);
+    mpz_clears(p, q, n, d, pq, NULL);
+    fclose(outfile);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,410 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "randstate.h"
+#include "arena.h"
+#include "numtheory.h"
+#include "pool.h"
+#include "ss.h"
+#include "ssdproto.h"
+
+#define OPTIONS "hvn:d:K:S:t:"
+
+// blocks per job of a batch, a multiple of every kernel's lane count
+#define GROUP_BLOCKS 16
+
+// most blocks exponentiated in one batch; requests beyond it wait for the next
+#define BATCH_BLOCKS 4096
+
+// one connection's request, queued for the batcher
+typedef struct job {
+    ss_request *req;
+    bool decrypt;
+    bool done;
+    struct job *next;
+} job;
+
+// coalesces the blocks of every queued request into shared batches
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work; // jobs were queued
+    pthread_cond_t finished; // jobs were completed
+    job *head, *tail;
+
+    pool *workers;
+    ss_ctx **enc, **dec; // a context per worker, NULL without that key
+    mpz_t *batch; // the batch, gathered by swapping blocks in and out
+    mpz_ptr *origin; // where each batch entry was swapped in from
+    size_t fill;
+    bool decrypt; // kind of the batch being filled
+    bool verbose;
+} batcher;
+
+static batcher bt;
+static const char *socket_path = SSD_SOCKET;
+
+// the block range [g * GROUP_BLOCKS, ...) of the batch, on the worker's own context
+static void run_group(void *arg, size_t g, uint32_t worker) {
+    batcher *b = (batcher *) arg;
+    size_t first = g * GROUP_BLOCKS;
+    size_t count = b->fill - first < GROUP_BLOCKS ? b->fill - first : GROUP_BLOCKS;
+
+    if (b->decrypt == true)
+        ss_ctx_decrypt_batch(b->dec[worker], b->batch + first, b->batch + first, count);
+    else
+        ss_ctx_encrypt_batch(b->enc[worker], b->batch + first, b->batch + first, count);
+}
+
+// exponentiates the gathered blocks and swaps the results back into their requests
+static void run_batch(batcher *b) {
+    if (b->fill == 0)
+        return;
+
+    pool_run(b->workers, run_group, b, (b->fill + GROUP_BLOCKS - 1) / GROUP_BLOCKS);
+    for (size_t i = 0; i < b->fill; i++)
+        mpz_swap(b->origin[i], b->batch[i]);
+    b->fill = 0;
+}
+
+// adds every block of the jobs of one kind to batches, running each as it fills
+static void gather(batcher *b, job *jobs, bool decrypt) {
+    b->decrypt = decrypt;
+    for (job *j = jobs; j != NULL; j = j->next) {
+        if (j->decrypt != decrypt)
+            continue;
+
+        size_t count;
+        mpz_t *blocks = ss_request_blocks(j->req, &count);
+        for (size_t i = 0; i < count; i++) {
+            mpz_swap(b->batch[b->fill], blocks[i]);
+            b->origin[b->fill++] = blocks[i];
+            if (b->fill == BATCH_BLOCKS)
+                run_batch(b);
+        }
+    }
+    run_batch(b);
+}
+
+// takes everything queued since the last round, so concurrent requests share batches
+static void *batcher_main(void *arg) {
+    batcher *b = (batcher *) arg;
+
+    while (true) {
+        pthread_mutex_lock(&b->lock);
+        while (b->head == NULL)
+            pthread_cond_wait(&b->work, &b->lock);
+        job *jobs = b->head;
+        b->head = b->tail = NULL;
+        pthread_mutex_unlock(&b->lock);
+
+        size_t requests = 0;
+        for (job *j = jobs; j != NULL; j = j->next)
+            requests++;
+        if (b->verbose == true)
+            fprintf(stderr, "ssd: batching %zu requests\n", requests);
+
+        gather(b, jobs, false);
+        gather(b, jobs, true);
+
+        pthread_mutex_lock(&b->lock);
+        for (job *j = jobs, *next; j != NULL; j = next) {
+            next = j->next;
+            j->done = true;
+        }
+        pthread_cond_broadcast(&b->finished);
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    return NULL;
+}
+
+// queues a request and waits for its blocks to be exponentiated
+static void submit(batcher *b, ss_request *req, bool decrypt) {
+    job j = { req, decrypt, false, NULL };
+
+    pthread_mutex_lock(&b->lock);
+    if (b->tail != NULL)
+        b->tail->next = &j;
+    else
+        b->head = &j;
+    b->tail = &j;
+    pthread_cond_signal(&b->work);
+    while (j.done == false)
+        pthread_cond_wait(&b->finished, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static bool reply_error(int fd, const char *msg) {
+    return ssd_send(fd, SSD_ERROR, (const uint8_t *) msg, strlen(msg));
+}
+
+// serves one client until it hangs up
+static void *conn_main(void *arg) {
+    int fd = (int) (intptr_t) arg;
+    uint8_t code;
+    uint8_t *data;
+    size_t len;
+
+    while (ssd_recv(fd, &code, &data, &len) == true) {
+        bool decrypt = code == SSD_DECRYPT;
+        ss_ctx *ctx = decrypt == true ? (bt.dec != NULL ? bt.dec[0] : NULL)
+                                      : (bt.enc != NULL ? bt.enc[0] : NULL);
+        bool sent;
+
+        if (code != SSD_ENCRYPT && code != SSD_DECRYPT) {
+            sent = reply_error(fd, "unknown request");
+        } else if (ctx == NULL) {
+            sent = reply_error(fd, decrypt ? "no private key loaded" : "no public key loaded");
+        } else {
+            ss_request *req = decrypt == true ? ss_request_decrypt(ctx, data, len)
+                                              : ss_request_encrypt(ctx, data, len);
+            uint8_t *out;
+            size_t out_len;
+
+            if (req == NULL) {
+                sent = reply_error(fd, "unsupported ciphertext (hybrid or compressed, or another key's)");
+            } else {
+                submit(&bt, req, decrypt);
+                if (ss_request_finish(req, &out, &out_len) == true) {
+                    sent = ssd_send(fd, SSD_OK, out, out_len);
+                    free(out);
+                } else {
+                    sent = reply_error(fd, "ciphertext block does not match the private key");
+                }
+            }
+        }
+
+        free(data);
+        if (sent == false)
+            break;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+// makes a context per worker from a key file, keystore entry or text key
+static ss_ctx **load_key(const char *path, const char *key_id, int kind, uint32_t workers,
+    ss_keystore **ks, ss_keyfile **kf) {
+    *ks = NULL;
+    *kf = NULL;
+
+    if (key_id != NULL) {
+        *ks = ss_keystore_open(path);
+        if (*ks == NULL) {
+            printf("%s: Not a keystore\n", path);
+            exit(1);
+        }
+        *kf = ss_keystore_get(*ks, key_id, kind);
+        if (*kf == NULL) {
+            printf("%s: No key %s\n", path, key_id);
+            exit(1);
+        }
+    } else {
+        *kf = ss_keyfile_open(path);
+    }
+
+    ss_ctx **ctx = (ss_ctx **) malloc(workers * sizeof(ss_ctx *));
+    if (*kf != NULL) {
+        if (ss_keyfile_kind(*kf) != kind) {
+            printf("%s: Not a %s key file\n", path, kind == SS_KEY_PUB ? "public" : "private");
+            exit(1);
+        }
+        for (uint32_t i = 0; i < workers; i++)
+            ctx[i] = ss_ctx_from_keyfile(*kf);
+        return ctx;
+    }
+
+    FILE *keyfile = fopen(path, "r");
+    if (keyfile == NULL) {
+        printf("%s: No such file or directory\n", path);
+        exit(1);
+    }
+
+    mpz_t n, d, pq;
+    mpz_inits(n, d, pq, NULL);
+    ss_crt crt;
+    ss_crt_init(&crt);
+    char username[_POSIX_LOGIN_NAME_MAX];
+    bool has_crt = false;
+
+    if (kind == SS_KEY_PUB)
+        ss_read_pub(n, username, keyfile);
+    else
+        has_crt = ss_read_priv(pq, d, &crt, keyfile);
+    fclose(keyfile);
+
+    for (uint32_t i = 0; i < workers; i++)
+        ctx[i] = kind == SS_KEY_PUB ? ss_ctx_create_pub(n)
+                                    : ss_ctx_create_priv(d, pq, has_crt ? &crt : NULL);
+
+    mpz_clears(n, d, pq, NULL);
+    ss_crt_clear(&crt);
+    return ctx;
+}
+
+static void stop(int sig) {
+    (void) sig;
+    unlink(socket_path);
+    _exit(0);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    bool verbose = false;
+    bool help = false;
+
+    char *public_key_file, *private_key_file, *key_id;
+    public_key_file = NULL;
+    private_key_file = NULL;
+    key_id = NULL;
+    uint32_t threads = 1;
+
+    int optInd = optind + 1;
+
+    // manages user inputs
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'v': {
+            verbose = true;
+            break;
+        }
+
+        case 'h': {
+            help = true;
+            break;
+        }
+
+        case 'n': {
+            public_key_file = argv[optInd];
+            break;
+        }
+
+        case 'd': {
+            private_key_file = argv[optInd];
+            break;
+        }
+
+        case 'K': {
+            key_id = argv[optInd];
+            break;
+        }
+
+        case 'S': {
+            socket_path = argv[optInd];
+            break;
+        }
+
+        case 't': {
+            if (pool_parse_threads(argv[optInd], &threads) == false) {
+                fprintf(stderr, "-t: threads must be from 1 to %u\n", pool_max_threads());
+                return 1;
+            }
+            break;
+        }
+
+        default: {
+            help = true;
+            break;
+        }
+        }
+        optInd = optind + 1;
+    }
+
+    // -K takes both halves of one key pair from a keystore
+    if (key_id != NULL && public_key_file != NULL && private_key_file == NULL)
+        private_key_file = public_key_file;
+
+    // usage message
+    if (help == true || (public_key_file == NULL && private_key_file == NULL)) {
+        printf("SYNOPSIS:\n   Serves SS encryption and decryption requests from 'encrypt -S' and "
+               "'decrypt -S',\n   with the keys loaded once and the blocks of concurrent "
+               "requests batched together.\n\nUSAGE\n   ./ssd [hvn:d:K:S:t:]\n\nOPTIONS\n  "
+               "-h\t\t\tDisplay program help and usage.\n  -v\t\t\tLog each batch to stderr.\n  "
+               "-n pbfile\t\tPublic key file, to serve encryption.\n  -d pvfile\t\tPrivate key "
+               "file, to serve decryption.\n  -K id\t\t\tUse key pair id from the keystore given "
+               "by -n.\n  -S socket\t\tUnix socket to listen on (default: ss.sock).\n  -t "
+               "threads\t\tWorker threads for exponentiation (default: 1).\n");
+        return 0;
+    }
+
+    // GMP temporaries come from per-thread caches instead of malloc
+    arena_install(true);
+
+    bt.workers = pool_create(threads);
+    uint32_t nworkers = pool_size(bt.workers);
+    ss_keystore *pub_ks = NULL, *priv_ks = NULL;
+    ss_keyfile *pub_kf = NULL, *priv_kf = NULL;
+    if (public_key_file != NULL)
+        bt.enc = load_key(public_key_file, key_id, SS_KEY_PUB, nworkers, &pub_ks, &pub_kf);
+    if (private_key_file != NULL)
+        bt.dec = load_key(private_key_file, key_id, SS_KEY_PRIV, nworkers, &priv_ks, &priv_kf);
+
+    pthread_mutex_init(&bt.lock, NULL);
+    pthread_cond_init(&bt.work, NULL);
+    pthread_cond_init(&bt.finished, NULL);
+    bt.batch = (mpz_t *) malloc(BATCH_BLOCKS * sizeof(mpz_t));
+    bt.origin = (mpz_ptr *) malloc(BATCH_BLOCKS * sizeof(mpz_ptr));
+    for (size_t i = 0; i < BATCH_BLOCKS; i++)
+        mpz_init(bt.batch[i]);
+    bt.verbose = verbose;
+
+    // the socket can decrypt with the private key, so only its owner may connect
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        printf("%s: Socket path too long\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // a stale socket from an earlier run is replaced, anything else is left alone
+    struct stat st;
+    if (lstat(socket_path, &st) == 0) {
+        if (S_ISSOCK(st.st_mode) == false) {
+            printf("%s: Exists and is not a socket\n", socket_path);
+            return 1;
+        }
+        unlink(socket_path);
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(0077);
+    if (listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0
+        || listen(listener, SOMAXCONN) != 0) {
+        perror(socket_path);
+        return 1;
+    }
+    umask(mask);
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    pthread_t batcher_thread;
+    pthread_create(&batcher_thread, NULL, batcher_main, &bt);
+
+    if (verbose == true)
+        fprintf(stderr, "ssd: listening on %s with %u workers\n", socket_path, nworkers);
+
+    while (true) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        pthread_t conn;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_create(&conn, &attr, conn_main, (void *) (intptr_t) fd);
+        pthread_attr_destroy(&attr);
+    }
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include "ssdproto.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int ssd_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        // MSG_NOSIGNAL: a client that hangs up must not take the daemon down with SIGPIPE
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool ssd_send(int fd, uint8_t code, const uint8_t *data, size_t len) {
+    uint8_t head[SSD_FRAME_HEAD] = { code, 0, 0, 0, (uint8_t) (len >> 24), (uint8_t) (len >> 16),
+        (uint8_t) (len >> 8), (uint8_t) len };
+    return len <= SSD_MAX_PAYLOAD && write_all(fd, head, sizeof(head)) && write_all(fd, data, len);
+}
+
+bool ssd_recv(int fd, uint8_t *code, uint8_t **data, size_t *len) {
+    uint8_t head[SSD_FRAME_HEAD];
+    if (read_all(fd, head, sizeof(head)) == false)
+        return false;
+
+    *code = head[0];
+    *len = ((size_t) head[4] << 24) | ((size_t) head[5] << 16) | ((size_t) head[6] << 8) | head[7];
+    if (*len > SSD_MAX_PAYLOAD)
+        return false;
+
+    *data = (uint8_t *) malloc(*len + 1); // + 1 so error messages can be terminated
+    if (read_all(fd, *data, *len) == false) {
+        free(*data);
+        return false;
+    }
+    return true;
+}
+
+bool ssd_call(const char *path, uint8_t code, FILE *infile, FILE *outfile) {
+    // the whole input goes in one frame
+    size_t len = 0, cap = 1 << 16;
+    uint8_t *data = (uint8_t *) malloc(cap);
+    for (size_t n; (n = fread(data + len, sizeof(uint8_t), cap - len, infile)) > 0;) {
+        len += n;
+        if (len == cap)
+            data = (uint8_t *) realloc(data, cap *= 2);
+    }
+
+    if (len > SSD_MAX_PAYLOAD) {
+        fprintf(stderr, "input is larger than ssd accepts\n");
+        free(data);
+        return false;
+    }
+
+    int fd = ssd_connect(path);
+    if (fd < 0) {
+        fprintf(stderr, "%s: no ssd listening\n", path);
+        free(data);
+        return false;
+    }
+
+    uint8_t reply_code;
+    uint8_t *reply;
+    size_t reply_len;
+    bool ok = ssd_send(fd, code, data, len) && ssd_recv(fd, &reply_code, &reply, &reply_len);
+    close(fd);
+    free(data);
+
+    if (ok == false) {
+        fprintf(stderr, "%s: ssd closed the connection\n", path);
+        return false;
+    }
+
+    if (reply_code != SSD_OK) {
+        reply[reply_len] = '\0';
+        fprintf(stderr, "ssd: %s\n", (char *) reply);
+        free(reply);
+        return false;
+    }
+
+    fwrite(reply, sizeof(uint8_t), reply_len, outfile);
+    free(reply);
+    return true;
+}
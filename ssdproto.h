@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//
+// Framing between the ssd daemon and its clients over a Unix domain socket.
+// Every request and response is a frame: a code byte, three zero bytes and
+// the payload length (big-endian u32), then the payload. A connection may
+// carry any number of requests, each answered in order.
+//
+#define SSD_FRAME_HEAD  8
+#define SSD_MAX_PAYLOAD (64u << 20)
+#define SSD_SOCKET      "ss.sock"
+
+// request codes
+#define SSD_ENCRYPT 1 // payload: plaintext; reply: binary-format ciphertext
+#define SSD_DECRYPT 2 // payload: hex or binary ciphertext; reply: plaintext
+
+// response codes
+#define SSD_OK    0
+#define SSD_ERROR 1 // payload: error message
+
+//
+// Connects to the daemon listening at path.
+//
+// Provides:
+//  returns the socket, or -1 if nothing is listening there
+//
+int ssd_connect(const char *path);
+
+//
+// Writes one frame.
+//
+// Provides:
+//  returns false if the peer has gone away
+//
+bool ssd_send(int fd, uint8_t code, const uint8_t *data, size_t len);
+
+//
+// Reads one frame.
+//
+// Provides:
+//  code: the frame's code
+//  data: the payload, freed by the caller with free
+//  len: its length
+//  returns false at the end of the connection, or on a frame longer than
+//  SSD_MAX_PAYLOAD
+//
+bool ssd_recv(int fd, uint8_t *code, uint8_t **data, size_t *len);
+
+//
+// Client side of one request: sends all of infile, writes the reply to
+// outfile, or the daemon's error to stderr.
+//
+// Provides:
+//  returns false if the request failed
+//
+bool ssd_call(const char *path, uint8_t code, FILE *infile, FILE *outfile);
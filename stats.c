@@ -0,0 +1,53 @@
+#include "stats.h"
+#include "arena.h"
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// report names, in stat_id order; timers are reported in seconds
+static const char *const stat_names[STAT_COUNT] = { "prime_candidates", "prime_sieved",
+    "prime_composite", "mr_rounds", "lucas_tests", "blocks", "bytes_in", "bytes_out", "io_s",
+    "powm_s", "prime_s" };
+
+#ifdef SS_STATS
+
+uint64_t stats_counters[STAT_COUNT];
+
+uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+#endif
+
+bool parse_stats(const char *arg) {
+    return strcmp(arg, "json") == 0;
+}
+
+void stats_report(FILE *out, const char *program) {
+    uint64_t counters[STAT_COUNT] = { 0 };
+    bool enabled = false;
+#ifdef SS_STATS
+    for (int i = 0; i < STAT_COUNT; i++)
+        counters[i] = __atomic_load_n(&stats_counters[i], __ATOMIC_RELAXED);
+    enabled = true;
+#endif
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    arena_stats st;
+    arena_stats_get(&st);
+
+    fprintf(out, "{\"program\": \"%s\", \"enabled\": %s, \"user_s\": %.6f, \"sys_s\": %.6f", program,
+        enabled ? "true" : "false", ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+    for (int i = 0; i < STAT_COUNT; i++) {
+        if (i == STAT_IO_NS || i == STAT_POWM_NS || i == STAT_PRIME_NS)
+            fprintf(out, ", \"%s\": %.6f", stat_names[i], counters[i] / 1e9);
+        else
+            fprintf(out, ", \"%s\": %lu", stat_names[i], (unsigned long) counters[i]);
+    }
+    fprintf(out, ", \"gmp_allocs\": %lu, \"gmp_mallocs\": %lu}\n", (unsigned long) st.requests,
+        (unsigned long) st.mallocs);
+}
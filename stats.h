@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//
+// Hot-path counters and timers, compiled in with make STATS=1 (SS_STATS).
+// Without it the STATS_ macros expand to nothing, so the hot paths carry no
+// trace of them. Counters are summed over every thread with relaxed atomic
+// adds; timers are counters of wall-clock nanoseconds, summed over the
+// threads that ran the timed code, so with several threads (or fewer CPUs
+// than threads) they can exceed the run time.
+//
+typedef enum {
+    STAT_PRIME_CANDIDATES, // odd numbers make_prime and the sieved search looked at
+    STAT_PRIME_SIEVED, // candidates rejected for a small factor
+    STAT_PRIME_COMPOSITE, // candidates is_prime rejected
+    STAT_MR_ROUNDS, // Miller-Rabin rounds, including Baillie-PSW's base 2 test
+    STAT_LUCAS_TESTS, // strong Lucas tests for Baillie-PSW
+    STAT_BLOCKS, // blocks encrypted or decrypted through a context
+    STAT_BYTES_IN, // bytes read by the file paths
+    STAT_BYTES_OUT, // bytes written by the file paths
+    STAT_IO_NS, // time in the file paths' reads and writes
+    STAT_POWM_NS, // time exponentiating blocks and in pow_mod
+    STAT_PRIME_NS, // time in is_prime
+    STAT_COUNT
+} stat_id;
+
+#ifdef SS_STATS
+
+extern uint64_t stats_counters[STAT_COUNT];
+
+// nanoseconds on the monotonic clock
+uint64_t stats_clock(void);
+
+static inline void stats_add(stat_id id, uint64_t n) {
+    __atomic_fetch_add(&stats_counters[id], n, __ATOMIC_RELAXED);
+}
+
+#define STATS_ADD(id, n)   stats_add((id), (n))
+#define STATS_START(t)     uint64_t t = stats_clock()
+#define STATS_STOP(id, t)  stats_add((id), stats_clock() - (t))
+
+#else
+
+#define STATS_ADD(id, n)  ((void) 0)
+#define STATS_START(t)    ((void) 0)
+#define STATS_STOP(id, t) ((void) 0)
+
+#endif
+
+//
+// Parses a --stats argument; "json" is the only format.
+//
+bool parse_stats(const char *arg);
+
+//
+// Writes every counter, plus CPU time and GMP allocation counts, as one JSON
+// object on one line. A build without SS_STATS reports "enabled": false and
+// zero counters, so the report's shape doesn't depend on the build.
+//
+void stats_report(FILE *out, const char *program);